@@ -1,8 +1,17 @@
 #include "APS2.h"
+#include "EndianSwap.h"
+#include "RegisterBatch.h"
+#include "ContentHash.h"
+#include "BinarySequence.h"
 
-APS2::APS2() :  isOpen{false}, channels_(2), samplingRate_{0} {};
+#include <future>
+#include <sys/stat.h>
 
-APS2::APS2(string deviceSerial) :  isOpen{false}, deviceSerial_{deviceSerial}, samplingRate_{0} {
+APS2::APS2() :  isOpen{false}, channels_(2), samplingRate_{0},
+	writeAckInterval_{WRITE_ACK_INTERVAL}, writeWindow_{WRITE_WINDOW}, readWindow_{READ_WINDOW}, uploadSession_{nullptr}, sequenceKnown_{false}, sequenceHash_{0} {};
+
+APS2::APS2(string deviceSerial) :  isOpen{false}, deviceSerial_{deviceSerial}, samplingRate_{0},
+	writeAckInterval_{WRITE_ACK_INTERVAL}, writeWindow_{WRITE_WINDOW}, readWindow_{READ_WINDOW}, uploadSession_{nullptr}, sequenceKnown_{false}, sequenceHash_{0} {
 	channels_.reserve(2);
 	for(size_t ct=0; ct<2; ct++) channels_.push_back(Channel(ct));
 };
@@ -28,6 +37,14 @@ void APS2::connect(shared_ptr<APSEthernet> && ethernetRM) {
 
 		FILE_LOG(logINFO) << "Opened connection to device: " << deviceSerial_;
 
+		//Prime the register shadow with a single block read
+		try {
+			refresh_CSR_shadow();
+		}
+		catch(...) {
+			FILE_LOG(logWARNING) << "Unable to read CSR block; registers will be cached on first access";
+		}
+
 		// TODO: restore state information from file
 	}
 }
@@ -35,6 +52,8 @@ void APS2::connect(shared_ptr<APSEthernet> && ethernetRM) {
 void APS2::disconnect() {
 	if (isOpen) {
 		ethernetRM_->disconnect(deviceSerial_);
+		invalidate_CSR_shadow();
+		invalidate_memory_copies();
 
 		FILE_LOG(logINFO) << "Closed connection to device: " << deviceSerial_;
 
@@ -57,6 +76,8 @@ void APS2::reset(const APS_RESET_MODE_STAT & resetMode /* default SOFT_RESET */)
 	}
 
 	write_command(command, addr, false);
+	invalidate_CSR_shadow();
+	invalidate_memory_copies();
 	// After being reset the board should send an acknowledge packet with status bytes
 	std::this_thread::sleep_for(std::chrono::seconds(4));
 	int retrycnt = 0;
@@ -85,7 +106,8 @@ APS2_STATUS APS2::init(const bool & forceReload, const int & bitFileNum) {
 	check_clocks_status();
 
 	// check if previously initialized
-	uint32_t initReg = read_memory(INIT_STATUS_ADDR, 1)[0];
+	refresh_CSR_shadow();
+	uint32_t initReg = read_register(INIT_STATUS_ADDR);
 	bool initialized = (initReg & 0x1) == 0x1;
 
 	if (!initialized || forceReload) {
@@ -108,11 +130,12 @@ APS2_STATUS APS2::init(const bool & forceReload, const int & bitFileNum) {
 
 		clear_channel_data();
 
-		write_memory_map();
-
-		// write to INIT_STATUS_ADDR to record that init() was run
+		// write the memory map and record that init() was run (INIT_STATUS_ADDR) in one go
+		RegisterBatch batch(*this);
+		write_memory_map(&batch);
 		initReg |= 0x1;
-		write_memory(INIT_STATUS_ADDR, initReg);
+		batch.write_register(INIT_STATUS_ADDR, initReg);
+		batch.flush();
 	}
 
 	return APS2_OK;
@@ -197,15 +220,9 @@ void APS2::store_image(const string & bitFile, const int & position) { /* see he
 	FILE_LOG(logDEBUG1) << "Padding bitfile byte vector with " << padBytes << " bytes.";
 	fileData.resize(fileData.size() + padBytes, 0xff);
 
-	//Copy over the file data to a 32 bit data vector
-	vector<uint32_t> packedData;
-	packedData.resize(fileData.size()/4);
-	memcpy(packedData.data(), fileData.data(), fileData.size());
-
-	//Convert to big endian byte order - basically because it will be byte-swapped again when the packet is serialized
-	for (auto & packet : packedData) {
-		packet = htonl(packet);
-	}
+	//Read the file bytes as big endian 32 bit words so that serializing the packets puts them back in file order
+	vector<uint32_t> packedData(fileData.size()/4);
+	network_to_host(fileData.data(), packedData.data(), packedData.size());
 
 	FILE_LOG(logDEBUG1) << "Bit file is " << packedData.size() << " 32-bit words long";
 
@@ -213,7 +230,7 @@ void APS2::store_image(const string & bitFile, const int & position) { /* see he
 	auto packets = pack_data(addr, packedData, APS_COMMANDS::FPGACONFIG_ACK);
 
 	// send in groups of 20
-	ethernetRM_->send(deviceSerial_, packets, 20);
+	ethernetRM_->send(deviceSerial_, std::move(packets), 20);
 }
 
 int APS2::select_image(const int & bitFileNum) {
@@ -237,6 +254,9 @@ int APS2::program_FPGA(const string & bitFile) {
 	 */
 	store_image(bitFile);
 	int success = select_image(0);
+	//the reconfigured FPGA comes up with fresh registers
+	invalidate_CSR_shadow();
+	invalidate_memory_copies();
 	if (success != 0)
 		return success;
 
@@ -281,37 +301,123 @@ void APS2::clear_channel_data() {
 	}
 }
 
-void APS2::load_sequence_file(const string & seqFile){
-	/*
-	 * Load a sequence file from an H5 file
-	 */
+//Sequence file kept open so the instructions can be read a piece at a time
+//Every HDF5 call, including closing the file, is made holding the HDF5 lock
+class SequenceFile {
+public:
+	SequenceFile(const string & seqFile) : identity(file_identity(seqFile)) {
+		try {
+			std::lock_guard<std::mutex> h5Lock(h5_mutex());
+			FILE_LOG(logINFO) << "Opening sequence file: " << seqFile;
+			file_.openFile(seqFile, H5F_ACC_RDONLY);
+			instructions_ = file_.openDataSet("chan_1/instructions");
+			numInstructions = instructions_.getSpace().getSimpleExtentNpoints();
+		}
+		catch (H5::Exception & e) {
+			close();
+			throw APS2_SEQFILE_FAIL;
+		}
+	}
 
-	//First open the file
-	try {
-		FILE_LOG(logINFO) << "Opening sequence file: " << seqFile;
-		H5::H5File H5SeqFile(seqFile, H5F_ACC_RDONLY);
+	~SequenceFile() {
+		close();
+	}
 
+	//For now assume 2 channel data, TODO: check the channelDataFor attribute
+	vector<short> read_waveform(const int & ch) {
 		const vector<string> chanStrs = {"chan_1", "chan_2"};
-		//For now assume 2 channel data, TODO: check the channelDataFor attribute
-		clear_channel_data();
-		for(int chanct=0; chanct<2; chanct++){
-			//Load the waveform library first
-			string chanStr = chanStrs[chanct];
-			vector<short> waveform = h5array2vector<short>(&H5SeqFile, chanStr + "/waveforms", H5::PredType::NATIVE_INT16);
-			set_waveform(chanct, waveform);
-
-			if (chanct % 2 == 0) {
-				// load instruction data
-				vector<uint64_t> instructions = h5array2vector<uint64_t>(&H5SeqFile, chanStr + "/instructions", H5::PredType::NATIVE_UINT64);
-				write_sequence(instructions);
-			}
+		try {
+			std::lock_guard<std::mutex> h5Lock(h5_mutex());
+			return h5array2vector<short>(&file_, chanStrs[ch] + "/waveforms", H5::PredType::NATIVE_INT16);
+		}
+		catch (H5::Exception & e) {
+			throw APS2_SEQFILE_FAIL;
+		}
+	}
+
+	void read_instructions(const size_t & offset, const size_t & count, uint64_t * buffer) {
+		try {
+			std::lock_guard<std::mutex> h5Lock(h5_mutex());
+			h5array2buffer<uint64_t>(instructions_, offset, count, buffer, H5::PredType::NATIVE_UINT64);
+		}
+		catch (H5::Exception & e) {
+			throw APS2_SEQFILE_FAIL;
+		}
+	}
+
+	size_t numInstructions;
+	//Which file this is and which version of it, so loading it again can be recognised without reading it
+	string identity;
+
+private:
+	static string file_identity(const string & seqFile) {
+		//Path, inode, size and modification time; any rewrite of the file changes at least the last
+		struct stat fileStat;
+		if (stat(seqFile.c_str(), &fileStat) != 0) {
+			return "";
 		}
-		//Close the file
-		H5SeqFile.close();
+		std::ostringstream identity;
+		identity << "hdf5:" << seqFile << ":" << fileStat.st_dev << ":" << fileStat.st_ino << ":" << fileStat.st_size <<
+			":" << fileStat.st_mtime;
+#ifdef __linux__
+		identity << "." << fileStat.st_mtim.tv_nsec;
+#endif
+		return identity.str();
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> h5Lock(h5_mutex());
+		instructions_.close();
+		file_.close();
 	}
-	catch (H5::FileIException & e) {
-		throw APS2_SEQFILE_FAIL;
+
+	H5::H5File file_;
+	H5::DataSet instructions_;
+};
+
+void APS2::load_sequence_file(const string & seqFile){
+	/*
+	 * Load a sequence file from an H5 file
+	 * The waveforms are read whole but the instructions are streamed from the file a chunk at a time, read and packed
+	 * on another thread while the chunks before are sent, so memory use does not grow with the sequence length.
+	 * Binary sequence files are recognised by their magic and loaded from a memory mapping instead.
+	 */
+	if (BinarySequence::is_binary_sequence(seqFile)) {
+		load_binary_sequence_file(seqFile);
+		return;
 	}
+	SequenceFile file(seqFile);
+
+	clear_channel_data();
+	UploadSession session(*this);
+	//The channels are read and prepared in parallel; their HDF5 reads take turns but overlap the other's preparation
+	write_waveforms([this, &file](const int & ch){
+		channels_[ch].set_waveform(file.read_waveform(ch));
+	});
+	write_sequence(file.numInstructions, [&file](const size_t & offset, const size_t & count, uint64_t * buffer){
+		file.read_instructions(offset, count, buffer);
+	}, file.identity);
+	session.flush();
+}
+
+void APS2::load_binary_sequence_file(const string & seqFile){
+	FILE_LOG(logINFO) << "Opening binary sequence file: " << seqFile;
+	BinarySequence file(seqFile);
+
+	clear_channel_data();
+	UploadSession session(*this);
+	write_waveforms([this, &file](const int & ch){
+		vector<uint8_t> markers;
+		channels_[ch].set_waveform(file.read_waveform(ch, markers));
+		channels_[ch].set_markers(markers);
+	});
+	//The stored checksum identifies the instructions without reading them
+	std::ostringstream identity;
+	identity << "binary:" << file.numInstructions << ":" << hexn<16> << file.instructionsChecksum;
+	write_sequence(file.numInstructions, [&file](const size_t & offset, const size_t & count, uint64_t * buffer){
+		file.read_instructions(offset, count, buffer);
+	}, identity.str());
+	session.flush();
 }
 
 void APS2::set_channel_enabled(const int & dac, const bool & enable){
@@ -325,9 +431,9 @@ bool APS2::get_channel_enabled(const int & dac) const{
 void APS2::set_channel_offset(const int & dac, const float & offset){
 	//Update the waveform in driver
 	channels_[dac].set_offset(offset);
-	//Write to device if necessary
-	if (!channels_[dac].waveform_.empty()){
-		write_waveform(dac, channels_[dac].prep_waveform());
+	//Write to device if necessary; in register mode the waveform memory is left alone
+	if (channels_[dac].get_offset_mode() == OFFSET_IN_WAVEFORM && channels_[dac].get_length() > 0){
+		write_waveform(dac);
 	}
 
 	//Update TAZ register
@@ -338,10 +444,24 @@ float APS2::get_channel_offset(const int & dac) const{
 	return channels_[dac].get_offset();
 }
 
+void APS2::set_channel_offset_mode(const int & dac, const OFFSET_MODE & mode){
+	FILE_LOG(logDEBUG) << deviceSerial_ << " setting channel " << dac << " offset mode to " << mode;
+	channels_[dac].set_offset_mode(mode);
+	//Add or remove the offset from the uploaded samples
+	if (channels_[dac].get_length() > 0){
+		write_waveform(dac);
+	}
+	set_offset_register(dac, channels_[dac].get_offset());
+}
+
+OFFSET_MODE APS2::get_channel_offset_mode(const int & dac) const{
+	return channels_[dac].get_offset_mode();
+}
+
 void APS2::set_channel_scale(const int & dac, const float & scale){
 	channels_[dac].set_scale(scale);
-	if (!channels_[dac].waveform_.empty()){
-		write_waveform(dac, channels_[dac].prep_waveform());
+	if (channels_[dac].get_length() > 0){
+		write_waveform(dac);
 	}
 }
 
@@ -351,14 +471,14 @@ float APS2::get_channel_scale(const int & dac) const{
 
 void APS2::set_markers(const int & dac, const vector<uint8_t> & data) {
 	channels_[dac].set_markers(data);
-	// write the waveform data again to add packed marker data
-	write_waveform(dac, channels_[dac].prep_waveform());
+	// write the samples whose marker bits changed
+	write_waveform(dac);
 }
 
 void APS2::set_trigger_source(const TRIGGER_SOURCE & triggerSource){
 	FILE_LOG(logDEBUG) << "Setting trigger source to " << triggerSource;
 
-	uint32_t regVal = read_memory(SEQ_CONTROL_ADDR, 1)[0];
+	uint32_t regVal = read_register(SEQ_CONTROL_ADDR);
 
 	//Set the trigger source bits
 	regVal = (regVal & ~(3 << TRIGSRC_BIT)) | (static_cast<uint32_t>(triggerSource) << TRIGSRC_BIT);
@@ -366,7 +486,7 @@ void APS2::set_trigger_source(const TRIGGER_SOURCE & triggerSource){
 }
 
 TRIGGER_SOURCE APS2::get_trigger_source() {
-	uint32_t regVal = read_memory(SEQ_CONTROL_ADDR, 1)[0];
+	uint32_t regVal = read_register(SEQ_CONTROL_ADDR);
 	return TRIGGER_SOURCE((regVal & (3 << TRIGSRC_BIT)) >> TRIGSRC_BIT);
 }
 
@@ -382,7 +502,7 @@ void APS2::set_trigger_interval(const double & interval){
 
 double APS2::get_trigger_interval() {
 
-	uint32_t clockCycles = read_memory(TRIGGER_INTERVAL_ADDR, 1)[0];
+	uint32_t clockCycles = read_register(TRIGGER_INTERVAL_ADDR);
 	// Convert from clock cycles to time
 	return static_cast<double>(clockCycles + 1)/(0.25*samplingRate_*1e6);
 }
@@ -390,7 +510,7 @@ double APS2::get_trigger_interval() {
 void APS2::trigger(){
 	//Apply a software trigger by toggling the trigger line
 	FILE_LOG(logDEBUG) << "Sending software trigger";
-	uint32_t regVal = read_memory(SEQ_CONTROL_ADDR, 1)[0];
+	uint32_t regVal = read_register(SEQ_CONTROL_ADDR);
 	FILE_LOG(logDEBUG3) << "SEQ_CONTROL register was " << hexn<8> << regVal;
 	regVal ^= (1 << SOFT_TRIG_BIT);
 	FILE_LOG(logDEBUG3) << "Setting SEQ_CONTROL register to " << hexn<8> << regVal;
@@ -455,25 +575,82 @@ void APS2::write_memory(const uint32_t & addr, const vector<uint32_t> & data){
 	//Pack the data into APSEthernetFrames
 	vector<APSEthernetPacket> dataPackets = pack_data(addr, data);
 
-	//Send the packets out
-	ethernetRM_->send(deviceSerial_, dataPackets, 20);
+	//Send the packets out keeping several acknowledge chunks in flight
+	//Only trust the register shadow once the write has been acknowledged
+	bool touchesCSR = (addr < CSR_AXI_OFFSET + 4*NUM_CSR_REGS) && (addr + 4*data.size() > CSR_AXI_OFFSET);
+	if (touchesCSR) {
+		update_CSR_shadow(addr, nullptr, data.size());
+	}
+	int status = ethernetRM_->send(deviceSerial_, std::move(dataPackets), writeAckInterval_, writeWindow_);
+	if (touchesCSR && status == 0) {
+		update_CSR_shadow(addr, data.data(), data.size());
+	}
+
+	//Writing straight into waveform or sequence memory leaves our record of it stale
+	uint32_t endAddr = addr + 4*data.size();
+	if (addr < MEMORY_ADDR+WFB_OFFSET && endAddr > MEMORY_ADDR+WFA_OFFSET) {
+		channels_[0].deviceWords_.clear();
+	}
+	if (addr < MEMORY_ADDR+SEQ_OFFSET && endAddr > MEMORY_ADDR+WFB_OFFSET) {
+		channels_[1].deviceWords_.clear();
+	}
+	if (addr < MEMORY_ADDR+SEQ_OFFSET+8*MAX_LL_LENGTH && endAddr > MEMORY_ADDR+SEQ_OFFSET) {
+		sequenceKnown_ = false;
+	}
 }
 
 vector<uint32_t> APS2::read_memory(const uint32_t & addr, const uint32_t & numWords){
-	//TODO: handle numWords that require mulitple packets
+	//Split the read into packet sized requests
+	vector<APSEthernetPacket> readReqs;
+	for (uint32_t offset = 0; offset < numWords; offset += MAX_PAYLOAD_WORDS) {
+		APSEthernetPacket readReq;
+		readReq.header.command.r_w = 1;
+		readReq.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+		readReq.header.command.cnt = std::min(numWords - offset, MAX_PAYLOAD_WORDS);
+		readReq.header.addr = addr + 4*offset;
+		readReqs.push_back(readReq);
+	}
 
-	//Send the read request
-	APSEthernetPacket readReq;
-	readReq.header.command.r_w = 1;
-	readReq.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
-	readReq.header.command.cnt = numWords;
-	readReq.header.addr = addr;
-	ethernetRM_->send(deviceSerial_, readReq, false);
+	//Issue the requests back-to-back and reassemble the responses by address into the output buffer
+	//A response with less data than was asked for is requested again rather than leaving a hole in the result
+	const unsigned MAX_READ_RETRIES = 3;
+	vector<uint32_t> data(numWords);
+	for (unsigned retries = 0; !readReqs.empty(); retries++) {
+		auto readData = ethernetRM_->query(deviceSerial_, readReqs, readWindow_);
+		vector<APSEthernetPacket> shortReqs;
+		for (size_t ct = 0; ct < readData.size(); ct++) {
+			auto offset = (readReqs[ct].header.addr - addr) / 4;
+			auto count = static_cast<size_t>(readReqs[ct].header.command.cnt);
+			if (readData[ct].payload.size() < count) {
+				FILE_LOG(logWARNING) << "Read of " << count << " words from " << hexn<8> << readReqs[ct].header.addr <<
+					" returned only " << std::dec << readData[ct].payload.size();
+				shortReqs.push_back(readReqs[ct]);
+				continue;
+			}
+			std::copy(readData[ct].payload.begin(), readData[ct].payload.begin() + count, data.begin() + offset);
+		}
+		if (!shortReqs.empty() && retries == MAX_READ_RETRIES) {
+			FILE_LOG(logERROR) << "Giving up on read of " << numWords << " words from " << hexn<8> << addr << " after short responses";
+			throw APS2_RECEIVE_TIMEOUT;
+		}
+		readReqs.swap(shortReqs);
+	}
 
-	//Retrieve the data packet(s)
-	auto readData = read_packets(1);
+	//Anything we just read from the CSR block is the freshest copy we have
+	if ((addr < CSR_AXI_OFFSET + 4*NUM_CSR_REGS) && (addr + 4*numWords > CSR_AXI_OFFSET)) {
+		update_CSR_shadow(addr, data.data(), numWords);
+	}
+
+	return data;
+}
 
-	return readData[0].payload;
+void APS2::set_transfer_window(const unsigned & ackInterval, const unsigned & writeWindow, const unsigned & readWindow) {
+	//Every write chunk has to be acknowledged so lost packets are caught and resent
+	writeAckInterval_ = std::max(ackInterval, 1u);
+	writeWindow_ = std::max(writeWindow, 1u);
+	readWindow_ = std::max(readWindow, 1u);
+	FILE_LOG(logDEBUG) << "Transfer window set to " << writeAckInterval_ << " packets per acknowledge with " <<
+		writeWindow_ << " write chunks and " << readWindow_ << " read requests in flight";
 }
 
 //SPI read/write
@@ -496,7 +673,18 @@ void APS2::write_SPI(vector<uint32_t> & msg) {
 
 uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr) {
 	// reads a single 32-bit word from the target SPI device
+	vector<uint32_t> msg = build_SPI_read_msg(target, addr);
+	if (msg.empty()) {
+		return 0;
+	}
 
+	// write the SPI read instruction
+	write_SPI(msg);
+
+	return read_SPI_response();
+}
+
+vector<uint32_t> APS2::build_SPI_read_msg(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr) {
 	// build message
 	APSChipConfigCommand_t cmd;
 	DACCommand_t dacinstr = {.packed = 0};
@@ -526,7 +714,7 @@ uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & ad
 			break;
 		default:
 			FILE_LOG(logERROR) << "Invalid read_SPI target " << myhex << target;
-			return 0;
+			return {};
 	}
 	cmd.spicnt_data = 1; // request 1 byte
 	vector<uint32_t> msg = {cmd.packed};
@@ -534,10 +722,10 @@ uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & ad
 	msg.push_back(cmd.packed);
 	msg.push_back(cmd.packed);
 	msg.push_back(cmd.packed);
+	return msg;
+}
 
-	// write the SPI read instruction
-	write_SPI(msg);
-
+uint32_t APS2::read_SPI_response() {
 	// build read packet
 	APSEthernetPacket packet;
 	packet.header.command.r_w = 1;
@@ -568,7 +756,7 @@ int APS2::write_flash(const uint32_t & addr, vector<uint32_t> & data) {
 
 	FILE_LOG(logDEBUG) << "Writing " << packets.size() << " packets of data to flash address " << myhex << addr;
 	try {
-		ethernetRM_->send(deviceSerial_, packets);
+		ethernetRM_->send(deviceSerial_, std::move(packets));
 		// APSEthernetPacket p = read_packets(packets.size())[0];
 		// return p.header.command.mode_stat;
 		return 0;
@@ -718,10 +906,8 @@ int APS2::write_command(const APSCommand_t & command, const uint32_t & addr, con
 }
 
 vector<APSEthernetPacket> APS2::pack_data(const uint32_t & addr, const vector<uint32_t> & data, const APS_COMMANDS & cmdtype /* see header for default */) {
-	//Break the data up into ethernet frame sized chunks.
-	// ethernet frame payload = 1500bytes - 20bytes IPV4 and 8 bytes UDP and 24 bytes APS header (with address field) = 1448bytes = 362 words
-	// for unknown reasons, we see occasional failures when using packets that large. 256 seems to be more stable.
-	static const int maxPayload = 256;
+	//Break the data up into ethernet frame sized chunks (see MAX_PAYLOAD_WORDS).
+	static const int maxPayload = MAX_PAYLOAD_WORDS;
 
 	vector<APSEthernetPacket> packets;
 
@@ -958,17 +1144,21 @@ int APS2::test_PLL_sync() {
 				// done with this channel
 				break;
 			} else {
+				uint32_t resets = read_register(RESETS_ADDR);
+				RegisterBatch batch(*this);
 				// disable the channel PLL
-				set_bit(RESETS_ADDR, {CH_PLL_RESET_BIT[ch]});
+				batch.write_register(RESETS_ADDR, resets | (1 << CH_PLL_RESET_BIT[ch]));
 
 				if (ch_phase_deg >= lowPhaseCutoff && ch_phase_deg <= highPhaseCutoff) {
-					// disable then enable the DAC PLL
-					disable_DAC_clock(ch);
-					enable_DAC_clock(ch);
+					// disable then enable the DAC PLL as separate SPI messages so the clock is off for a full round trip
+					batch.write_SPI(build_DAC_clock_msg(ch, false));
+					batch.flush();
+					batch.write_SPI(build_DAC_clock_msg(ch, true));
 				}
 
 				// enable the channel pll
-				clear_bit(RESETS_ADDR, {CH_PLL_RESET_BIT[ch]});
+				batch.write_register(RESETS_ADDR, resets & ~(1 << CH_PLL_RESET_BIT[ch]));
+				batch.flush();
 			}
 			if (ct == MAX_PHASE_TEST_CNT-1) {
 				FILE_LOG(logINFO) << "DAC " << ((ch==0) ? "A" : "B") << " failed to sync";
@@ -1056,25 +1246,24 @@ int APS2::get_PLL_freq() {
 
 void APS2::enable_DAC_clock(const int & dac) {
 	// enables the PLL output to a DAC (0 or 1)
-	const vector<uint16_t> DAC_PLL_ADDR = {0xF0, 0xF1};
-
-	vector<SPI_AddrData_t> enable_msg = {
-		{DAC_PLL_ADDR[dac], 0x00},
-		{0x232, 0x1}
-	};
-	auto msg = build_PLL_SPI_msg(enable_msg);
+	auto msg = build_DAC_clock_msg(dac, true);
 	write_SPI(msg);
 }
 
 void APS2::disable_DAC_clock(const int & dac) {
+	auto msg = build_DAC_clock_msg(dac, false);
+	write_SPI(msg);
+}
+
+vector<uint32_t> APS2::build_DAC_clock_msg(const int & dac, const bool & enable) {
+	// PLL output driver control for a DAC followed by a register update
 	const vector<uint16_t> DAC_PLL_ADDR = {0xF0, 0xF1};
 
-	vector<SPI_AddrData_t> disable_msg = {
-		{DAC_PLL_ADDR[dac], 0x02},
+	vector<SPI_AddrData_t> clock_msg = {
+		{DAC_PLL_ADDR[dac], enable ? 0x00 : 0x02},
 		{0x232, 0x1}
 	};
-	auto msg = build_PLL_SPI_msg(disable_msg);
-	write_SPI(msg);
+	return build_PLL_SPI_msg(clock_msg);
 }
 
 void APS2::setup_VCXO() {
@@ -1099,7 +1288,6 @@ void APS2::setup_DAC(const int & dac)
 {
 
 	uint8_t data;
-	vector<uint32_t> msg;
 	uint8_t SD, MSD, MHD;
 	uint8_t edgeMSD, edgeMHD;
 
@@ -1112,48 +1300,49 @@ void APS2::setup_DAC(const int & dac)
 	const vector<CHIPCONFIG_IO_TARGET> targets = {CHIPCONFIG_TARGET_DAC_0, CHIPCONFIG_TARGET_DAC_1};
 
 	// Step 0: check control clock divider
-	data = read_SPI(targets[dac], DAC_CONTROLLERCLOCK_ADDR);
-	FILE_LOG(logDEBUG1) << "DAC controller clock divider register = " << (data & 0xf);
+	RegisterBatch batch(*this);
+	auto clockDivider = batch.read_SPI(targets[dac], DAC_CONTROLLERCLOCK_ADDR);
 	// Max freq is 1.2GS/s so dividing by 128 gets us below 10MHz for sure
-	msg = build_DAC_SPI_msg(targets[dac], {{DAC_CONTROLLERCLOCK_ADDR, 5}});
-	write_SPI(msg);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_CONTROLLERCLOCK_ADDR, 5}}));
+	batch.flush();
+	FILE_LOG(logDEBUG1) << "DAC controller clock divider register = " << (clockDivider.get() & 0xf);
 
 	disable_DAC_FIFO(dac);
 
 	// Step 1: calibrate and set the LVDS controller.
 	// get initial states of registers
-
-	// TODO: remove int(... & 0x1F)
-	data = read_SPI(targets[dac], DAC_INTERRUPT_ADDR);
-	FILE_LOG(logDEBUG2) <<  "Reg: " << myhex << int(DAC_INTERRUPT_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
-	data = read_SPI(targets[dac], DAC_MSDMHD_ADDR);
-	FILE_LOG(logDEBUG2) <<  "Reg: " << myhex << int(DAC_MSDMHD_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
-	data = read_SPI(targets[dac], DAC_SD_ADDR);
-	FILE_LOG(logDEBUG2) <<  "Reg: " << myhex << int(DAC_SD_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
+	vector<std::pair<uint8_t, std::future<uint32_t>>> initialRegs;
+	for (uint8_t reg : {DAC_INTERRUPT_ADDR, DAC_MSDMHD_ADDR, DAC_SD_ADDR, DAC_CONTROLLER_ADDR}) {
+		initialRegs.emplace_back(reg, batch.read_SPI(targets[dac], reg));
+	}
 
 	// Ensure that surveilance and auto modes are off
-	data = read_SPI(targets[dac], DAC_CONTROLLER_ADDR);
-	FILE_LOG(logDEBUG2) <<  "Reg: " << myhex << int(DAC_CONTROLLER_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
 	data = 0;
-	msg = build_DAC_SPI_msg(targets[dac], {{DAC_CONTROLLER_ADDR, data}});
-	write_SPI(msg);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_CONTROLLER_ADDR, data}}));
 
 	// Slide the data valid window left (with MSD) and check for the interrupt
 	SD = 0;  //(sample delay nibble, stored in Reg. 5, bits 7:4)
 	MSD = 0; //(setup delay nibble, stored in Reg. 4, bits 7:4)
 	MHD = 0; //(hold delay nibble,  stored in Reg. 4, bits 3:0)
 
-	set_DAC_SD(dac, SD);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_SD_ADDR, ((SD & 0xf) << 4)}}));
+	batch.flush();
+
+	// TODO: remove int(... & 0x1F)
+	for (auto & reg : initialRegs) {
+		FILE_LOG(logDEBUG2) <<  "Reg: " << myhex << int(reg.first & 0x1F) << " Val: " << int(reg.second.get() & 0xFF);
+	}
 
 	for (MSD = 0; MSD < 16; MSD++) {
 		FILE_LOG(logDEBUG2) <<  "Setting MSD: " << int(MSD);
 
 		data = (MSD << 4) | MHD;
-		msg = build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}});
-		write_SPI(msg);
+		batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}}));
 		FILE_LOG(logDEBUG2) <<  "Write Reg: " << myhex << int(DAC_MSDMHD_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
 
-		data = read_SPI(targets[dac], DAC_SD_ADDR);
+		auto sdReg = batch.read_SPI(targets[dac], DAC_SD_ADDR);
+		batch.flush();
+		data = sdReg.get();
 		FILE_LOG(logDEBUG2) <<  "Read Reg: " << myhex << int(DAC_SD_ADDR & 0x1F) << " Val: " << int(data & 0xFF);
 
 		bool check = data & 1;
@@ -1170,10 +1359,11 @@ void APS2::setup_DAC(const int & dac)
 		FILE_LOG(logDEBUG2) <<  "Setting MHD: " << int(MHD);
 
 		data = (MSD << 4) | MHD;
-		msg = build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}});
-		write_SPI(msg);
+		batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}}));
 
-		data = read_SPI(targets[dac], DAC_SD_ADDR);
+		auto sdReg = batch.read_SPI(targets[dac], DAC_SD_ADDR);
+		batch.flush();
+		data = sdReg.get();
 		FILE_LOG(logDEBUG2) << "Read: " << myhex << int(data & 0xFF);
 		bool check = data & 1;
 		FILE_LOG(logDEBUG2) << "Check: " << check;
@@ -1187,11 +1377,12 @@ void APS2::setup_DAC(const int & dac)
 	// Clear MSD and MHD
 	MHD = 0;
 	data = (MSD << 4) | MHD;
-	msg = build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}});
-	write_SPI(msg);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_MSDMHD_ADDR, data}}));
 
 	// Set the optimal sample delay (SD)
-	set_DAC_SD(dac, SD);
+	FILE_LOG(logDEBUG) << "Setting SD = " << int(SD);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_SD_ADDR, ((SD & 0xf) << 4)}}));
+	batch.flush();
 
 	// AD9376 data sheet advises us to enable surveilance and auto modes, but this
 	// has introduced output glitches in limited testing
@@ -1246,15 +1437,16 @@ void APS2::enable_DAC_FIFO(const int & dac) {
 	// set sync bit (Reg 0, bit 2)
 	data = read_SPI(targets[dac], DAC_SYNC_ADDR);
 	data = data | (1 << 2);
-	vector<uint32_t> msg = build_DAC_SPI_msg(targets[dac], {{DAC_SYNC_ADDR, data}});
-	write_SPI(msg);
+	RegisterBatch batch(*this);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_SYNC_ADDR, data}}));
 
 	// clear OFFSET bits
-	msg = build_DAC_SPI_msg(targets[dac], {{DAC_FIFOSTAT_ADDR, 0}});
-	write_SPI(msg);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_FIFOSTAT_ADDR, 0}}));
 
 	// read back FIFO phase to ensure we are in a safe zone
-	data = read_SPI(targets[dac], DAC_FIFOSTAT_ADDR);
+	auto fifoStat = batch.read_SPI(targets[dac], DAC_FIFOSTAT_ADDR);
+	batch.flush();
+	data = fifoStat.get();
 	FILE_LOG(logDEBUG2) << "Read: " << myhex << int(data & 0xFF);
 
 	// phase (FIFOPHASE) is in bits <6:4>
@@ -1269,11 +1461,12 @@ void APS2::enable_DAC_FIFO(const int & dac) {
 	offset = mymod(offset - 2, 4);
 	FILE_LOG(logDEBUG) << "Setting FIFO offset = " << int(offset);
 
-	msg = build_DAC_SPI_msg(targets[dac], {{DAC_FIFOSTAT_ADDR, offset}});
-	write_SPI(msg);
+	batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{DAC_FIFOSTAT_ADDR, offset}}));
 
 	// verify by measuring FIFO offset again
-	data = read_SPI(targets[dac], DAC_FIFOSTAT_ADDR);
+	fifoStat = batch.read_SPI(targets[dac], DAC_FIFOSTAT_ADDR);
+	batch.flush();
+	data = fifoStat.get();
 	data = (data & 0x70) >> 4;
 	FILE_LOG(logDEBUG) << "FIFO phase = " << int(data);
 }
@@ -1316,34 +1509,36 @@ int APS2::run_DAC_BIST(const int & dac, const vector<int16_t> & testVec, vector<
 
 	//Read the BIST signature
 	auto read_BIST_sig = [&](){
-		vector<uint32_t> bistVals;
-		//Read the on-board values first
-		bistVals.push_back(read_memory(FPGA_Reg_Phase1[dac], 1)[0]);
-		FILE_LOG(logDEBUG1) << "FPGA Phase 1 BIST " << hexn<8> << bistVals.back();
-		bistVals.push_back(read_memory(FPGA_Reg_Phase2[dac], 1)[0]);
-		FILE_LOG(logDEBUG1) << "FPGA Phase 2 BIST " << hexn<8> << bistVals.back();
+		//Queue all the reads so the FPGA registers come back together and the DAC register selects ride along with the SPI reads
+		RegisterBatch batch(*this);
+		auto fpgaPhase1 = batch.read_register(FPGA_Reg_Phase1[dac]);
+		auto fpgaPhase2 = batch.read_register(FPGA_Reg_Phase2[dac]);
 
 		//Now the DAC registers
-		//LVDS Phase 1 Reg 17 (SEL1=0; SEL0=0; SIGREAD=1; SYNC_EN=1; LVDS_EN=1)
+		//Reg 17 selects the signature (SEL1/SEL0) with SIGREAD=1; SYNC_EN=1; LVDS_EN=1
 		//Not the BIST byte ordering seems to be backwards to the data sheet
-		write_reg(17, 0x26);
-		bistVals.push_back( (read_reg(18) << 24) | (read_reg(19) << 16) | (read_reg(20) << 8) | read_reg(21) );
-		FILE_LOG(logDEBUG1) << "LVDS Phase 1 BIST " << hexn<8> << bistVals.back();
-
-		//LVDS Phase 2
-		write_reg(17, 0x66);
-		bistVals.push_back( (read_reg(18) << 24) | (read_reg(19) << 16) | (read_reg(20) << 8) | read_reg(21) );
-		FILE_LOG(logDEBUG1) << "LVDS Phase 2 BIST " << hexn<8> << bistVals.back();
-
-		//SYNC Phase 1
-		write_reg(17, 0xA6);
-		bistVals.push_back( (read_reg(18) << 24) | (read_reg(19) << 16) | (read_reg(20) << 8) | read_reg(21) );
-		FILE_LOG(logDEBUG1) << "SYNC Phase 1 BIST " << hexn<8> << bistVals.back();
+		const vector<std::pair<string, uint8_t>> dacSignatures = {
+			{"LVDS Phase 1", 0x26}, {"LVDS Phase 2", 0x66}, {"SYNC Phase 1", 0xA6}, {"SYNC Phase 2", 0xE6}
+		};
+		vector<vector<std::future<uint32_t>>> sigBytes;
+		for (auto & sig : dacSignatures) {
+			batch.write_SPI(build_DAC_SPI_msg(targets[dac], {{17, sig.second}}));
+			sigBytes.push_back({});
+			for (uint16_t reg = 18; reg <= 21; reg++) {
+				sigBytes.back().push_back(batch.read_SPI(targets[dac], reg));
+			}
+		}
+		batch.flush();
 
-		//SYNC Phase 2
-		write_reg(17, 0xE6);
-		bistVals.push_back( (read_reg(18) << 24) | (read_reg(19) << 16) | (read_reg(20) << 8) | read_reg(21) );
-		FILE_LOG(logDEBUG1) << "SYNC Phase 2 BIST " << hexn<8> << bistVals.back();
+		vector<uint32_t> bistVals;
+		bistVals.push_back(fpgaPhase1.get());
+		FILE_LOG(logDEBUG1) << "FPGA Phase 1 BIST " << hexn<8> << bistVals.back();
+		bistVals.push_back(fpgaPhase2.get());
+		FILE_LOG(logDEBUG1) << "FPGA Phase 2 BIST " << hexn<8> << bistVals.back();
+		for (size_t ct = 0; ct < dacSignatures.size(); ct++) {
+			bistVals.push_back( (sigBytes[ct][0].get() << 24) | (sigBytes[ct][1].get() << 16) | (sigBytes[ct][2].get() << 8) | sigBytes[ct][3].get() );
+			FILE_LOG(logDEBUG1) << dacSignatures[ct].first << " BIST " << hexn<8> << bistVals.back();
+		}
 
 		return bistVals;
 	};
@@ -1487,7 +1682,7 @@ int APS2::set_offset_register(const int & dac, const float & offset) {
 	FILE_LOG(logINFO) << "Setting DAC " << dac << "  zero register to " << scaledOffset;
 
 	//Read current value
-	uint32_t val = read_memory(ZERO_OUT_ADDR, 1)[0];
+	uint32_t val = read_register(ZERO_OUT_ADDR);
 
 	//Overwrite the correct bits
 	if (dac == 0) {
@@ -1503,7 +1698,7 @@ int APS2::set_offset_register(const int & dac, const float & offset) {
 }
 
 void APS2::set_bit(const uint32_t & addr, std::initializer_list<int> bits) {
-	uint32_t curReg = read_memory(addr, 1)[0];
+	uint32_t curReg = read_register(addr);
 	for (int bit : bits) {
 		curReg |= (1 << bit);
 	}
@@ -1511,38 +1706,276 @@ void APS2::set_bit(const uint32_t & addr, std::initializer_list<int> bits) {
 }
 
 void APS2::clear_bit(const uint32_t & addr, std::initializer_list<int> bits) {
-	uint32_t curReg = read_memory(addr, 1)[0];
+	uint32_t curReg = read_register(addr);
 	for (int bit : bits) {
 		curReg &= ~(1 << bit);
 	}
 	write_memory(addr, curReg);
 }
 
-void APS2::write_waveform(const int & ch, const vector<int16_t> & wfData) {
+uint32_t APS2::read_register(const uint32_t & addr) {
+	//Serve cacheable CSRs from the shadow and only go to the device on a miss
+	if (is_cached_CSR(addr)) {
+		size_t idx = (addr - CSR_AXI_OFFSET) / 4;
+		if (csrShadowValid_[idx]) {
+			FILE_LOG(logDEBUG3) << "Register " << hexn<8> << addr << " served from shadow";
+			return csrShadow_[idx];
+		}
+	}
+	//read_memory fills in the shadow
+	return read_memory(addr, 1)[0];
+}
+
+void APS2::refresh_CSR_shadow() {
+	//Read the whole CSR block in one go
+	read_memory(CSR_AXI_OFFSET, NUM_CSR_REGS);
+}
+
+void APS2::invalidate_CSR_shadow() {
+	csrShadowValid_.reset();
+}
+
+void APS2::update_CSR_shadow(const uint32_t & addr, const uint32_t * data, size_t numWords) {
+	/*
+	 * Record numWords of register values starting at addr in the shadow, skipping volatile registers.
+	 * Passing a null data pointer invalidates the range instead.
+	 */
+	for (size_t ct = 0; ct < numWords; ct++) {
+		uint32_t regAddr = addr + 4*ct;
+		if (!is_cached_CSR(regAddr)) continue;
+		size_t idx = (regAddr - CSR_AXI_OFFSET) / 4;
+		if (data) {
+			csrShadow_[idx] = data[ct];
+			csrShadowValid_[idx] = true;
+		} else {
+			csrShadowValid_[idx] = false;
+		}
+	}
+}
+
+bool APS2::is_cached_CSR(const uint32_t & addr) {
+	if (addr < CSR_AXI_OFFSET || addr >= CSR_AXI_OFFSET + 4*NUM_CSR_REGS || (addr & 0x3)) {
+		return false;
+	}
+	return std::find(std::begin(VOLATILE_CSR_ADDRS), std::end(VOLATILE_CSR_ADDRS), addr) == std::end(VOLATILE_CSR_ADDRS);
+}
+
+void APS2::write_waveform(const int & ch) {
 	/*Write waveform data to FPGA memory
 	 * ch = channel (0-1)
-	 * wfData = bits 0-13: signed 14-bit waveform data, bits 14-15: marker data
+	 * Queued on any open upload session; otherwise sent here
+	 */
+	auto segments = waveform_segments(ch);
+	if (!segments.empty()) {
+		UploadSession session(*this);
+		for (auto & segment : segments) {
+			session.write_memory(segment.first, std::move(segment.second));
+		}
+		session.flush();
+	}
+}
+
+vector<std::pair<uint32_t, vector<uint32_t>>> APS2::waveform_segments(const int & ch) {
+	/*Work out the blocks of waveform memory that need writing for a channel
+	 * Only the dirty ranges of the channel are prepared. They are compared against the host copy of the device
+	 * memory and only the words that changed are sent, merging runs less than WAVEFORM_MERGE_GAP words apart.
+	 * When the channel's samples, markers, scale and offset hash the same as they did for the copy the device
+	 * already holds the waveform, so nothing is prepared or sent.
+	 * The host copy is brought up to date on the assumption the blocks will be sent; an upload session that fails
+	 * or is never flushed drops it. Only this channel is touched so the two channels can be worked out on different threads.
 	 */
 
 	uint32_t startAddr = (ch == 0) ? MEMORY_ADDR+WFA_OFFSET : MEMORY_ADDR+WFB_OFFSET;
+	Channel & channel = channels_[ch];
+	size_t numWords = channel.get_length() / 2;
+
+	uint64_t hash = channel.waveform_hash();
+	if (numWords > 0 && channel.deviceWords_.size() == numWords && channel.deviceHash_ == hash) {
+		FILE_LOG(logDEBUG2) << "Waveform for channel " << ch << " matches device memory; skipping upload";
+		channel.dirtyWords_.clear();
+		return {};
+	}
 
-	// disable cache
-	write_memory(CACHE_CONTROL_ADDR, 0);
+	//Take the copy out of the channel so a failure part way leaves it unknown
+	vector<uint32_t> deviceWords = std::move(channel.deviceWords_);
+	channel.deviceWords_.clear();
+	size_t knownWords = std::min(deviceWords.size(), numWords);
+	deviceWords.resize(numWords);
+	channel.mark_dirty(2*knownWords, 2*numWords);
+
+	//Find the runs of changed words and bring the copy up to date
+	vector<std::pair<size_t, size_t>> runs;
+	for (auto & range : channel.dirtyWords_) {
+		size_t end = std::min(range.second, numWords);
+		if (range.first >= end) {
+			continue;
+		}
+		vector<uint32_t> words = channel.prep_waveform(range.first, end - range.first);
+		for (size_t idx = range.first; idx < end; idx++) {
+			uint32_t word = words[idx - range.first];
+			if (idx < knownWords && deviceWords[idx] == word) {
+				continue;
+			}
+			deviceWords[idx] = word;
+			if (!runs.empty() && idx <= runs.back().second + WAVEFORM_MERGE_GAP) {
+				runs.back().second = idx + 1;
+			} else {
+				runs.push_back({idx, idx + 1});
+			}
+		}
+	}
+
+	vector<std::pair<uint32_t, vector<uint32_t>>> segments;
+	if (!runs.empty()) {
+		size_t wordsSent = 0;
+		for (auto & run : runs) {
+			segments.push_back({startAddr + 4*run.first, vector<uint32_t>(deviceWords.begin() + run.first, deviceWords.begin() + run.second)});
+			wordsSent += run.second - run.first;
+		}
+		FILE_LOG(logDEBUG2) << "Loading " << wordsSent << " of " << numWords << " waveform words in " << runs.size() <<
+			" ranges at address " << myhex << startAddr;
+	}
+	else {
+		FILE_LOG(logDEBUG2) << "Waveform for channel " << ch << " is already up to date";
+	}
+
+	channel.deviceWords_ = std::move(deviceWords);
+	channel.deviceHash_ = hash;
+	channel.dirtyWords_.clear();
+	return segments;
+}
 
-	FILE_LOG(logDEBUG2) << "Loading waveform of length " << wfData.size() << " at address " << myhex << startAddr;
-	vector<uint32_t> packedData;
-	for (size_t ct=0; ct < wfData.size(); ct += 2) {
-		packedData.push_back(((uint32_t)wfData[ct] << 16) | (uint16_t)wfData[ct+1]);
+void APS2::write_waveforms(const std::function<void(const int &)> & fill) {
+	/*Fill in both channels with fill(ch) and upload them
+	 * Each channel is filled and prepared on its own thread, so reading and converting the two overlap, and the blocks
+	 * of both are then queued on any open upload session (sent here otherwise) to go out in one transfer.
+	 * If either channel fails nothing is queued, but the other may already have brought its host copy up to date,
+	 * so the copies are dropped before rethrowing.
+	 */
+	vector<std::pair<uint32_t, vector<uint32_t>>> segments[2];
+	auto load_channel = [this, &fill, &segments](const int & ch) {
+		fill(ch);
+		segments[ch] = waveform_segments(ch);
+	};
+	//Wait for both channels before touching the copies
+	std::exception_ptr error;
+	auto channel1 = std::async(std::launch::async, load_channel, 1);
+	try {
+		load_channel(0);
+	}
+	catch (...) {
+		error = std::current_exception();
+	}
+	try {
+		channel1.get();
+	}
+	catch (...) {
+		if (!error) {
+			error = std::current_exception();
+		}
+	}
+	if (error) {
+		invalidate_memory_copies();
+		std::rethrow_exception(error);
 	}
-	write_memory(startAddr, packedData);
 
-	// enable cache
-	write_memory(CACHE_CONTROL_ADDR, 1);
+	UploadSession session(*this);
+	for (auto & channelSegments : segments) {
+		for (auto & segment : channelSegments) {
+			session.write_memory(segment.first, std::move(segment.second));
+		}
+	}
+	session.flush();
+}
+
+void APS2::write_memory_ranges(const vector<std::pair<uint32_t, vector<uint32_t>>> & segments) {
+	//Send several blocks of memory in one windowed transfer rather than paying a round trip each
+	vector<APSEthernetPacket> packets;
+	for (auto & segment : segments) {
+		auto segmentPackets = pack_data(segment.first, segment.second);
+		std::move(segmentPackets.begin(), segmentPackets.end(), std::back_inserter(packets));
+	}
+	if (ethernetRM_->send(deviceSerial_, std::move(packets), writeAckInterval_, writeWindow_) != 0) {
+		throw APS2_RECEIVE_TIMEOUT;
+	}
+}
+
+void APS2::invalidate_memory_copies() {
+	for (auto & channel : channels_) {
+		channel.deviceWords_.clear();
+	}
+	sequenceKnown_ = false;
+}
+
+//Instructions are hashed a chunk at a time so streamed and in memory sequences hash the same
+static uint64_t hash_instructions(const uint64_t * data, const size_t & numInstructions, uint64_t hash = 0) {
+	for (size_t ct = 0; ct < numInstructions; ct += SEQUENCE_CHUNK_LENGTH) {
+		hash = content_hash(data + ct, std::min(SEQUENCE_CHUNK_LENGTH, numInstructions - ct)*sizeof(uint64_t), hash);
+	}
+	return hash;
 }
 
 void APS2::write_sequence(const vector<uint64_t> & data) {
+	//Skip the upload when the device already holds this sequence
+	uint64_t hash = hash_instructions(data.data(), data.size());
+	if (sequenceKnown_ && hash == sequenceHash_) {
+		FILE_LOG(logDEBUG2) << "Sequence of length " << data.size() << " matches device memory; skipping upload";
+		return;
+	}
 	FILE_LOG(logDEBUG2) << "Loading sequence of length " << data.size();
 
+	//Queued on any open upload session; otherwise sent here
+	sequenceKnown_ = false;
+	UploadSession session(*this);
+	session.write_memory(MEMORY_ADDR+SEQ_OFFSET, pack_sequence(data));
+	session.flush();
+	sequenceKnown_ = true;
+	sequenceHash_ = hash;
+	sequenceSource_.clear();
+}
+
+void APS2::write_sequence(const size_t & numInstructions, const std::function<void(const size_t &, const size_t &, uint64_t *)> & read,
+	const string & source /* see header for default */) {
+	/*
+	 * Upload a sequence read SEQUENCE_CHUNK_LENGTH instructions at a time by read(offset, count, buffer)
+	 * Each instruction is read once. The chunks are hashed as they are streamed so the record of what sequence
+	 * memory holds is kept up to date, but that hash is only known once everything has been sent. A sequence is
+	 * therefore only skipped when source names the same file as the last streamed upload.
+	 */
+	if (numInstructions == 0) {
+		write_sequence(vector<uint64_t>());
+		return;
+	}
+	if (sequenceKnown_ && !source.empty() && source == sequenceSource_) {
+		FILE_LOG(logDEBUG2) << "Sequence of length " << numInstructions << " from unchanged " << source << " is already loaded; skipping upload";
+		return;
+	}
+	FILE_LOG(logDEBUG2) << "Streaming sequence of length " << numInstructions;
+
+	//The record is made by the producer once it has read everything; a failed send drops it again
+	sequenceKnown_ = false;
+	vector<uint64_t> chunk;
+	size_t offset = 0;
+	uint64_t hash = 0;
+	UploadSession session(*this);
+	session.write_memory_stream(MEMORY_ADDR+SEQ_OFFSET, [this, numInstructions, read, source, chunk, offset, hash](vector<uint32_t> & packed) mutable {
+		chunk.resize(std::min(SEQUENCE_CHUNK_LENGTH, numInstructions - offset));
+		read(offset, chunk.size(), chunk.data());
+		hash = hash_instructions(chunk.data(), chunk.size(), hash);
+		packed = pack_sequence(chunk);
+		offset += chunk.size();
+		if (offset < numInstructions) {
+			return true;
+		}
+		sequenceKnown_ = true;
+		sequenceHash_ = hash;
+		sequenceSource_ = source;
+		return false;
+	});
+	session.flush();
+}
+
+vector<uint32_t> APS2::pack_sequence(const vector<uint64_t> & data) {
 	// pack into uint32_t vector
 	vector<uint32_t> packed_instructions;
 	for (size_t ct = 0; ct < data.size(); ct++) {
@@ -1554,24 +1987,21 @@ void APS2::write_sequence(const vector<uint64_t> & data) {
 	for (size_t ct = 0; ct < padwords; ct++) {
 		packed_instructions.push_back(0);
 	}
-
-	// disable cache
-	write_memory(CACHE_CONTROL_ADDR, 0);
-
-	write_memory(MEMORY_ADDR+SEQ_OFFSET, packed_instructions);
-
-	// enable cache
-	write_memory(CACHE_CONTROL_ADDR, 1);
+	return packed_instructions;
 }
 
-int APS2::write_memory_map(const uint32_t & wfA, const uint32_t & wfB, const uint32_t & seq) { /* see header for defaults */
+int APS2::write_memory_map(RegisterBatch * batch, const uint32_t & wfA, const uint32_t & wfB, const uint32_t & seq) { /* see header for defaults */
 	/* Writes the partitioning of external memory to registers. Takes 3 offsets
-	 * (in bytes) for wfA/B and seq data */
+	 * (in bytes) for wfA/B and seq data
+	 * The writes are queued on batch if given; otherwise they go out immediately as a single packet */
 	FILE_LOG(logDEBUG2) << "Writing memory map with offsets wfA: " << wfA << ", wfB: " << wfB << ", seq: " << seq;
 
-	write_memory(WFA_OFFSET_ADDR, MEMORY_ADDR + wfA);
-	write_memory(WFB_OFFSET_ADDR, MEMORY_ADDR + wfB);
-	write_memory(SEQ_OFFSET_ADDR, MEMORY_ADDR + seq);
+	RegisterBatch localBatch(*this);
+	if (!batch) batch = &localBatch;
+	batch->write_register(WFA_OFFSET_ADDR, MEMORY_ADDR + wfA);
+	batch->write_register(WFB_OFFSET_ADDR, MEMORY_ADDR + wfB);
+	batch->write_register(SEQ_OFFSET_ADDR, MEMORY_ADDR + seq);
+	localBatch.flush();
 
 	return 0;
 }
@@ -12,9 +12,17 @@
 #include "Channel.h"
 #include "APS2_errno.h"
 #include "APS2_enums.h"
+#include "UploadSession.h"
+
+class RegisterBatch;
 
 class APS2 {
 
+	friend class RegisterBatch;
+	friend class UploadSession;
+	//Lets the host side tests in src/test drive the upload bookkeeping without a device
+	friend class APS2TestAccess;
+
 public:
 
 	static const int NUM_CHANNELS = 2;
@@ -59,6 +67,8 @@ public:
 	bool get_channel_enabled(const int &) const;
 	void set_channel_offset(const int &, const float &);
 	float get_channel_offset(const int &) const;
+	void set_channel_offset_mode(const int &, const OFFSET_MODE &);
+	OFFSET_MODE get_channel_offset_mode(const int &) const;
 	void set_channel_scale(const int &, const float &);
 	float get_channel_scale(const int &) const;
 	int set_offset_register(const int &, const float &);
@@ -66,7 +76,7 @@ public:
 	template <typename T>
 	void set_waveform(const int & dac, const vector<T> & data){
 		channels_[dac].set_waveform(data);
-		write_waveform(dac, channels_[dac].prep_waveform());
+		write_waveform(dac);
 	}
 
 	void set_markers(const int &, const vector<uint8_t> &);
@@ -74,9 +84,25 @@ public:
 	void set_run_mode(const RUN_MODE &);
 
 	void write_sequence(const vector<uint64_t> &);
+	//Stream a sequence from read(offset, count, buffer) without holding all of it in memory
+	//source identifies where the instructions come from; the upload is skipped if it matches the last one streamed
+	void write_sequence(const size_t &, const std::function<void(const size_t &, const size_t &, uint64_t *)> &, const string & source = "");
 	void clear_channel_data();
 
+	//Replace both channels' waveforms and the sequence in one upload session
+	template <typename T>
+	void load_sequence(const vector<T> & wfA, const vector<T> & wfB, const vector<uint64_t> & instructions){
+		clear_channel_data();
+		UploadSession session(*this);
+		write_waveforms([this, &wfA, &wfB](const int & ch){
+			channels_[ch].set_waveform(ch == 0 ? wfA : wfB);
+		});
+		write_sequence(instructions);
+		session.flush();
+	}
+
 	void load_sequence_file(const string &);
+	void load_binary_sequence_file(const string &);
 
 	void run();
 	void stop();
@@ -92,10 +118,16 @@ public:
 	static string print_status_bank(const APSStatusBank_t & status);
 	static string printAPSChipCommand(APSChipConfigCommand_t & command);
 
+	//Host side packing into the formats the firmware expects; these do no I/O so they can be timed on their own
+	static vector<APSEthernetPacket> pack_data(const uint32_t &, const vector<uint32_t> &, const APS_COMMANDS & cmdtype = APS_COMMANDS::USERIO_ACK);
+	static vector<uint32_t> pack_sequence(const vector<uint64_t> &);
+
 	//Memory read/write
 	void write_memory(const uint32_t & addr, const vector<uint32_t> & data);
 	void write_memory(const uint32_t & addr, const uint32_t & data);
 	vector<uint32_t> read_memory(const uint32_t &, const uint32_t &);
+	//Tune how many packets go per acknowledge and how many chunks/requests are kept in flight
+	void set_transfer_window(const unsigned &, const unsigned &, const unsigned &);
 
 	//SPI read/write
 	void write_SPI(vector<uint32_t> &);
@@ -134,9 +166,27 @@ private:
 	unsigned samplingRate_;
 	MACAddr macAddr_;
 
+	//Host side shadow of the CSR block so read-modify-writes only cost the write
+	//Kept coherent by write_memory/read_memory and dropped on reset or reprogramming
+	uint32_t csrShadow_[NUM_CSR_REGS];
+	std::bitset<NUM_CSR_REGS> csrShadowValid_;
+
+	//Bulk transfer windowing; defaults to WRITE_ACK_INTERVAL, WRITE_WINDOW and READ_WINDOW
+	unsigned writeAckInterval_;
+	unsigned writeWindow_;
+	unsigned readWindow_;
+
+	//Open upload session that waveform and sequence writes are queued on; null when there is none
+	UploadSession * uploadSession_;
+
+	//Hash of the instructions in sequence memory when sequenceKnown_, and the file they were streamed from if any;
+	//waveform records are kept per Channel
+	bool sequenceKnown_;
+	uint64_t sequenceHash_;
+	string sequenceSource_;
+
 	//Read/Write commands
 	int write_command(const APSCommand_t &, const uint32_t & addr = 0, const bool & checkResponse = true);
-	vector<APSEthernetPacket> pack_data(const uint32_t &, const vector<uint32_t> &, const APS_COMMANDS & cmdtype = APS_COMMANDS::USERIO_ACK);
 	vector<APSEthernetPacket> read_packets(const size_t &);
 
 	int erase_flash(uint32_t, uint32_t);
@@ -148,6 +198,9 @@ private:
 	vector<uint32_t> build_DAC_SPI_msg(const CHIPCONFIG_IO_TARGET &, const vector<SPI_AddrData_t> &);
 	vector<uint32_t> build_PLL_SPI_msg(const vector<SPI_AddrData_t> &);
 	vector<uint32_t> build_VCXO_SPI_msg(const vector<uint8_t> &);
+	vector<uint32_t> build_SPI_read_msg(const CHIPCONFIG_IO_TARGET &, const uint16_t &);
+	uint32_t read_SPI_response();
+	vector<uint32_t> build_DAC_clock_msg(const int &, const bool &);
 
 	// PLL methods
 	int setup_PLL();
@@ -172,9 +225,23 @@ private:
 	void set_bit(const uint32_t &, std::initializer_list<int>);
 	void clear_bit(const uint32_t &, std::initializer_list<int>);
 
-	void write_waveform(const int &, const vector<int16_t> &);
-
-	int write_memory_map(const uint32_t & wfA = WFA_OFFSET, const uint32_t & wfB = WFB_OFFSET, const uint32_t & seq = SEQ_OFFSET);
+	//CSR access through the register shadow
+	uint32_t read_register(const uint32_t &);
+	void refresh_CSR_shadow();
+	void invalidate_CSR_shadow();
+	void update_CSR_shadow(const uint32_t &, const uint32_t *, size_t);
+	static bool is_cached_CSR(const uint32_t &);
+
+	//Upload whatever part of a channel's waveform differs from what the device holds
+	void write_waveform(const int &);
+	vector<std::pair<uint32_t, vector<uint32_t>>> waveform_segments(const int &);
+	//Fill in and upload both channels, working on them in parallel
+	void write_waveforms(const std::function<void(const int &)> &);
+	void write_memory_ranges(const vector<std::pair<uint32_t, vector<uint32_t>>> &);
+	//Forget what waveform and sequence memory hold so the next uploads are complete
+	void invalidate_memory_copies();
+
+	int write_memory_map(RegisterBatch * batch = nullptr, const uint32_t & wfA = WFA_OFFSET, const uint32_t & wfB = WFB_OFFSET, const uint32_t & seq = SEQ_OFFSET);
 
 	int save_state_file(string &);
 	int read_state_file(string &);
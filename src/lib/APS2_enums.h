@@ -10,4 +10,9 @@ enum RUN_STATE {STOPPED=0, PLAYING};
 
 enum HOST_TYPE {APS=0, TDM};
 
+// CHANNEL OFFSET MODES
+// OFFSET_IN_WAVEFORM adds the offset to every sample before upload; OFFSET_IN_REGISTER leaves the
+// waveform memory alone and applies it with the DAC zero register only
+enum OFFSET_MODE {OFFSET_IN_WAVEFORM=0, OFFSET_IN_REGISTER};
+
 #endif
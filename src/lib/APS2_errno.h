@@ -18,7 +18,8 @@ enum APS2_STATUS {
 	APS2_MAC_ADDR_VALIDATION_FAILURE = -13,
 	APS2_IP_ADDR_VALIDATION_FAILURE = -14,
 	APS2_DHCP_VALIDATION_FAILURE = -15,
-	APS2_RECEIVE_TIMEOUT = -16
+	APS2_RECEIVE_TIMEOUT = -16,
+	APS2_INVALID_SEQUENCE = -17
 };
 
 
@@ -29,7 +30,7 @@ enum APS2_STATUS {
 
 static std::map<APS2_STATUS, std::string> messages = {
 	{APS2_UNCONNECTED, "Attempt to run library function on unconnected APS2"},
-	{APS2_SEQFILE_FAIL, "Failed to load HDF5 sequence file. Check it is present and correctly formatted."},
+	{APS2_SEQFILE_FAIL, "Failed to load sequence file. Check it is present and correctly formatted."},
 	{APS2_FILELOG_ERROR, "Unable to open log file."},
 	{APS2_PLL_LOST_LOCK, "The PLL chip has lost its lock.  Try power cycling the module."},
 	{APS2_MMCM_LOST_LOCK, "The FPGA MMCM has lost its lock.  Try resetting the module."},
@@ -40,7 +41,8 @@ static std::map<APS2_STATUS, std::string> messages = {
 	{APS2_MAC_ADDR_VALIDATION_FAILURE, "Failed to validate the update to the MAC address in flash memory."},
 	{APS2_IP_ADDR_VALIDATION_FAILURE, "Failed to validate the update to the IP address in flash memory."},
 	{APS2_DHCP_VALIDATION_FAILURE, "Failed to validate the update to the DHCP enable bit in flash memory."},
-	{APS2_RECEIVE_TIMEOUT, "Timed out while waiting to receive data."}
+	{APS2_RECEIVE_TIMEOUT, "Timed out while waiting to receive data."},
+	{APS2_INVALID_SEQUENCE, "Sequence contains an invalid instruction, jump or waveform address."}
 };
 
 
@@ -1,13 +1,37 @@
 #include "APSEthernet.h"
 
+#include <cstdlib>
+#include <system_error>
+
 #ifdef _WIN32
 #include "iphlpapi.h"
 #else
 #include <ifaddrs.h>
 #endif
 
-APSEthernet::APSEthernet() : socket_(ios_, udp::endpoint(udp::v4(), APS_PROTO)) {
+#ifdef __linux__
+#include <sys/socket.h>
+#include <poll.h>
+#endif
+
+APSEthernet::APSEthernet() : socket_(ios_) {
     FILE_LOG(logDEBUG) << "Creating ethernet interface";
+    socket_.open(udp::v4());
+    //Only share the port when asked to, so aps2_emulator can bind its loopback addresses alongside us. Otherwise a
+    //second process fails to bind rather than silently losing the acknowledges to this one.
+    const char * sharePort = std::getenv("APS2_SHARE_PORT");
+    if (sharePort && string(sharePort) != "0") {
+        FILE_LOG(logINFO) << "APS2_SHARE_PORT is set; sharing the APS2 port with other sockets";
+        socket_.set_option(asio::socket_base::reuse_address(true));
+    }
+    try {
+        socket_.bind(udp::endpoint(udp::v4(), APS_PROTO));
+    }
+    catch (std::system_error & e) {
+        FILE_LOG(logERROR) << "Unable to bind the APS2 port " << APS_PROTO << ": " << e.what() <<
+            "; is another program using the APS2s, or aps2_emulator running without APS2_SHARE_PORT set?";
+        throw;
+    }
     //enable broadcasting for enumerating
     socket_.set_option(asio::socket_base::broadcast(true));
 
@@ -36,40 +60,75 @@ void APSEthernet::setup_receive() {
                 sort_packet(packetData, senderEndpoint_);
             }
 
+            #ifdef __linux__
+            //Pick up the rest of a burst without a trip through the io_service for each packet
+            if (!ec) drain_receive();
+            #endif
+
             //Start the receiver again
             setup_receive();
     });
 }
 
 void APSEthernet::sort_packet(const vector<uint8_t> & packetData, const udp::endpoint & sender) {
+    //Anything too short to parse is dropped here; it must not take down the receive thread
+    if (packetData.size() < APSEthernetPacket::NUM_HEADER_BYTES - 4) {
+        FILE_LOG(logWARNING) << "Dropping runt packet of " << packetData.size() << " bytes from " << sender.address().to_string();
+        return;
+    }
     //If we have the endpoint address then add it to the queue
     string senderIP = sender.address().to_string();
-    if (msgQueues_.find(senderIP) == msgQueues_.end()) {
+    auto msgQueue = get_queue(senderIP);
+    if (!msgQueue) {
         //If it isn't in our list of APSs then perhaps we are seeing an enumerate status response
         //If so add the device info to the set
         if (packetData.size() == 84) {
-            devInfo_[senderIP].endpoint = sender;
             //Turn the byte array into a packet to extract the MAC address and firmware version
             //MAC not strictly necessary as we could just use the broadcast MAC address
             APSEthernetPacket packet = APSEthernetPacket(packetData);
-            devInfo_[senderIP].macAddr = packet.header.src;
             APSStatusBank_t statusRegs;
             std::copy(packet.payload.begin(), packet.payload.end(), statusRegs.array);
+            {
+                std::lock_guard<std::mutex> lock(devInfoLock_);
+                devInfo_[senderIP].endpoint = sender;
+                devInfo_[senderIP].macAddr = packet.header.src;
+            }
             FILE_LOG(logDEBUG1) << "Added device with IP " << senderIP <<
-                " ; MAC addresss " << devInfo_[senderIP].macAddr.to_string() <<
+                " ; MAC addresss " << packet.header.src.to_string() <<
                 " ; firmware version " << hexn<4> << statusRegs.userFirmwareVersion;
         }
     }
     else {
         //Turn the byte array into an APSEthernetPacket
-        APSEthernetPacket packet = APSEthernetPacket(packetData);
-        //Grab a lock and push the packet into the message queue
-        mLock_.lock();
-        msgQueues_[senderIP].emplace(packet);
-        mLock_.unlock();
+        APSEthernetPacket packet;
+        try {
+            packet = APSEthernetPacket(packetData);
+        }
+        catch (APS2_STATUS) {
+            return;
+        }
+        //Grab the device's lock and push the packet into the message queue
+        {
+            std::lock_guard<std::mutex> lock(msgQueue->lock);
+            msgQueue->packets.emplace(std::move(packet));
+        }
+        //Wake up anyone waiting on this device
+        msgQueue->cond.notify_all();
     }
 }
 
+EthernetDevInfo & APSEthernet::get_devInfo(const string & serial) {
+    //Entries are never erased while connected so the reference stays good after the lock is released
+    std::lock_guard<std::mutex> lock(devInfoLock_);
+    return devInfo_[serial];
+}
+
+std::shared_ptr<APSEthernet::DeviceQueue> APSEthernet::get_queue(const string & serial) {
+    std::lock_guard<std::mutex> lock(mLock_);
+    auto iter = msgQueues_.find(serial);
+    return (iter == msgQueues_.end()) ? nullptr : iter->second;
+}
+
 /* PUBLIC methods */
 
 void APSEthernet::init() {
@@ -172,9 +231,7 @@ set<string> APSEthernet::enumerate() {
     vector<std::pair<string,string>> localIPs = get_local_IPs();
 
     for (auto IP : localIPs) {
-        //Skip the loop-back
-        if ( IP.first.compare("127.0.0.1") == 0 ) continue;
-
+        //The loop-back broadcast is kept so emulated APS2s (see DummyAPS) can answer
         //Make sure it is a valid IP
         typedef asio::ip::address_v4 addrv4;
         asio::error_code ec;
@@ -188,13 +245,15 @@ set<string> APSEthernet::enumerate() {
         addrv4 broadcastAddr = addrv4::broadcast(addrv4::from_string(IP.first), addrv4::from_string(IP.second));
         FILE_LOG(logDEBUG1) << "Sending enumerate broadcast out on: " << broadcastAddr.to_string();
         udp::endpoint broadCastEndPoint(broadcastAddr, APS_PROTO);
+        std::lock_guard<std::mutex> lock(socketLock_);
         socket_.send_to(asio::buffer(broadcastPacket.serialize()), broadCastEndPoint);
     }
 
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
     set<string> deviceSerials;
-    for (auto kv : devInfo_) {
+    std::lock_guard<std::mutex> lock(devInfoLock_);
+    for (auto & kv : devInfo_) {
         FILE_LOG(logINFO) << "Found device: " << kv.first;
         deviceSerials.insert(kv.first);
     }
@@ -202,15 +261,30 @@ set<string> APSEthernet::enumerate() {
 }
 
 void APSEthernet::reset_maps() {
-    devInfo_.clear();
-    msgQueues_.clear();
+    //Forget devices seen by earlier enumerates but keep the connected ones;
+    //another thread may be in the middle of talking to them
+    std::lock_guard<std::mutex> queueLock(mLock_);
+    std::lock_guard<std::mutex> devInfoLock(devInfoLock_);
+    for (auto iter = devInfo_.begin(); iter != devInfo_.end(); ) {
+        if (msgQueues_.find(iter->first) == msgQueues_.end()) {
+            iter = devInfo_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
 }
 
 void APSEthernet::connect(string serial) {
-
-    mLock_.lock();
-	msgQueues_[serial] = queue<APSEthernetPacket>();
-    mLock_.unlock();
+    {
+        std::lock_guard<std::mutex> lock(mLock_);
+        auto & msgQueue = msgQueues_[serial];
+        if (!msgQueue) {
+            msgQueue = std::make_shared<DeviceQueue>();
+        }
+        std::lock_guard<std::mutex> queueLock(msgQueue->lock);
+        msgQueue->packets = queue<APSEthernetPacket>();
+    }
+    std::lock_guard<std::mutex> lock(devInfoLock_);
     if (devInfo_.find(serial) == devInfo_.end()) {
         devInfo_[serial].endpoint = udp::endpoint(asio::ip::address_v4::from_string(serial), APS_PROTO);
         devInfo_[serial].macAddr = MACAddr("FF:FF:FF:FF:FF:FF");
@@ -218,125 +292,337 @@ void APSEthernet::connect(string serial) {
 }
 
 void APSEthernet::disconnect(string serial) {
-    mLock_.lock();
-	msgQueues_.erase(serial);
-    mLock_.unlock();
+    std::lock_guard<std::mutex> lock(mLock_);
+    msgQueues_.erase(serial);
 }
 
 int APSEthernet::send(string serial, APSEthernetPacket msg, bool checkResponse) {
-    msg.header.dest = devInfo_[serial].macAddr;
-    return send_chunk(serial, vector<APSEthernetPacket>(1, msg), !checkResponse);
+    if (checkResponse) {
+        return send(serial, vector<APSEthernetPacket>(1, msg), 1);
+    }
+    EthernetDevInfo & devInfo = get_devInfo(serial);
+    msg.header.dest = devInfo.macAddr;
+    msg.header.seqNum = next_seqNum(devInfo);
+    stage_frames(devInfo, 0, &msg, 1);
+    send_frames(devInfo, 0, 1);
+    return 0;
 }
 
-int APSEthernet::send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery /* see header for default */) {
-    //Fill out the destination  MAC address
-    FILE_LOG(logDEBUG3) << "Sending " << msg.size() << " packets to " << serial;
-    auto iter = msg.begin();
+int APSEthernet::send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery, unsigned window /* see header for defaults */) {
+    /*
+     * Send the packets in chunks of ackEvery packets with only the last packet of each chunk requesting an acknowledge.
+     * Up to window chunks are kept in flight. Acknowledges are matched to chunks by sequence number and only the
+     * chunks whose acknowledge goes missing are retransmitted. An acknowledge is only given up on once nothing comes
+     * back or more than REORDER_TOLERANCE later chunks have been acknowledged, so reordering alone causes no resends.
+     * Each chunk is serialized once into its own group of slots in the device's transmit buffer and retransmitted
+     * from there. Pass msg with std::move to avoid copying the packets.
+     */
+    FILE_LOG(logDEBUG3) << "Sending " << msg.size() << " packets to " << serial << " in windows of " << window << " chunks";
+    EthernetDevInfo & devInfo = get_devInfo(serial);
     bool noACK = false;
     if (ackEvery == 0) {
         noACK = true;
         ackEvery = 1;
     }
+    window = std::max(window, 1u);
     // it's nice to have extra status on slow EPROM writes
     bool verbose = (msg[0].header.command.cmd == static_cast<uint32_t>(APS_COMMANDS::EPROMIO));
 
-    vector<APSEthernetPacket> buffer(ackEvery);
-
-    while (iter != msg.end()) {
-
-        //Copy the next chunk into a buffer
-        auto endPoint = iter + ackEvery;
-        if (endPoint > msg.end()) {
-            endPoint = msg.end();
-        }
-        auto chunkSize = std::distance(iter, endPoint);
-        buffer.resize(chunkSize);
-        std::copy(iter, endPoint, buffer.begin());
-
-        for (auto & packet : buffer ) {
-            // insert the target MAC address - not really necessary anymore because UDP does filtering
-            packet.header.dest = devInfo_[serial].macAddr;
-            //NOACK sets the top bit of the command nibble of the command word
-            packet.header.command.cmd |= (1 << 3);
+    for (size_t ct = 0; ct < msg.size(); ct++) {
+        // insert the target MAC address - not really necessary anymore because UDP does filtering
+        msg[ct].header.dest = devInfo.macAddr;
+        //NOACK sets the top bit of the command nibble of the command word
+        msg[ct].header.command.cmd |= (1 << 3);
+        //Apply acknowledge flag to last element of each chunk
+        if (!noACK && ((ct % ackEvery == ackEvery - 1) || (ct == msg.size() - 1))) {
+            msg[ct].header.command.cmd &= ~(1 << 3);
         }
+    }
 
-        //Apply acknowledge flag to last element of chunk
-        if (!noACK) {
-            buffer.back().header.command.cmd &= ~(1 << 3);
+    struct InFlightChunk {
+        size_t slot;
+        size_t numPackets;
+        uint16_t ackSeqNum;
+        unsigned retries;
+        //Acknowledges for chunks sent after this one that came back first
+        unsigned overtaken;
+    };
+    //Kept in the order the acknowledges are expected back
+    std::deque<InFlightChunk> inFlight;
+    size_t nextPacket = 0;
+
+    /*
+     * Retransmit a chunk straight from the transmit buffer; its acknowledge now comes after everything else in flight.
+     * The staged frames get fresh sequence numbers so the device sees its count carry on rather than a skip back to
+     * the old ones.
+     */
+    auto resend = [&](InFlightChunk chunk) {
+        const size_t slotSize = APSEthernetPacket::MAX_NUM_BYTES;
+        for (size_t ct = 0; ct < chunk.numPackets; ct++) {
+            chunk.ackSeqNum = next_seqNum(devInfo);
+            uint8_t * seqNumBytes = &devInfo.txBuffer[(chunk.slot + ct) * slotSize + APSEthernetPacket::SEQ_NUM_OFFSET];
+            seqNumBytes[0] = chunk.ackSeqNum >> 8;
+            seqNumBytes[1] = chunk.ackSeqNum & 0xff;
         }
+        chunk.overtaken = 0;
+        send_frames(devInfo, chunk.slot, chunk.numPackets);
+        inFlight.push_back(chunk);
+    };
+
+    while (nextPacket < msg.size() || !inFlight.empty()) {
+
+        //Top up the window with new chunks
+        while (nextPacket < msg.size() && inFlight.size() < window) {
+            //Find a group of transmit slots not held by a chunk in flight
+            size_t slot = 0;
+            while (std::any_of(inFlight.begin(), inFlight.end(),
+                    [slot](const InFlightChunk & chunk) { return chunk.slot == slot; })) {
+                slot += ackEvery;
+            }
+            InFlightChunk chunk = {slot, std::min(static_cast<size_t>(ackEvery), msg.size() - nextPacket), 0, 0, 0};
+            for (size_t ct = nextPacket; ct < nextPacket + chunk.numPackets; ct++) {
+                msg[ct].header.seqNum = next_seqNum(devInfo);
+            }
+            chunk.ackSeqNum = msg[nextPacket + chunk.numPackets - 1].header.seqNum;
+            stage_frames(devInfo, chunk.slot, &msg[nextPacket], chunk.numPackets);
+            send_frames(devInfo, chunk.slot, chunk.numPackets);
+            nextPacket += chunk.numPackets;
+            if (!noACK) {
+                inFlight.push_back(chunk);
+            }
 
-        auto result = send_chunk(serial, buffer, noACK);
-        if (result != 0) {
-            return result;
+            if (verbose && (nextPacket % 1000 < chunk.numPackets)) {
+                FILE_LOG(logDEBUG) << "Write " << 100*nextPacket/msg.size() << "% complete";
+            }
         }
-        std::advance(iter, chunkSize);
 
-        if (verbose && (std::distance(msg.begin(), iter) % 1000 == 0)) {
-            FILE_LOG(logDEBUG) << "Write " << 100*std::distance(msg.begin(), iter)/msg.size() << "% complete";
+        if (inFlight.empty()) continue;
+
+        //Wait for the next acknowledge
+        try {
+            auto response = receive(serial)[0];
+            //TODO: how to check response mode/stat for success?
+            auto match = std::find_if(inFlight.begin(), inFlight.end(),
+                [&response](const InFlightChunk & chunk) { return chunk.ackSeqNum == response.header.seqNum; });
+            if (match == inFlight.end()) {
+                FILE_LOG(logDEBUG2) << "Ignoring stale acknowledge with sequence number " << response.header.seqNum;
+                continue;
+            }
+            //Older chunks may just have been reordered; only resend those overtaken by too many later acknowledges
+            for (auto chunk = inFlight.begin(); chunk != match; ++chunk) {
+                chunk->overtaken++;
+            }
+            inFlight.erase(match);
+            vector<InFlightChunk> lost;
+            for (auto chunk = inFlight.begin(); chunk != inFlight.end(); ) {
+                if (chunk->overtaken > REORDER_TOLERANCE) {
+                    lost.push_back(*chunk);
+                    chunk = inFlight.erase(chunk);
+                } else {
+                    ++chunk;
+                }
+            }
+            for (auto & chunk : lost) {
+                if (++chunk.retries > MAX_RETRIES) {
+                    return -1;
+                }
+                FILE_LOG(logDEBUG) << "Missing acknowledge for sequence number " << chunk.ackSeqNum << ", retrying ...";
+                resend(chunk);
+            }
+        }
+        catch (APS2_STATUS status) {
+            //Nothing came back so resend the oldest chunk
+            InFlightChunk chunk = inFlight.front();
+            inFlight.pop_front();
+            if (++chunk.retries > MAX_RETRIES) {
+                return -1;
+            }
+            FILE_LOG(logDEBUG) << "No acknowledge received, retrying ...";
+            resend(chunk);
         }
     }
     return 0;
 }
 
-int APSEthernet::send_chunk(string serial, vector<APSEthernetPacket> chunk, bool noACK) {
-
-    unsigned seqNum, retryct = 0;
-
-    while (retryct++ < 3) {
-        seqNum = 0;
-        for (auto packet : chunk) {
-            packet.header.seqNum = seqNum;
-            seqNum++;
-            FILE_LOG(logDEBUG4) << "Packet command: " << print_APSCommand(packet.header.command);
-            socket_.send_to(asio::buffer(packet.serialize()), devInfo_[serial].endpoint);
-            // std::this_thread::sleep_for(std::chrono::microseconds(100));
+vector<APSEthernetPacket> APSEthernet::query(string serial, vector<APSEthernetPacket> requests, unsigned window /* see header for default */) {
+    /*
+     * Pipelined request/response: keep up to window requests outstanding and match each response to its
+     * request by sequence number. Responses are returned in request order.
+     */
+    FILE_LOG(logDEBUG3) << "Sending " << requests.size() << " requests to " << serial << " with " << window << " outstanding";
+    window = std::max(window, 1u);
+
+    vector<APSEthernetPacket> responses(requests.size());
+    unordered_map<uint16_t, size_t> outstanding; // sequence number -> request index
+    size_t nextRequest = 0, numReceived = 0;
+    unsigned retries = 0;
+
+    EthernetDevInfo & devInfo = get_devInfo(serial);
+    auto issue = [&](size_t idx) {
+        requests[idx].header.dest = devInfo.macAddr;
+        requests[idx].header.seqNum = next_seqNum(devInfo);
+        outstanding[requests[idx].header.seqNum] = idx;
+        stage_frames(devInfo, 0, &requests[idx], 1);
+        send_frames(devInfo, 0, 1);
+    };
+
+    while (numReceived < requests.size()) {
+        while (nextRequest < requests.size() && outstanding.size() < window) {
+            issue(nextRequest++);
         }
 
-        if (noACK) break;
-        //Wait for acknowledge
-        //TODO: how to check response mode/stat for success?
         try {
             auto response = receive(serial)[0];
-            break;
+            auto match = outstanding.find(response.header.seqNum);
+            if (match == outstanding.end()) {
+                FILE_LOG(logDEBUG2) << "Ignoring stale response with sequence number " << response.header.seqNum;
+                continue;
+            }
+            responses[match->second] = response;
+            outstanding.erase(match);
+            numReceived++;
         }
-        catch (std::exception& e) {
-            FILE_LOG(logDEBUG) << "No acknowledge received, retrying ...";
+        catch (APS2_STATUS status) {
+            if (++retries > MAX_RETRIES) {
+                throw;
+            }
+            //Reissue whatever is still outstanding under fresh sequence numbers
+            FILE_LOG(logDEBUG) << "Missing " << outstanding.size() << " responses, retrying ...";
+            vector<size_t> missing;
+            for (auto & kv : outstanding) {
+                missing.push_back(kv.second);
+            }
+            outstanding.clear();
+            std::sort(missing.begin(), missing.end());
+            for (auto idx : missing) {
+                issue(idx);
+            }
         }
     }
+    return responses;
+}
 
-    if (retryct == 3) {
-        return -1;
+void APSEthernet::stage_frames(EthernetDevInfo & devInfo, size_t firstSlot, const APSEthernetPacket * packets, size_t numPackets) {
+    //Serialize packets into consecutive slots of the device's transmit buffer
+    //The buffer only ever grows so steady state sends do not allocate
+    const size_t slotSize = APSEthernetPacket::MAX_NUM_BYTES;
+    if (devInfo.txFrameSizes.size() < firstSlot + numPackets) {
+        devInfo.txBuffer.resize((firstSlot + numPackets) * slotSize);
+        devInfo.txFrameSizes.resize(firstSlot + numPackets);
+    }
+    for (size_t ct = 0; ct < numPackets; ct++) {
+        FILE_LOG(logDEBUG4) << "Packet command: " << print_APSCommand(packets[ct].header.command);
+        devInfo.txFrameSizes[firstSlot + ct] = packets[ct].serialize_into(&devInfo.txBuffer[(firstSlot + ct) * slotSize], slotSize);
     }
-    return 0;
 }
 
+void APSEthernet::send_frames(EthernetDevInfo & devInfo, size_t firstSlot, size_t numFrames) {
+    const size_t slotSize = APSEthernetPacket::MAX_NUM_BYTES;
+#ifdef __linux__
+    //Hand the kernel up to MMSG_BATCH frames per system call rather than one send_to per frame
+    mmsghdr msgs[MMSG_BATCH];
+    iovec iovecs[MMSG_BATCH];
+    size_t slot = firstSlot;
+    const size_t lastSlot = firstSlot + numFrames;
+    while (slot < lastSlot) {
+        unsigned batchSize = std::min(lastSlot - slot, static_cast<size_t>(MMSG_BATCH));
+        for (unsigned ct = 0; ct < batchSize; ct++) {
+            iovecs[ct].iov_base = &devInfo.txBuffer[(slot + ct) * slotSize];
+            iovecs[ct].iov_len = devInfo.txFrameSizes[slot + ct];
+            msgs[ct].msg_hdr = msghdr();
+            msgs[ct].msg_hdr.msg_name = devInfo.endpoint.data();
+            msgs[ct].msg_hdr.msg_namelen = devInfo.endpoint.size();
+            msgs[ct].msg_hdr.msg_iov = &iovecs[ct];
+            msgs[ct].msg_hdr.msg_iovlen = 1;
+        }
+        //Datagram sends are atomic in the kernel so concurrent callers on other devices need no lock here
+        int numSent = sendmmsg(socket_.native_handle(), msgs, batchSize, 0);
+        if (numSent < 0) {
+            //asio runs the descriptor non-blocking so wait for room in the send buffer
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd writable = {socket_.native_handle(), POLLOUT, 0};
+                poll(&writable, 1, -1);
+                continue;
+            }
+            if (errno == EINTR) continue;
+            FILE_LOG(logERROR) << "sendmmsg failed: " << strerror(errno);
+            throw std::system_error(errno, std::system_category(), "sendmmsg");
+        }
+        slot += numSent;
+    }
+#else
+    std::lock_guard<std::mutex> lock(socketLock_);
+    for (size_t slot = firstSlot; slot < firstSlot + numFrames; slot++) {
+        socket_.send_to(asio::buffer(&devInfo.txBuffer[slot * slotSize], devInfo.txFrameSizes[slot]), devInfo.endpoint);
+    }
+#endif
+}
+
+#ifdef __linux__
+void APSEthernet::drain_receive() {
+    //Read whatever else is already waiting on the socket in batches of MMSG_BATCH packets per system call
+    mmsghdr msgs[MMSG_BATCH];
+    iovec iovecs[MMSG_BATCH];
+    sockaddr_storage senders[MMSG_BATCH];
+    while (true) {
+        for (unsigned ct = 0; ct < MMSG_BATCH; ct++) {
+            iovecs[ct].iov_base = receiveBatch_[ct];
+            iovecs[ct].iov_len = sizeof(receiveBatch_[ct]);
+            msgs[ct].msg_hdr = msghdr();
+            msgs[ct].msg_hdr.msg_name = &senders[ct];
+            msgs[ct].msg_hdr.msg_namelen = sizeof(senders[ct]);
+            msgs[ct].msg_hdr.msg_iov = &iovecs[ct];
+            msgs[ct].msg_hdr.msg_iovlen = 1;
+        }
+        int numReceived = recvmmsg(socket_.native_handle(), msgs, MMSG_BATCH, MSG_DONTWAIT, nullptr);
+        if (numReceived <= 0) return;
+
+        for (int ct = 0; ct < numReceived; ct++) {
+            if (msgs[ct].msg_len == 0) continue;
+            udp::endpoint sender;
+            memcpy(sender.data(), &senders[ct], msgs[ct].msg_hdr.msg_namelen);
+            sender.resize(msgs[ct].msg_hdr.msg_namelen);
+            vector<uint8_t> packetData(receiveBatch_[ct], receiveBatch_[ct] + msgs[ct].msg_len);
+            sort_packet(packetData, sender);
+        }
+        if (numReceived < static_cast<int>(MMSG_BATCH)) return;
+    }
+}
+#endif
+
+uint16_t APSEthernet::next_seqNum(EthernetDevInfo & devInfo) {
+    //Sequence numbers run continuously per device so acknowledges can be matched to the packet that requested them
+    //Zero restarts the sequence count on the device so skip it on wrap-around
+    if (++devInfo.seqNum == 0) {
+        ++devInfo.seqNum;
+    }
+    return devInfo.seqNum;
+}
 
 vector<APSEthernetPacket> APSEthernet::receive(string serial, size_t numPackets, size_t timeoutMS) {
     //Read the packets coming back in up to the timeout
     //Defaults: receive(string serial, size_t numPackets = 1, size_t timeoutMS = 1000);
-    std::chrono::time_point<std::chrono::steady_clock> start, end;
-
-    start = std::chrono::steady_clock::now();
-    size_t elapsedTime = 0;
+    //Rather than polling we sleep on the device's condition variable and sort_packet wakes us up
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS);
 
     vector<APSEthernetPacket> outVec;
 
-    while (elapsedTime < timeoutMS) {
-        if (!msgQueues_[serial].empty()) {
-            mLock_.lock();
-            outVec.push_back(msgQueues_[serial].front());
-            msgQueues_[serial].pop();
-            mLock_.unlock();
-            FILE_LOG(logDEBUG4) << "Received packet command: " << print_APSCommand(outVec.back().header.command);
-            if (outVec.size() == numPackets) {
-                FILE_LOG(logDEBUG3) << "Received " << numPackets << " packets from " << serial;
-                return outVec;
-            }
+    auto msgQueue = get_queue(serial);
+    if (!msgQueue) {
+        throw APS2_UNCONNECTED;
+    }
+    std::unique_lock<std::mutex> lock(msgQueue->lock);
+    auto & packets = msgQueue->packets;
+
+    while (outVec.size() < numPackets) {
+        if (!msgQueue->cond.wait_until(lock, deadline, [&packets](){ return !packets.empty(); })) {
+            throw APS2_RECEIVE_TIMEOUT;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        end = std::chrono::steady_clock::now();
-        elapsedTime =  std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+        outVec.push_back(std::move(packets.front()));
+        packets.pop();
+        FILE_LOG(logDEBUG4) << "Received packet command: " << print_APSCommand(outVec.back().header.command);
     }
 
-    throw APS2_RECEIVE_TIMEOUT;
+    FILE_LOG(logDEBUG3) << "Received " << numPackets << " packets from " << serial;
+    return outVec;
 }
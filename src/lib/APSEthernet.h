@@ -14,6 +14,10 @@ struct EthernetDevInfo {
 	MACAddr macAddr;
 	udp::endpoint endpoint;
 	uint16_t seqNum;
+	//Reusable transmit buffer of APSEthernetPacket::MAX_NUM_BYTES slots
+	//Frames stay serialized here until their chunk is acknowledged
+	vector<uint8_t> txBuffer;
+	vector<size_t> txFrameSizes;
 };
 
 class APSEthernet {
@@ -28,8 +32,9 @@ public:
 	void connect(string serial);
 	void disconnect(string serial);
 	int send(string serial, APSEthernetPacket msg, bool checkResponse=true);
-	int send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery=1);
+	int send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery=1, unsigned window=1);
 	vector<APSEthernetPacket> receive(string serial, size_t numPackets = 1, size_t timeoutMS = 2000);
+	vector<APSEthernetPacket> query(string serial, vector<APSEthernetPacket> requests, unsigned window=1);
 
 private:
 	APSEthernet(APSEthernet const &) = delete;
@@ -37,18 +42,41 @@ private:
 	MACAddr srcMAC_;
 
 	//Keep track of all the device info with a map from I.P. addresses to devInfo structs
+	//devInfoLock_ guards the map itself; an entry's transmit state belongs to whoever holds the device's lock
 	unordered_map<string, EthernetDevInfo> devInfo_;
-
-	unordered_map<string, queue<APSEthernetPacket>> msgQueues_;
+	std::mutex devInfoLock_;
+
+	//Received packets for a connected device
+	//Each queue has its own lock so the receive thread and callers on other devices do not contend
+	struct DeviceQueue {
+		std::mutex lock;
+		//Wake up threads waiting in receive as soon as a packet is sorted into the queue
+		std::condition_variable cond;
+		queue<APSEthernetPacket> packets;
+	};
+	//mLock_ guards the map; receive holds on to the shared_ptr so a disconnect does not pull the queue out from under it
+	unordered_map<string, std::shared_ptr<DeviceQueue>> msgQueues_;
 
 	vector<std::pair<string,string>> get_local_IPs();
 
 	void reset_maps();
+	EthernetDevInfo & get_devInfo(const string &);
+	std::shared_ptr<DeviceQueue> get_queue(const string &);
 
 	void setup_receive();
 	void sort_packet(const vector<uint8_t> &, const udp::endpoint &);
 
-	int send_chunk(string, vector<APSEthernetPacket>, bool);
+	void stage_frames(EthernetDevInfo &, size_t, const APSEthernetPacket *, size_t);
+	void send_frames(EthernetDevInfo &, size_t, size_t);
+#ifdef __linux__
+	void drain_receive();
+#endif
+	uint16_t next_seqNum(EthernetDevInfo &);
+
+	//Number of times an unacknowledged chunk is resent before giving up
+	static const unsigned MAX_RETRIES = 3;
+	//Later chunks that may be acknowledged before a chunk's acknowledge is taken as lost
+	static const unsigned REORDER_TOLERANCE = 1;
 
 	asio::io_service ios_;
 	udp::socket socket_;
@@ -57,8 +85,16 @@ private:
  	uint8_t receivedData_[2048];
 	udp::endpoint senderEndpoint_;
 
+#ifdef __linux__
+	//Number of frames handed to sendmmsg/recvmmsg per system call
+	static const unsigned MMSG_BATCH = 32;
+	uint8_t receiveBatch_[MMSG_BATCH][2048];
+#endif
+
 	std::thread receiveThread_;
 	std::mutex mLock_;
+	//Serializes writes to the shared socket that go through asio
+	std::mutex socketLock_;
 };
 
 
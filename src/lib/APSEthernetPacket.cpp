@@ -1,4 +1,6 @@
 #include "APSEthernetPacket.h"
+#include "EndianSwap.h"
+#include "APS2_errno.h"
 
 APSEthernetPacket::APSEthernetPacket() : header{{}, {}, APS_PROTO, 0, {0}, 0}, payload(0){};
 
@@ -11,7 +13,12 @@ APSEthernetPacket::APSEthernetPacket(const MACAddr & destMAC, const MACAddr & sr
 APSEthernetPacket::APSEthernetPacket(const vector<uint8_t> & packetData){
 	/*
 	Create a packet from a byte array returned by pcap.
+	Runt datagrams too short for their header are logged and rejected with APS2_UNKNOWN_ERROR.
 	*/
+	if (packetData.size() < NUM_HEADER_BYTES - 4) {
+		FILE_LOG(logWARNING) << "Dropping runt packet of " << packetData.size() << " bytes";
+		throw APS2_UNKNOWN_ERROR;
+	}
 	//Helper function to turn two network bytes into a uint16_t or uint32_t assuming big-endian network byte order
 	auto bytes2uint16 = [&packetData](size_t offset) -> uint16_t {return (packetData[offset] << 8) + packetData[offset+1];};
 	auto bytes2uint32 = [&packetData](size_t offset) -> uint32_t {return (packetData[offset] << 24) + (packetData[offset+1] << 16) + (packetData[offset+2] << 8) + packetData[offset+3] ;};
@@ -19,36 +26,49 @@ APSEthernetPacket::APSEthernetPacket(const vector<uint8_t> & packetData){
 	std::copy(packetData.begin(), packetData.begin()+6, header.dest.addr.begin());
 	std::copy(packetData.begin()+6, packetData.begin()+12, header.src.addr.begin());
 	header.frameType = bytes2uint16(12);
-	header.seqNum = bytes2uint16(14);
+	header.seqNum = bytes2uint16(SEQ_NUM_OFFSET);
 	header.command.packed = bytes2uint32(16);
 
 	size_t myOffset;
 	//not all return packets have an address; if-block on command type and whether it is an acknowledge
-	if (!header.command.ack && needs_address(APS_COMMANDS(header.command.cmd))){
+	if (has_address()){
+		if (packetData.size() < NUM_HEADER_BYTES) {
+			FILE_LOG(logWARNING) << "Dropping runt packet of " << packetData.size() << " bytes with no address word";
+			throw APS2_UNKNOWN_ERROR;
+		}
 		header.addr = bytes2uint32(20);
 		myOffset = 24;
 	}
 	else{
 		myOffset = 20;
 	}
-	payload.clear();
-	payload.reserve((packetData.size() - myOffset)/4);
-	while(myOffset < packetData.size()){
-		payload.push_back(bytes2uint32(myOffset));
-		myOffset += 4;
-	}
+	//Bulk convert the payload out of network byte order
+	payload.resize((packetData.size() - myOffset)/4);
+	network_to_host(packetData.data() + myOffset, payload.data(), payload.size());
 }
 
 vector<uint8_t> APSEthernetPacket::serialize() const {
 	/*
 	 * Serialize a packet to a vector of bytes for transmission.
+	 */
+	vector<uint8_t> outVec(numBytes());
+	serialize_into(outVec.data(), outVec.size());
+	return outVec;
+}
+
+size_t APSEthernetPacket::serialize_into(uint8_t * buffer, size_t bufferSize) const {
+	/*
+	 * Serialize a packet into a caller provided buffer and return the number of bytes written.
 	 * Handle host to network byte ordering here
 	 */
-	vector<uint8_t> outVec;
-	outVec.resize(numBytes(), 0);
+	size_t frameSize = numBytes();
+	if (frameSize > bufferSize) {
+		FILE_LOG(logERROR) << "Buffer of " << bufferSize << " bytes too small to serialize " << frameSize << " byte packet";
+		throw runtime_error("Buffer too small to serialize packet");
+	}
 
 	//Push on the destination and source mac address
-	auto insertPt = outVec.begin();
+	uint8_t * insertPt = buffer;
 	std::copy(header.dest.addr.begin(), header.dest.addr.end(), insertPt); insertPt += 6;
 	std::copy(header.src.addr.begin(), header.src.addr.end(), insertPt); insertPt += 6;
 
@@ -70,26 +90,31 @@ vector<uint8_t> APSEthernetPacket::serialize() const {
 	myuint32 = htonl(header.command.packed);
 	std::copy(start, start+4, insertPt); insertPt += 4;
 
-	//Address
-	if (needs_address(APS_COMMANDS(header.command.cmd))){
+	//Address; acknowledges never carry one
+	if (has_address()){
 		myuint32 = htonl(header.addr);
 		std::copy(start, start+4, insertPt); insertPt += 4;
 	}
 
 	//Data
-	for (auto word : payload){
-		myuint32 = htonl(word);
-		std::copy(start, start+4, insertPt); insertPt += 4;
-	}
+	host_to_network(payload.data(), insertPt, payload.size());
+	insertPt += 4*payload.size();
 
-	return outVec;
+	//Zero pad out to the minimum frame size
+	std::fill(insertPt, buffer + frameSize, 0);
+
+	return frameSize;
 }
 
 size_t APSEthernetPacket::numBytes() const{
-	size_t trueSize = needs_address(APS_COMMANDS(header.command.cmd)) ? NUM_HEADER_BYTES + 4*payload.size() : NUM_HEADER_BYTES - 4 + 4*payload.size() ;
+	size_t trueSize = has_address() ? NUM_HEADER_BYTES + 4*payload.size() : NUM_HEADER_BYTES - 4 + 4*payload.size() ;
 	return std::max(trueSize, static_cast<size_t>(64)); 
 }	
 
+bool APSEthernetPacket::has_address() const {
+	return !header.command.ack && needs_address(APS_COMMANDS(header.command.cmd));
+}
+
 APSEthernetPacket APSEthernetPacket::create_broadcast_packet(){
 	/*
 	 * Helper function to put together a broadcast status packet that all APS units should respond to.
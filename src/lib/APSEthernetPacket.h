@@ -64,9 +64,16 @@ public:
 	APSEthernetPacket(const vector<uint8_t> &);
 	
 	static const size_t NUM_HEADER_BYTES = 24;
+	//Where the big-endian sequence number sits in a serialized frame
+	static const size_t SEQ_NUM_OFFSET = 14;
+	//Largest frame we build: full header plus the protocol maximum of 366 payload words
+	static const size_t MAX_NUM_BYTES = NUM_HEADER_BYTES + 4*366;
 
 	vector<uint8_t> serialize() const ;
+	size_t serialize_into(uint8_t *, size_t) const;
 	size_t numBytes() const; 
+	//Acknowledges and RESET/STATUS commands go without the address word
+	bool has_address() const;
 
 	static APSEthernetPacket create_broadcast_packet();
 };
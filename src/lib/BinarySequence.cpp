@@ -0,0 +1,252 @@
+#include "BinarySequence.h"
+#include "APS2.h"
+#include "EndianSwap.h"
+#include "WaveformPack.h"
+#include "ContentHash.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+//Header and section table fields are big-endian like the payloads
+const size_t HEADER_BYTES = 16;
+const size_t SECTION_ENTRY_BYTES = 32;
+const uint32_t NUM_SECTIONS = 3;
+
+uint32_t get32(const uint8_t * src) {
+	return (uint32_t(src[0]) << 24) | (uint32_t(src[1]) << 16) | (uint32_t(src[2]) << 8) | uint32_t(src[3]);
+}
+
+uint64_t get64(const uint8_t * src) {
+	return (uint64_t(get32(src)) << 32) | get32(src + 4);
+}
+
+void put32(vector<uint8_t> & dst, uint32_t val) {
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		dst.push_back(uint8_t(val >> shift));
+	}
+}
+
+void put64(vector<uint8_t> & dst, uint64_t val) {
+	put32(dst, uint32_t(val >> 32));
+	put32(dst, uint32_t(val));
+}
+
+//Memory words in network byte order
+vector<uint8_t> to_network(const vector<uint32_t> & words) {
+	vector<uint8_t> bytes(4*words.size());
+	host_to_network(words.data(), bytes.data(), words.size());
+	return bytes;
+}
+
+vector<uint8_t> pack_channel(const vector<int16_t> & waveform) {
+	//Padded to WF_MODULUS as Channel does so a load packs to the same words
+	vector<int16_t> samples(waveform);
+	samples.resize(size_t(WF_MODULUS*ceil(float(samples.size())/WF_MODULUS)), 0);
+	vector<uint8_t> markers(samples.size(), 0);
+	vector<uint32_t> words(samples.size()/2);
+	pack_waveform(samples.data(), markers.data(), samples.size(), 1.0, 0.0, words.data());
+	return to_network(words);
+}
+
+}
+
+BinarySequence::BinarySequence(const string & fileName) : numInstructions{0}, instructionsChecksum{0}, data_{nullptr}, size_{0} {
+	map(fileName);
+	try {
+		parse();
+	}
+	catch (...) {
+		unmap();
+		throw;
+	}
+}
+
+BinarySequence::~BinarySequence() {
+	unmap();
+}
+
+bool BinarySequence::is_binary_sequence(const string & fileName) {
+	std::ifstream file(fileName, std::ios::binary);
+	char magic[sizeof(BINARY_SEQUENCE_MAGIC)];
+	return file.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), BINARY_SEQUENCE_MAGIC);
+}
+
+void BinarySequence::map(const string & fileName) {
+#ifdef _WIN32
+	file_ = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	mapping_ = NULL;
+	LARGE_INTEGER fileSize;
+	if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &fileSize) || fileSize.QuadPart < LONGLONG(HEADER_BYTES)) {
+		unmap();
+		throw APS2_SEQFILE_FAIL;
+	}
+	size_ = fileSize.QuadPart;
+	mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+	data_ = mapping_ ? static_cast<const uint8_t *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+	fd_ = open(fileName.c_str(), O_RDONLY);
+	struct stat fileStat;
+	if (fd_ < 0 || fstat(fd_, &fileStat) != 0 || fileStat.st_size < off_t(HEADER_BYTES)) {
+		unmap();
+		throw APS2_SEQFILE_FAIL;
+	}
+	size_ = fileStat.st_size;
+	void * mapped = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+	data_ = (mapped == MAP_FAILED) ? nullptr : static_cast<const uint8_t *>(mapped);
+#endif
+	if (!data_) {
+		FILE_LOG(logERROR) << "Unable to map sequence file " << fileName;
+		unmap();
+		throw APS2_SEQFILE_FAIL;
+	}
+}
+
+void BinarySequence::unmap() {
+#ifdef _WIN32
+	if (data_) UnmapViewOfFile(data_);
+	if (mapping_) CloseHandle(mapping_);
+	if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+	mapping_ = NULL;
+	file_ = INVALID_HANDLE_VALUE;
+#else
+	if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+	if (fd_ >= 0) close(fd_);
+	fd_ = -1;
+#endif
+	data_ = nullptr;
+}
+
+void BinarySequence::parse() {
+	/*
+	 * Check the header and section table and find the payloads
+	 * Every section's payload must lie inside the file, be the size its count implies and match its checksum.
+	 */
+	if (!std::equal(data_, data_ + sizeof(BINARY_SEQUENCE_MAGIC), reinterpret_cast<const uint8_t *>(BINARY_SEQUENCE_MAGIC))) {
+		FILE_LOG(logERROR) << "Not a binary sequence file";
+		throw APS2_SEQFILE_FAIL;
+	}
+	uint32_t version = get32(data_ + 8);
+	if (version != BINARY_SEQUENCE_VERSION) {
+		FILE_LOG(logERROR) << "Unsupported binary sequence file version " << version;
+		throw APS2_SEQFILE_FAIL;
+	}
+	uint32_t numSections = get32(data_ + 12);
+	if (HEADER_BYTES + SECTION_ENTRY_BYTES*uint64_t(numSections) > size_) {
+		FILE_LOG(logERROR) << "Binary sequence file section table is truncated";
+		throw APS2_SEQFILE_FAIL;
+	}
+
+	for (auto & section : sections_) {
+		section = {0, nullptr, 0};
+	}
+	for (uint32_t ct = 0; ct < numSections; ct++) {
+		const uint8_t * entry = data_ + HEADER_BYTES + SECTION_ENTRY_BYTES*ct;
+		uint32_t type = get32(entry);
+		uint32_t count = get32(entry + 4);
+		uint64_t offset = get64(entry + 8);
+		uint64_t numBytes = get64(entry + 16);
+		uint64_t checksum = get64(entry + 24);
+
+		//Unknown sections are skipped so later versions can add them
+		if (type < SECTION_WAVEFORM_A || type > SECTION_INSTRUCTIONS) {
+			continue;
+		}
+		//Instruction words are padded to a multiple of 256 as pack_sequence does and samples to WF_MODULUS
+		uint64_t expectedBytes = (type == SECTION_INSTRUCTIONS) ?
+			4*((2*uint64_t(count) + 255) / 256 * 256) :
+			2*uint64_t(WF_MODULUS*ceil(float(count)/WF_MODULUS));
+		if (offset > size_ || numBytes > size_ - offset || numBytes != expectedBytes) {
+			FILE_LOG(logERROR) << "Binary sequence file section " << type << " does not fit the file";
+			throw APS2_SEQFILE_FAIL;
+		}
+		if (content_hash(data_ + offset, numBytes) != checksum) {
+			FILE_LOG(logERROR) << "Binary sequence file section " << type << " fails its checksum";
+			throw APS2_SEQFILE_FAIL;
+		}
+		sections_[type - SECTION_WAVEFORM_A] = {count, data_ + offset, numBytes};
+		if (type == SECTION_INSTRUCTIONS) {
+			instructionsChecksum = checksum;
+		}
+	}
+	numInstructions = sections_[SECTION_INSTRUCTIONS - SECTION_WAVEFORM_A].count;
+}
+
+vector<int16_t> BinarySequence::read_waveform(const int & channel, vector<uint8_t> & markers) const {
+	//Undo the packing: sign extend the 14-bit samples and pick out the marker bits above them
+	const Section & section = sections_[channel];
+	vector<uint32_t> words(section.numBytes / 4);
+	network_to_host(section.payload, words.data(), words.size());
+	vector<int16_t> samples(section.count);
+	markers.assign(section.count, 0);
+	for (size_t ct = 0; ct < section.count; ct++) {
+		uint16_t sample = (ct % 2 == 0) ? uint16_t(words[ct/2] >> 16) : uint16_t(words[ct/2]);
+		samples[ct] = int16_t(uint16_t(sample << 2)) >> 2;
+		markers[ct] = sample >> 14;
+	}
+	return samples;
+}
+
+void BinarySequence::read_instructions(const size_t & offset, const size_t & count, uint64_t * buffer) const {
+	//Each instruction is stored as its low word then its high word
+	const Section & section = sections_[SECTION_INSTRUCTIONS - SECTION_WAVEFORM_A];
+	vector<uint32_t> words(2*count);
+	network_to_host(section.payload + 8*offset, words.data(), words.size());
+	for (size_t ct = 0; ct < count; ct++) {
+		buffer[ct] = (uint64_t(words[2*ct + 1]) << 32) | words[2*ct];
+	}
+}
+
+void BinarySequence::write(const string & fileName, const vector<int16_t> & wfA, const vector<int16_t> & wfB, const vector<uint64_t> & instructions) {
+	vector<uint8_t> payloads[NUM_SECTIONS] = {pack_channel(wfA), pack_channel(wfB), to_network(APS2::pack_sequence(instructions))};
+	uint32_t counts[NUM_SECTIONS] = {uint32_t(wfA.size()), uint32_t(wfB.size()), uint32_t(instructions.size())};
+
+	vector<uint8_t> header(BINARY_SEQUENCE_MAGIC, BINARY_SEQUENCE_MAGIC + sizeof(BINARY_SEQUENCE_MAGIC));
+	put32(header, BINARY_SEQUENCE_VERSION);
+	put32(header, NUM_SECTIONS);
+	//Payloads follow the table in order, each starting on an 8 byte boundary
+	uint64_t offset = HEADER_BYTES + SECTION_ENTRY_BYTES*NUM_SECTIONS;
+	for (uint32_t ct = 0; ct < NUM_SECTIONS; ct++) {
+		put32(header, SECTION_WAVEFORM_A + ct);
+		put32(header, counts[ct]);
+		put64(header, offset);
+		put64(header, payloads[ct].size());
+		put64(header, content_hash(payloads[ct].data(), payloads[ct].size()));
+		offset += (payloads[ct].size() + 7) & ~uint64_t(7);
+	}
+
+	std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char *>(header.data()), header.size());
+	const char padding[8] = {0};
+	for (auto & payload : payloads) {
+		file.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+		file.write(padding, (8 - payload.size() % 8) % 8);
+	}
+	if (!file) {
+		FILE_LOG(logERROR) << "Unable to write binary sequence file " << fileName;
+		throw APS2_SEQFILE_FAIL;
+	}
+}
+
+void BinarySequence::convert(const string & h5FileName, const string & fileName) {
+	vector<int16_t> waveforms[2];
+	vector<uint64_t> instructions;
+	try {
+		std::lock_guard<std::mutex> h5Lock(h5_mutex());
+		FILE_LOG(logINFO) << "Converting sequence file " << h5FileName << " to " << fileName;
+		H5::H5File H5SeqFile(h5FileName, H5F_ACC_RDONLY);
+		waveforms[0] = h5array2vector<int16_t>(&H5SeqFile, "chan_1/waveforms", H5::PredType::NATIVE_INT16);
+		waveforms[1] = h5array2vector<int16_t>(&H5SeqFile, "chan_2/waveforms", H5::PredType::NATIVE_INT16);
+		instructions = h5array2vector<uint64_t>(&H5SeqFile, "chan_1/instructions", H5::PredType::NATIVE_UINT64);
+		H5SeqFile.close();
+	}
+	catch (H5::Exception & e) {
+		throw APS2_SEQFILE_FAIL;
+	}
+	write(fileName, waveforms[0], waveforms[1], instructions);
+}
@@ -0,0 +1,67 @@
+/*
+ * BinarySequence.h
+ *
+ * Native binary sequence files holding waveform and instruction data laid out exactly as it is written to APS2 memory
+ *
+ * The layout is described in doc/formats.rst. Files are memory mapped for reading and the header and section checksums
+ * are checked when they are opened. Anything wrong with a file is reported by throwing APS2_SEQFILE_FAIL.
+ */
+
+#ifndef BINARYSEQUENCE_H_
+#define BINARYSEQUENCE_H_
+
+#include "headings.h"
+
+static const char BINARY_SEQUENCE_MAGIC[8] = {'A', 'P', 'S', '2', 'S', 'E', 'Q', '\0'};
+static const uint32_t BINARY_SEQUENCE_VERSION = 2;
+
+enum BINARY_SECTION {SECTION_WAVEFORM_A=1, SECTION_WAVEFORM_B, SECTION_INSTRUCTIONS};
+
+class BinarySequence {
+public:
+	BinarySequence(const string &);
+	~BinarySequence();
+
+	BinarySequence(const BinarySequence &) = delete;
+	BinarySequence & operator=(const BinarySequence &) = delete;
+
+	//Whether a file starts with the binary sequence magic rather than being e.g. HDF5
+	static bool is_binary_sequence(const string &);
+
+	//Write a binary sequence file; the waveforms are saturated to the DAC range as they would be on upload
+	static void write(const string &, const vector<int16_t> &, const vector<int16_t> &, const vector<uint64_t> &);
+	//Convert an HDF5 sequence file to a binary one
+	static void convert(const string &, const string &);
+
+	//Samples and marker bits of channel 0 or 1
+	vector<int16_t> read_waveform(const int &, vector<uint8_t> &) const;
+	//count instructions starting at offset
+	void read_instructions(const size_t &, const size_t &, uint64_t *) const;
+
+	size_t numInstructions;
+	//Checksum of the instruction section as stored in the file
+	uint64_t instructionsChecksum;
+
+private:
+	struct Section {
+		uint32_t count;
+		const uint8_t * payload;
+		size_t numBytes;
+	};
+	Section sections_[3];
+
+	const uint8_t * data_;
+	size_t size_;
+#ifdef _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int fd_;
+#endif
+
+	void map(const string &);
+	void unmap();
+	void parse();
+};
+
+#endif /* BINARYSEQUENCE_H_ */
@@ -7,10 +7,12 @@
 
 #include "headings.h"
 #include "Channel.h"
+#include "WaveformPack.h"
+#include "ContentHash.h"
 
-Channel::Channel() : number{-1}, offset_{0.0}, scale_{1.0}, enabled_{true}, waveform_(0), trigDelay_{0}{}
+Channel::Channel() : number{-1}, offset_{0.0}, offsetMode_{OFFSET_IN_WAVEFORM}, scale_{1.0}, enabled_{true}, waveform_(0), trigDelay_{0}, deviceHash_{0}{}
 
-Channel::Channel( int number) : number{number}, offset_{0.0}, scale_{1.0}, enabled_{true}, waveform_(0), trigDelay_{0}{}
+Channel::Channel( int number) : number{number}, offset_{0.0}, offsetMode_{OFFSET_IN_WAVEFORM}, scale_{1.0}, enabled_{true}, waveform_(0), trigDelay_{0}, deviceHash_{0}{}
 
 Channel::~Channel() {
 	// TODO Auto-generated destructor stub
@@ -26,8 +28,11 @@ bool Channel::get_enabled() const{
 }
 
 int Channel::set_offset(const float & offset){
+	float oldOffset = offset_;
 	offset_ = (offset>1.0) ? 1.0 : offset;
 	offset_ = (offset<-1.0) ? -1.0 : offset;
+	//Only a baked in offset changes the waveform words
+	if (offset_ != oldOffset && offsetMode_ == OFFSET_IN_WAVEFORM) mark_dirty(0, get_length());
 	return 0;
 }
 
@@ -35,7 +40,19 @@ float Channel::get_offset() const{
 	return offset_;
 }
 
+int Channel::set_offset_mode(const OFFSET_MODE & mode){
+	//Moving the offset into or out of the samples changes every word
+	if (mode != offsetMode_ && offset_ != 0) mark_dirty(0, get_length());
+	offsetMode_ = mode;
+	return 0;
+}
+
+OFFSET_MODE Channel::get_offset_mode() const{
+	return offsetMode_;
+}
+
 int Channel::set_scale(const float & scale){
+	if (scale != scale_) mark_dirty(0, get_length());
 	scale_ = scale;
 	return 0;
 }
@@ -45,7 +62,7 @@ float Channel::get_scale() const{
 }
 
 size_t Channel::get_length() const {
-	return waveform_.size();
+	return intWaveform_.empty() ? waveform_.size() : intWaveform_.size();
 }
 
 
@@ -60,6 +77,9 @@ int Channel::set_waveform(const vector<float> & data) {
 	waveform_.resize(size_t(WF_MODULUS*ceil(float(data.size())/WF_MODULUS)), 0);
 	markers_.resize(waveform_.size());
 	std::copy(data.begin(), data.end(), waveform_.begin());
+	intWaveform_.clear();
+	intWaveform_.shrink_to_fit();
+	mark_dirty(0, get_length());
 
 	return 0;
 }
@@ -70,12 +90,13 @@ int Channel::set_waveform(const vector<int16_t> & data) {
 	}
 
 	//Waveform length must be a integer multiple of WF_MODULUS so resize to that
-	waveform_.resize(size_t(WF_MODULUS*ceil(float(data.size())/WF_MODULUS)), 0);
-	markers_.resize(waveform_.size());
-	//Copy over the waveform data and convert to scaled floats
-	for(size_t ct=0; ct<data.size(); ct++){
-		waveform_[ct] = float(data[ct])/MAX_WF_AMP;
-	}
+	//Keep the data as integers; prep_waveform works on them directly
+	intWaveform_.resize(size_t(WF_MODULUS*ceil(float(data.size())/WF_MODULUS)), 0);
+	markers_.resize(intWaveform_.size());
+	std::copy(data.begin(), data.end(), intWaveform_.begin());
+	waveform_.clear();
+	waveform_.shrink_to_fit();
+	mark_dirty(0, get_length());
 	return 0;
 }
 
@@ -85,40 +106,80 @@ int Channel::set_markers(const vector<uint8_t> & data) {
 		markers_.resize(size_t(WF_MODULUS*ceil(float(data.size())/WF_MODULUS)), 0);
 	}
 
+	//Only the samples whose marker bits change need uploading again
+	for (size_t ct = 0; ct < data.size(); ct++) {
+		if (((markers_[ct] ^ data[ct]) & 0x3) == 0) {
+			continue;
+		}
+		size_t end = ct + 1;
+		while (end < data.size() && ((markers_[end] ^ data[end]) & 0x3) != 0) {
+			end++;
+		}
+		mark_dirty(ct, end);
+		ct = end;
+	}
 	std::copy(data.begin(), data.end(), markers_.begin());
 	return 0;
 }
 
-vector<int16_t> Channel::prep_waveform() const{
-	//Apply the scale,offset and covert to integer format
-	vector<int16_t> prepVec(waveform_.size());
-	for(size_t ct=0; ct<prepVec.size(); ct++){
-		prepVec[ct] = int16_t(MAX_WF_AMP*(scale_*waveform_[ct]+offset_));
+void Channel::mark_dirty(size_t firstSample, size_t endSample) {
+	//Keep the word ranges sorted and merge any that touch or overlap
+	std::pair<size_t, size_t> range(firstSample / 2, (endSample + 1) / 2);
+	if (range.first >= range.second) {
+		return;
 	}
+	auto iter = std::lower_bound(dirtyWords_.begin(), dirtyWords_.end(), range);
+	if (iter != dirtyWords_.begin() && std::prev(iter)->second >= range.first) {
+		--iter;
+		range.first = iter->first;
+	}
+	auto last = iter;
+	while (last != dirtyWords_.end() && last->first <= range.second) {
+		range.second = std::max(range.second, last->second);
+		++last;
+	}
+	iter = dirtyWords_.erase(iter, last);
+	dirtyWords_.insert(iter, range);
+}
 
-	//Clip to the max and min values allowed
-	//Signed integer data is asymmetric: can go to -8192 but only up to 8191.
-	if ( (prepVec.size() > 0) && (*max_element(prepVec.begin(), prepVec.end()) > MAX_WF_AMP) ){
+vector<uint32_t> Channel::prep_waveform() const{
+	return prep_waveform(0, get_length() / 2);
+}
+
+vector<uint32_t> Channel::prep_waveform(const size_t & firstWord, const size_t & numWords) const{
+	//Apply the scale and offset, clip, merge in the markers and pack pairs of samples into words in one pass
+	//bits 0-13 of each sample hold the signed 14-bit DAC data and bits 14-15 the marker data
+	vector<uint32_t> packedData(numWords);
+	size_t first = 2*firstWord;
+	float offset = (offsetMode_ == OFFSET_IN_WAVEFORM) ? offset_ : 0;
+	int clipped = intWaveform_.empty() ?
+		pack_waveform(waveform_.data() + first, markers_.data() + first, 2*numWords, scale_, offset, packedData.data()) :
+		pack_waveform(intWaveform_.data() + first, markers_.data() + first, 2*numWords, scale_, offset, packedData.data());
+	if (clipped & WAVEFORM_CLIPPED_HIGH) {
 		FILE_LOG(logWARNING) << "Waveform element too positive. Clipping to max.";
-		for(int16_t & tmpVal : prepVec){
-			if (tmpVal > MAX_WF_AMP) tmpVal = MAX_WF_AMP;
-		}
 	}
-	if ( (prepVec.size() > 0) && (*min_element(prepVec.begin(), prepVec.end()) < -(MAX_WF_AMP+1)) ){
+	if (clipped & WAVEFORM_CLIPPED_LOW) {
 		FILE_LOG(logWARNING) << "Waveform element too negative. Clipping to min.";
-		for(int16_t & tmpVal : prepVec){
-			if (tmpVal < -MAX_WF_AMP) tmpVal = -MAX_WF_AMP;
-		}
-	}
-	// merge 14-bit DAC data with 2-bit marker data
-	for (size_t ct=0; ct < prepVec.size(); ct++) {
-		prepVec[ct] = (prepVec[ct] & 0x3FFF) | (static_cast<uint16_t>(markers_[ct]) << 14);
 	}
-	return prepVec;
+	return packedData;
+}
+
+uint64_t Channel::waveform_hash() const{
+	//Which storage is in use matters as well as the bytes in it
+	bool isInt = !intWaveform_.empty();
+	float offset = (offsetMode_ == OFFSET_IN_WAVEFORM) ? offset_ : 0;
+	float params[3] = {scale_, offset, float(isInt)};
+	uint64_t hash = content_hash(params, sizeof(params));
+	hash = isInt ? content_hash(intWaveform_.data(), intWaveform_.size()*sizeof(int16_t), hash) :
+		content_hash(waveform_.data(), waveform_.size()*sizeof(float), hash);
+	return content_hash(markers_.data(), std::min(markers_.size(), get_length()), hash);
 }
 
 int Channel::clear_data() {
+	//The device keeps the old waveform so its copy stays valid
 	waveform_.clear();
+	intWaveform_.clear();
+	dirtyWords_.clear();
 	return 0;
 }
 
@@ -126,7 +187,11 @@ int Channel::write_state_to_hdf5(H5::H5File & H5StateFile, const string & rootSt
 
 	// write waveform data
 	FILE_LOG(logDEBUG) << "Writing Waveform: " << rootStr + "/waveformLib";
-	vector2h5array<float>(waveform_,  &H5StateFile, rootStr + "/waveformLib", rootStr + "/waveformLib",   H5::PredType::NATIVE_FLOAT);
+	vector<float> floatWaveform = waveform_;
+	for (auto val : intWaveform_) {
+		floatWaveform.push_back(float(val)/MAX_WF_AMP);
+	}
+	vector2h5array<float>(floatWaveform,  &H5StateFile, rootStr + "/waveformLib", rootStr + "/waveformLib",   H5::PredType::NATIVE_FLOAT);
 
 
 	// add channel state information to root group
@@ -10,6 +10,7 @@
 #define CHANNEL_H_
 
 #include "headings.h"
+#include "APS2_enums.h"
 
 class Channel {
 public:
@@ -20,6 +21,8 @@ public:
 
 	int set_offset(const float &);
 	float get_offset() const;
+	int set_offset_mode(const OFFSET_MODE &);
+	OFFSET_MODE get_offset_mode() const;
 	int set_scale(const float &);
 	float get_scale() const;
 	int set_enabled(const bool &);
@@ -29,7 +32,11 @@ public:
 	int set_waveform(const vector<float> &);
 	int set_waveform(const vector<int16_t> &);
 	int set_markers(const vector<uint8_t> &);
-	vector<int16_t> prep_waveform() const;
+	//Waveform memory words holding two samples each; all of them or numWords starting at firstWord
+	vector<uint32_t> prep_waveform() const;
+	vector<uint32_t> prep_waveform(const size_t & firstWord, const size_t & numWords) const;
+	//Hash of everything prep_waveform depends on
+	uint64_t waveform_hash() const;
 
 	int clear_data();
 
@@ -41,11 +48,22 @@ public:
 
 private:
 	float offset_;
+	OFFSET_MODE offsetMode_;
 	float scale_;
 	bool enabled_;
+	//Only one of these holds the waveform: floats in units of full scale or integers in DAC units as given
 	vector<float> waveform_;
+	vector<int16_t> intWaveform_;
 	vector<uint8_t> markers_;
 	int trigDelay_;
+
+	//Waveform words [begin, end) changed since the last upload, sorted and non-overlapping
+	void mark_dirty(size_t firstSample, size_t endSample);
+	vector<std::pair<size_t, size_t>> dirtyWords_;
+	//Packed words the device holds from the last upload; empty when unknown
+	vector<uint32_t> deviceWords_;
+	//waveform_hash() of the state deviceWords_ was prepared from
+	uint64_t deviceHash_;
 };
 
 #endif /* CHANNEL_H_ */
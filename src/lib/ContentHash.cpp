@@ -0,0 +1,88 @@
+#include "ContentHash.h"
+
+#include <cstring>
+
+namespace {
+
+//XXH64 as specified at https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+inline uint64_t rotl(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+//Input is read little-endian whatever the host so hashes stored in files are portable
+inline uint64_t read64(const uint8_t * src) {
+	uint64_t value = 0;
+	for (int ct = 7; ct >= 0; ct--) {
+		value = (value << 8) | src[ct];
+	}
+	return value;
+}
+
+inline uint32_t read32(const uint8_t * src) {
+	return uint32_t(src[0]) | (uint32_t(src[1]) << 8) | (uint32_t(src[2]) << 16) | (uint32_t(src[3]) << 24);
+}
+
+inline uint64_t round(uint64_t acc, uint64_t lane) {
+	acc += lane * PRIME64_2;
+	return rotl(acc, 31) * PRIME64_1;
+}
+
+inline uint64_t merge_accumulator(uint64_t hash, uint64_t acc) {
+	hash ^= round(0, acc);
+	return hash * PRIME64_1 + PRIME64_4;
+}
+
+}
+
+uint64_t content_hash(const void * data, size_t numBytes, uint64_t seed) {
+	const uint8_t * bytes = static_cast<const uint8_t *>(data);
+	const uint8_t * end = bytes + numBytes;
+	uint64_t hash;
+
+	//32 byte stripes across four accumulators
+	if (numBytes >= 32) {
+		uint64_t acc[4] = {seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1};
+		for (; bytes + 32 <= end; bytes += 32) {
+			for (int lane = 0; lane < 4; lane++) {
+				acc[lane] = round(acc[lane], read64(bytes + 8*lane));
+			}
+		}
+		hash = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+		for (int lane = 0; lane < 4; lane++) {
+			hash = merge_accumulator(hash, acc[lane]);
+		}
+	}
+	else {
+		hash = seed + PRIME64_5;
+	}
+	hash += numBytes;
+
+	//Remaining 0-31 bytes
+	for (; bytes + 8 <= end; bytes += 8) {
+		hash ^= round(0, read64(bytes));
+		hash = rotl(hash, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (bytes + 4 <= end) {
+		hash ^= uint64_t(read32(bytes)) * PRIME64_1;
+		hash = rotl(hash, 23) * PRIME64_2 + PRIME64_3;
+		bytes += 4;
+	}
+	for (; bytes < end; bytes++) {
+		hash ^= (*bytes) * PRIME64_5;
+		hash = rotl(hash, 11) * PRIME64_1;
+	}
+
+	//Avalanche
+	hash ^= hash >> 33;
+	hash *= PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
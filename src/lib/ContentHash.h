@@ -0,0 +1,19 @@
+/*
+ * ContentHash.h
+ *
+ * 64-bit hash of a block of memory used to recognise data the APS2 already holds
+ *
+ * This is XXH64, a well studied non-cryptographic hash, so accidental matches between different uploads are
+ * vanishingly unlikely. It gives the same result on any host and is used for the binary sequence file checksums.
+ */
+
+#ifndef CONTENTHASH_H_
+#define CONTENTHASH_H_
+
+#include <cstddef>
+#include <cstdint>
+
+//XXH64 of numBytes starting at data; pass a previous result as seed to chain several blocks
+uint64_t content_hash(const void * data, size_t numBytes, uint64_t seed = 0);
+
+#endif /* CONTENTHASH_H_ */
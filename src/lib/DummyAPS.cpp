@@ -1,395 +1,378 @@
 #include "DummyAPS.h"
 
-#include <iostream>
-#include <fstream>
-#include <cstring>
-#include <cstdlib>
-#include <thread>
-#include "EthernetControl.h"
-#include "constants.h"
-#include "logger.h"
-
-#ifdef _WIN32
-#include "concol.h"
-#endif 
-
-using std::cout;
-using std::endl;
-using std::ofstream;
-
-
-
-DummyAPS::DummyAPS( string dev ) : pll_cycles_(00), pll_bypass_(0x80) {
-
-
-	memset(&statusRegs_, 0, sizeof(struct APS_Status_Registers));
-
-	statusRegs_.hostFirmwareVersion = 0x000A0001;
-	statusRegs_.userFirmwareVersion = 0x00000001;
-	statusRegs_.configurationSource = BASELINE_IMAGE;
-
-    // setup some default registers
-    user_registers_[FPGA_ADDR_VERSION] = 0x0;
-    user_registers_[FPGA_ADDR_PLL_STATUS] = (1 << PLL_02_LOCK_BIT) | (1 << PLL_13_LOCK_BIT) | (1 << REFERENCE_PLL_LOCK_BIT);
-
-    outboundPacketPtr_ = &outboundPacket_[0];
-
-    for (int cnt = 0; cnt < MAX_APS_CHANNELS; cnt++) {
-        dacs.push_back({0,0,0,0});
-    }
-	
-    EthernetControl::debugAPSEcho(dev,  this);
+void SparseMemory::write(const uint32_t & addr, const uint32_t * data, size_t numWords) {
+	uint32_t wordAddr = addr / 4;
+	for (size_t ct = 0; ct < numWords; ct++, wordAddr++) {
+		auto & page = pages_[wordAddr / PAGE_WORDS];
+		if (page.empty()) {
+			page.assign(PAGE_WORDS, fill_);
+		}
+		page[wordAddr % PAGE_WORDS] = data[ct];
+	}
 }
 
-unsigned char * DummyAPS::packetCallback(const void * voidDataPtr, size_t & length) {
-
-    uint32_t * data = reinterpret_cast<uint32_t*>(const_cast<void*>(voidDataPtr));
-
-	APSEthernetHeader * eh = (APSEthernetHeader *) data;
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-
-    setcolor(red, black);
-	cout << "Recv ";
-    setcolor(white,black);
-    cout << "SeqNum: " << eh->seqNum;
-    //cout << "Src: " << EthernetControl::print_ethernetAddress(eh->src);
-    //out << " Dest: " << EthernetControl::print_ethernetAddress(eh->dest);
-    cout << " Len: " << length;
-    cout << " Command: " << APS2::printAPSCommand(eh->command) << endl;
-
-    // update sequece number information
-    
-    if (eh->seqNum != 0) {
-        if (eh->seqNum == seqnum_) statusRegs_.sequenceDupCount++;
-        if (eh->seqNum > (seqnum_ + 1)) statusRegs_.sequenceSkipCount++;
-        seqnum_ = eh->seqNum;
-    }
-
-    statusRegs_.receivePacketCount++;
-
-    if (eh->command.cmd == APS_COMMAND_RESET) {
-    	length = reset();
-    } 
-
-    if (eh->command.cmd == APS_COMMAND_STATUS) {
-        length = status(data, length);
-    }
-
-
-    if ((eh->command.cmd == APS_COMMAND_FPGACONFIG_ACK) || 
-        (eh->command.cmd == APS_COMMAND_FPGACONFIG_NACK)
-       ) {
-        length = recv_fpga_file(data, length);
-    }
-
-    if (eh->command.cmd == APS_COMMAND_FPGACONFIG_CTRL) {
-        length = select_fpga_program();
-    }
-
- 
-    if (eh->command.cmd == APS_COMMAND_CHIPCONFIGIO) {
-        length = chip_config(data, length);
-    }
-
-    if ((eh->command.cmd == APS_COMMAND_USERIO_ACK) || 
-        (eh->command.cmd == APS_COMMAND_USERIO_NACK)
-       ) {
-        length = user_io(data, length);
-    }
-
-    if (length > 0) {
-        // packet will be sent so update count
-        statusRegs_.sendPacketCount++;
-    }
-
-    dh->seqNum = eh->seqNum;
-
-    unsigned char *ptr = reinterpret_cast<unsigned char *>(outboundPacketPtr_);
-
-    return ptr;
-
+void SparseMemory::read(const uint32_t & addr, uint32_t * data, size_t numWords) const {
+	uint32_t wordAddr = addr / 4;
+	for (size_t ct = 0; ct < numWords; ct++, wordAddr++) {
+		auto page = pages_.find(wordAddr / PAGE_WORDS);
+		data[ct] = (page == pages_.end()) ? fill_ : page->second[wordAddr % PAGE_WORDS];
+	}
 }
 
-size_t DummyAPS::reset() {
-
-    setcolor(purple,black);
-    cout << "reset()" << endl;
-    setcolor(white,black);
-
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-
-    // reset status register values
-    
-    statusRegs_.sendPacketCount = 0;
-    statusRegs_.receivePacketCount = 0;
-    statusRegs_.sequenceSkipCount = 0;
-    statusRegs_.sequenceDupCount = 0;
-    statusRegs_.uptime = 0;
-
-    bootTime_ = std::chrono::steady_clock::now();
-
-    // remove fpga bit file
-    ofstream bitFile ("fpga.bit", ofstream::out | ofstream::binary);
-    bitFile.close();
-
-    // copy status registers
-    memcpy((uint8_t *) getPayloadPtr(outboundPacketPtr_), &statusRegs_, sizeof(struct APS_Status_Registers));
-    
-    return sizeof(struct APSEthernetHeader) + sizeof(struct APS_Status_Registers);
+void SparseMemory::erase(const uint32_t & addr, size_t numBytes) {
+	//Put back the fill value; pages wholly inside the range are dropped
+	uint32_t wordAddr = addr / 4;
+	uint32_t endAddr = wordAddr + numBytes / 4;
+	while (wordAddr < endAddr) {
+		uint32_t pageIdx = wordAddr / PAGE_WORDS;
+		auto page = pages_.find(pageIdx);
+		uint32_t pageEnd = std::min(endAddr, static_cast<uint32_t>((pageIdx + 1) * PAGE_WORDS));
+		if (page != pages_.end()) {
+			if (wordAddr % PAGE_WORDS == 0 && pageEnd == (pageIdx + 1) * PAGE_WORDS) {
+				pages_.erase(page);
+			} else {
+				std::fill(page->second.begin() + wordAddr % PAGE_WORDS, page->second.begin() + (pageEnd - pageIdx * PAGE_WORDS), fill_);
+			}
+		}
+		wordAddr = pageEnd;
+	}
 }
 
-size_t DummyAPS::status(uint32_t * frameData,  size_t & length) {
-
-    setcolor(purple,black);
-    cout << "status()" << endl;
-    setcolor(white,black);
-
-    APSEthernetHeader * eh = (APSEthernetHeader *) frameData;
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-
-    std::fill(outboundPacket_, outboundPacket_ + frameLenWords, 0);
-
-    dh->command.packed = eh->command.packed;
-    dh->command.ack = 1;
-    
-    statusRegs_.uptime = uptime();
-
-    // copy status registers
-    memcpy((uint8_t *) getPayloadPtr(outboundPacketPtr_), &statusRegs_, sizeof(struct APS_Status_Registers));
-    
-    return sizeof(struct APSEthernetHeader) + sizeof(struct APS_Status_Registers);
+DummyAPS::DummyAPS(asio::io_service & ios, const string & ip, const uint64_t & macAddr) :
+	ip_(ip), ios_(ios), socket_(ios), sendBuffer_(APSEthernetPacket::MAX_NUM_BYTES), flash_(0xffffffff), bitFile_(0xffffffff) {
+
+	uint8_t macBytes[MACAddr::MAC_ADDR_LEN];
+	for (size_t ct = 0; ct < MACAddr::MAC_ADDR_LEN; ct++) {
+		macBytes[ct] = (macAddr >> (8*(MACAddr::MAC_ADDR_LEN - 1 - ct))) & 0xff;
+	}
+	macAddr_ = MACAddr(macBytes);
+
+	//Share the port with the library's wildcard socket; the kernel hands us the packets addressed to our IP
+	udp::endpoint endpoint(asio::ip::address_v4::from_string(ip), APS_PROTO);
+	socket_.open(udp::v4());
+	socket_.set_option(asio::socket_base::reuse_address(true));
+	socket_.bind(endpoint);
+
+	std::fill(std::begin(statusRegs_.array), std::end(statusRegs_.array), 0);
+	statusRegs_.hostFirmwareVersion = 0x00000A01;
+	statusRegs_.userFirmwareVersion = 0x00000212;
+	statusRegs_.configurationSource = USER_EPROM_IMAGE;
+	//MMCM and MIG locks and calibration done with the die at 40C
+	statusRegs_.userStatus = (1u << MMCM_SYS_LOCK_BIT) | (1 << MMCM_CFG_LOCK_BIT) | (1 << MIG_C0_LOCK_BIT) |
+		(1 << MIG_C0_CAL_BIT) | (1 << MIG_C1_LOCK_BIT) | (1 << MIG_C1_CAL_BIT) | 0x9f1;
+	statusRegs_.pllStatus = 0x7;
+
+	//MAC and IP live in the flash where APS2::get_mac_addr and get_ip_addr look for them
+	uint32_t macip[4] = {static_cast<uint32_t>(macAddr >> 16), static_cast<uint32_t>((macAddr & 0xffff) << 16),
+		static_cast<uint32_t>(endpoint.address().to_v4().to_ulong()), 0};
+	flash_.write(EPROM_MACIP_ADDR, macip, 4);
+
+	dacRegs_[0].assign(32, 0);
+	dacRegs_[1].assign(32, 0);
+	//PLL comes up bypassed at 1.2 GS/s
+	pllRegs_[0x190] = 0x00;
+	pllRegs_[0x191] = 0x80;
+
+	bootTime_ = std::chrono::steady_clock::now();
+	lastSeqNum_ = 0;
+	seqError_ = SEQ_OK;
+	numDropped_ = numDuplicated_ = numReordered_ = 0;
+
+	FILE_LOG(logINFO) << "Emulated APS2 listening on " << ip_ << " with MAC address " << macAddr_.to_string();
+
+	setup_receive();
 }
 
-unsigned int DummyAPS::uptime() {
-    std::chrono::time_point<std::chrono::steady_clock> t;
-    t = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::milliseconds>(t - bootTime_).count();
+void DummyAPS::setup_receive() {
+	socket_.async_receive_from(
+		asio::buffer(receivedData_, sizeof(receivedData_)), senderEndpoint_,
+		[this](std::error_code ec, std::size_t bytesReceived) {
+			//Anything shorter than a header without address is not for us
+			if (!ec && bytesReceived >= APSEthernetPacket::NUM_HEADER_BYTES - 4) {
+				APSEthernetPacket packet(vector<uint8_t>(receivedData_, receivedData_ + bytesReceived));
+				if (impairments_.active()) {
+					udp::endpoint sender = senderEndpoint_;
+					impair([this, packet, sender]() { handle_packet(packet, sender); });
+				} else {
+					handle_packet(packet, senderEndpoint_);
+				}
+			}
+			setup_receive();
+	});
 }
 
-size_t DummyAPS::recv_fpga_file(uint32_t * frameData,  size_t & length) {
-
-    ofstream bitFile ("fpga.bit", ofstream::out | ofstream::binary |  ofstream::app);
-
-    APSEthernetHeader * eh = (APSEthernetHeader *) frameData;
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-    std::fill(outboundPacket_,outboundPacket_ + frameLenWords, 0);
-
-    dh->command.packed = 0;
-    dh->command.cmd = APS_COMMAND_FPGACONFIG_ACK;
-    dh->command.ack = 1;
-
-    setcolor(purple,black);
-    cout << "recv_fpga_file: ";
-    setcolor(white,black);
-
-    unsigned char *data;
-
-    uint32_t addr;
-
-    size_t payloadLen;
-
-    data = (unsigned char *) frameData;
-    data += sizeof(APSEthernetHeader);
-
-    payloadLen = length - sizeof(APSEthernetHeader);
-
-    if (payloadLen < sizeof(uint32_t)) cout << "Error payload does not contain addr" << endl;
-
-    addr = eh->addr;
-
-    bitFile.seekp(addr * sizeof(uint32_t));
-
-    // convert from bytes to words
-    payloadLen /= sizeof(uint32_t); 
-
-    // test to make sure length matches
-    if (payloadLen != eh->command.cnt) {
-        dh->command.mode_stat = 0x01;
-        cout << "Error payload length " << payloadLen << " does not match cnt " << eh->command.cnt << endl;
-    }  else {
-        cout << "addr = " << std::hex << addr << " len = " << std::dec << payloadLen << endl;
-        bitFile.write((const char *) data, payloadLen*sizeof(uint32_t));
-    }
-
-    bitFile.close();
-
-    // ack frame if required
-    if (eh->command.cmd == APS_COMMAND_FPGACONFIG_ACK) {
-        return sizeof(struct APSEthernetHeader);
-    } 
-
-    return 0;
+void DummyAPS::set_impairments(const LinkImpairments & impairments, const unsigned & seed) {
+	impairments_ = impairments;
+	rng_.seed(seed);
+	FILE_LOG(logINFO) << ip_ << " link impairments: delay " << impairments.delayMS << " ms; jitter " << impairments.jitterMS <<
+		" ms; drop " << impairments.dropRate << "; duplicate " << impairments.duplicateRate <<
+		"; reorder " << impairments.reorderRate << " by " << impairments.reorderMS << " ms";
 }
 
-size_t DummyAPS::select_fpga_program() {
-    // mimic a reprogram
-    
-    setcolor(purple,black);
-    cout << "select_fpga_program" << endl;
-    setcolor(white,black);
-
-    // sleep random amount of time and then send host interface registers
-
-    std::chrono::milliseconds dura( rand() % 1000 );
-    std::this_thread::sleep_for( dura );
-
-    // dummy up expected FPGA version
-    user_registers_[FPGA_ADDR_VERSION] = 0xA03;
-
-    // copy status registers
-    memcpy((uint8_t *)getPayloadPtr(outboundPacketPtr_), &statusRegs_, sizeof(struct APS_Status_Registers));
-    
-    return sizeof(struct APSEthernetHeader) + sizeof(struct APS_Status_Registers);
+string DummyAPS::impairment_stats() const {
+	std::ostringstream ret;
+	ret << ip_ << ": " << numDropped_ << " dropped; " << numDuplicated_ << " duplicated; " << numReordered_ << " reordered; " <<
+		statusRegs_.sequenceSkipCount << " sequence skips; " << statusRegs_.sequenceDupCount << " sequence duplicates";
+	return ret.str();
 }
 
-size_t DummyAPS::user_io(uint32_t * frameData,  size_t & length) {
-    // mimic a reprogram
-    
-
-    APSEthernetHeader * eh = (APSEthernetHeader *) frameData;
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-    std::fill(outboundPacket_,outboundPacket_ + frameLenWords, 0);
-
-    setcolor(purple,black);
-    cout << "user_io ";
-    setcolor(white,black);
-    cout << ((eh->command.r_w) ? "read " : "write ") << std::hex << eh->addr << std::dec << " ";
-
-    dh->command.packed = 0;
-    dh->command.cmd = APS_COMMAND_USERIO_ACK;
-    dh->command.ack = 1;
-
-    uint32_t * inRegValue  = getPayloadPtr(frameData);
-    uint32_t * outRegValue = getPayloadPtr(outboundPacket_);
-
-    if (eh->command.r_w == 0) { // write
-        cout << "val = " << *inRegValue << endl;
-        user_registers_[eh->addr] = *inRegValue;
-    } else {
-        *outRegValue = user_registers_[eh->addr];
-        cout << "val = " << *outRegValue << endl;
-    }
-
-    /*
-    cout << "Register State" << endl;
-    for (auto reg: user_registers_) {
-        cout << std::hex << "Register: " << reg.first << " = " << std::dec << reg.second << endl;
-    }
-    */
-    
-    // ack frame if required
-    if (eh->command.cmd == APS_COMMAND_USERIO_ACK) {
-        return sizeof(struct APSEthernetHeader) + sizeof(uint32_t);
-    } 
-
-    return 0;
+void DummyAPS::impair(const std::function<void()> & deliver) {
+	//Decide the packet's fate and schedule each surviving copy on the io_service
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	if (uniform(rng_) < impairments_.dropRate) {
+		numDropped_++;
+		return;
+	}
+	int numCopies = 1;
+	if (uniform(rng_) < impairments_.duplicateRate) {
+		numDuplicated_++;
+		numCopies = 2;
+	}
+	for (int ct = 0; ct < numCopies; ct++) {
+		double delayMS = impairments_.delayMS + impairments_.jitterMS * uniform(rng_);
+		if (uniform(rng_) < impairments_.reorderRate) {
+			numReordered_++;
+			delayMS += impairments_.reorderMS;
+		}
+		if (delayMS <= 0) {
+			deliver();
+			continue;
+		}
+		auto timer = std::make_shared<asio::steady_timer>(ios_, std::chrono::microseconds(static_cast<int64_t>(1000 * delayMS)));
+		timer->async_wait([timer, deliver](const std::error_code &) { deliver(); });
+	}
 }
 
-size_t DummyAPS::chip_config(uint32_t * frameData,  size_t & length) {
-
-    APSEthernetHeader * eh = (APSEthernetHeader *) frameData;
-    APSEthernetHeader * dh = (APSEthernetHeader *) outboundPacket_;
-    std::fill(outboundPacket_,outboundPacket_ + frameLenWords, 0);
-
-    setcolor(purple,black);
-    cout << "chip_config ";
-    setcolor(white,black);
-
-    dh->command.packed = eh->command.packed;
-    dh->command.ack = 1;
-
-    APSChipConfigCommand_t chipCmd;
-
-
-    uint32_t * inValue =  getPayloadPtr(frameData);
-    uint32_t * outValue = getPayloadPtr(outboundPacket_);
-
-    chipCmd.packed = inValue[0];
-
-    // byte swap from big endian
-    
-    chipCmd.packed = ntohl(chipCmd.packed);
-    
-    cout << "chip command = " << APS2::printAPSChipCommand(chipCmd) << endl;
-
+void DummyAPS::handle_packet(const APSEthernetPacket & packet, const udp::endpoint & sender) {
+	statusRegs_.receivePacketCount++;
+	FILE_LOG(logDEBUG3) << ip_ << " received packet " << packet.header.seqNum << " command: " << print_APSCommand(packet.header.command);
+
+	//Sequence number zero restarts the count; anything but the next number is a duplicate or a skip
+	seqError_ = SEQ_OK;
+	if (packet.header.seqNum != 0) {
+		if (packet.header.seqNum == lastSeqNum_) {
+			statusRegs_.sequenceDupCount++;
+			seqError_ = SEQ_DUPLICATE;
+		} else if (packet.header.seqNum != static_cast<uint16_t>(lastSeqNum_ + 1)) {
+			statusRegs_.sequenceSkipCount++;
+			seqError_ = SEQ_SKIP;
+		}
+	}
+	lastSeqNum_ = packet.header.seqNum;
+
+	//NOACK is the top bit of the command nibble
+	bool ackRequested = !(packet.header.command.cmd & 0x8);
+	switch (APS_COMMANDS(packet.header.command.cmd & 0x7)) {
+		case APS_COMMANDS::STATUS:
+			status(packet, sender);
+			break;
+		case APS_COMMANDS::USERIO_ACK:
+			user_io(packet, sender, ackRequested);
+			break;
+		case APS_COMMANDS::EPROMIO:
+			eprom_io(packet, sender);
+			break;
+		case APS_COMMANDS::CHIPCONFIGIO:
+			chip_config(packet, sender);
+			break;
+		case APS_COMMANDS::RUNCHIPCONFIG: {
+			APSEthernetPacket ack;
+			ack.header.command.mode_stat = RUNCHIPCONFIG_SUCCESS;
+			send_ack(ack, packet, sender);
+			break;
+		}
+		case APS_COMMANDS::FPGACONFIG_ACK:
+			fpga_config(packet, sender, ackRequested);
+			break;
+		case APS_COMMANDS::FPGACONFIG_CTRL:
+		case APS_COMMANDS::RESET:
+			//The board goes away while the FPGA reconfigures; the host polls status to see it come back
+			reboot();
+			break;
+		default:
+			//the NOACK variants were folded into their base command above
+			break;
+	}
+}
 
+void DummyAPS::send_ack(APSEthernetPacket & ack, const APSEthernetPacket & request, const udp::endpoint & sender) {
+	//Echo the request's command word and sequence number with the acknowledge flag set
+	uint32_t modeStat = ack.header.command.mode_stat;
+	ack.header.command = request.header.command;
+	ack.header.command.ack = 1;
+	ack.header.command.mode_stat = modeStat;
+	//A sequence error takes over MODE/STAT: 0x01 for a skip and 0x00 for a duplicate
+	if (seqError_ != SEQ_OK) {
+		ack.header.command.seq = 1;
+		ack.header.command.mode_stat = (seqError_ == SEQ_SKIP) ? 0x01 : 0x00;
+	}
+	ack.header.command.cnt = ack.payload.size();
+	ack.header.seqNum = request.header.seqNum;
+	ack.header.dest = request.header.src;
+	ack.header.src = macAddr_;
+
+	size_t numBytes = ack.serialize_into(sendBuffer_.data(), sendBuffer_.size());
+	statusRegs_.sendPacketCount++;
+	if (impairments_.active()) {
+		vector<uint8_t> frame(sendBuffer_.begin(), sendBuffer_.begin() + numBytes);
+		impair([this, frame, sender]() { socket_.send_to(asio::buffer(frame), sender); });
+	} else {
+		socket_.send_to(asio::buffer(sendBuffer_.data(), numBytes), sender);
+	}
+}
 
+void DummyAPS::status(const APSEthernetPacket & request, const udp::endpoint & sender) {
+	auto uptime = std::chrono::steady_clock::now() - bootTime_;
+	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(uptime);
+	statusRegs_.uptimeSeconds = seconds.count();
+	statusRegs_.uptimeNanoSeconds = std::chrono::duration_cast<std::chrono::nanoseconds>(uptime - seconds).count();
 
-    switch(chipCmd.target) {
-        case CHIPCONFIG_IO_TARGET_PAUSE:         
-            break;
-        case CHIPCONFIG_IO_TARGET_DAC_0_MULTI: 
-            break;
-        case CHIPCONFIG_IO_TARGET_DAC_1_MULTI: 
-            break;
+	APSEthernetPacket ack;
+	ack.header.command.mode_stat = request.header.command.mode_stat;
+	ack.payload.assign(std::begin(statusRegs_.array), std::end(statusRegs_.array));
+	send_ack(ack, request, sender);
+}
 
-        case CHIPCONFIG_IO_TARGET_PLL_MULTI: 
-           
-            break;
-        case CHIPCONFIG_IO_TARGET_DAC_0_SINGLE: 
-        case CHIPCONFIG_IO_TARGET_DAC_1_SINGLE: 
-            {
-            DACCommand_t dacCmd;
-            dacCmd.packed = chipCmd.instr;
-            int dac = (chipCmd.target == CHIPCONFIG_IO_TARGET_DAC_0_SINGLE) ? 0 : 1;
-            uint8_t data = inValue[1] & 0xFF;
+void DummyAPS::user_io(const APSEthernetPacket & request, const udp::endpoint & sender, bool ackRequested) {
+	APSEthernetPacket ack;
+	ack.header.command.mode_stat = USERIO_SUCCESS;
+	size_t numWords = request.header.command.cnt;
+	if (request.header.command.r_w) {
+		ack.payload.resize(numWords);
+		memory_.read(request.header.addr, ack.payload.data(), numWords);
+		//reads are always answered
+		send_ack(ack, request, sender);
+		return;
+	}
+	//short frames are padded out so trust the count only as far as the payload goes
+	if (numWords > request.payload.size()) {
+		ack.header.command.mode_stat = USERIO_INVALID_CNT;
+		numWords = request.payload.size();
+	}
+	memory_.write(request.header.addr, request.payload.data(), numWords);
+	if (ackRequested) {
+		send_ack(ack, request, sender);
+	}
+}
 
-            uint8_t cmd = dacCmd.addr & 0x0F;
-            
-            auto invalidDacCMD = [] () {  
-                setcolor(red,black);
-                cout << "Error: ";
-                setcolor(white, black);
-                cout << "Invalid DAC cmd" << endl; 
-            };
+uint8_t & DummyAPS::SPI_register(uint8_t target, uint16_t addr) {
+	switch (target) {
+		case CHIPCONFIG_IO_TARGET_DAC_0:
+		case CHIPCONFIG_IO_TARGET_DAC_0_SINGLE:
+			return dacRegs_[0][addr & 0x1f];
+		case CHIPCONFIG_IO_TARGET_DAC_1:
+		case CHIPCONFIG_IO_TARGET_DAC_1_SINGLE:
+			return dacRegs_[1][addr & 0x1f];
+		default:
+			return pllRegs_[addr & 0x1fff];
+	}
+}
 
-            if (dacCmd.r_w) { // if read 
-                switch (cmd) {
-                    case 0x1: *outValue = dacs[dac].interrupt; break;
-                    case 0x6: *outValue = dacs[dac].controller; break;
-                    case 0x5: *outValue = dacs[dac].sd; break;
-                    case 0x4: *outValue = dacs[dac].msdMhd; break;
-                    default: invalidDacCMD(); break;
-                }
-            } else {
-                switch (cmd) {
-                    case 0x1: dacs[dac].interrupt = data; break;
-                    case 0x6: dacs[dac].controller = data; break;
-                    case 0x5: dacs[dac].sd = data; break;
-                    case 0x4: dacs[dac].msdMhd = data; break;
-                    default: invalidDacCMD(); break;
-                }
-            }
+void DummyAPS::chip_config(const APSEthernetPacket & request, const udp::endpoint & sender) {
+	APSEthernetPacket ack;
+	ack.header.command.mode_stat = CHIPCONFIG_SUCCESS;
+
+	if (request.header.command.r_w) {
+		//Hand back the bytes read by the last instruction stream, first byte in the MSB
+		ack.payload.assign(request.header.command.cnt, 0);
+		for (size_t ct = 0; ct < spiReadback_.size() && ct < 4*ack.payload.size(); ct++) {
+			ack.payload[ct / 4] |= spiReadback_[ct] << (24 - 8*(ct % 4));
+		}
+		spiReadback_.clear();
+		send_ack(ack, request, sender);
+		return;
+	}
+
+	spiReadback_.clear();
+	size_t numWords = std::min(static_cast<size_t>(request.header.command.cnt), request.payload.size());
+	for (size_t ct = 0; ct < numWords; ct++) {
+		APSChipConfigCommand_t cmd;
+		cmd.packed = request.payload[ct];
+		switch (cmd.target) {
+			case CHIPCONFIG_IO_TARGET_PAUSE:
+				break;
+			case CHIPCONFIG_IO_TARGET_DAC_0:
+			case CHIPCONFIG_IO_TARGET_DAC_1:
+			case CHIPCONFIG_IO_TARGET_DAC_0_SINGLE:
+			case CHIPCONFIG_IO_TARGET_DAC_1_SINGLE: {
+				DACCommand_t instr;
+				instr.packed = cmd.instr & 0xff;
+				if (instr.r_w) {
+					spiReadback_.push_back(SPI_register(cmd.target, instr.addr));
+				} else if (cmd.target == CHIPCONFIG_IO_TARGET_DAC_0_SINGLE || cmd.target == CHIPCONFIG_IO_TARGET_DAC_1_SINGLE) {
+					SPI_register(cmd.target, instr.addr) = cmd.spicnt_data;
+				}
+				break;
+			}
+			case CHIPCONFIG_IO_TARGET_PLL:
+			case CHIPCONFIG_IO_TARGET_PLL_SINGLE: {
+				PLLCommand_t instr;
+				instr.packed = cmd.instr;
+				if (instr.r_w) {
+					spiReadback_.push_back(SPI_register(cmd.target, instr.addr));
+				} else if (cmd.target == CHIPCONFIG_IO_TARGET_PLL_SINGLE) {
+					SPI_register(cmd.target, instr.addr) = cmd.spicnt_data;
+				}
+				break;
+			}
+			case CHIPCONFIG_IO_TARGET_VCXO:
+				//the VCXO word is followed by a data word we have no use for
+				ct++;
+				break;
+			case CHIPCONFIG_IO_TARGET_EOL:
+				ct = numWords;
+				break;
+			default:
+				FILE_LOG(logERROR) << ip_ << " invalid chip config target " << hexn<2> << cmd.target;
+				ack.header.command.mode_stat = CHIPCONFIG_INVALID_TARGET;
+				break;
+		}
+	}
+	send_ack(ack, request, sender);
+}
 
-            cout << "DAC[" << dac << "] Addr " << dacCmd.addr << " r/w " << dacCmd.r_w << " Data " << data << endl ;
-            }
-            break;
-        case CHIPCONFIG_IO_TARGET_PLL_SINGLE:  
-            {
-                PLLCommand_t pllcmd;
-                pllcmd.packed = chipCmd.instr;
-                uint8_t data = inValue[1] & 0xFF;
-                if (pllcmd.r_w && pllcmd.addr == FPGA1_PLL_CYCLES_ADDR) {
-                    *outValue = pll_cycles_;
-                } else if (pllcmd.r_w && pllcmd.addr == FPGA1_PLL_BYPASS_ADDR) {
-                    *outValue = pll_bypass_;
-                } else if (!pllcmd.r_w && pllcmd.addr == FPGA1_PLL_CYCLES_ADDR) {
-                    pll_cycles_ = data;
-                } else if (!pllcmd.r_w && pllcmd.addr == FPGA1_PLL_BYPASS_ADDR) {
-                    pll_bypass_ = data;
-                }
-            }
-            break;
-        case CHIPCONFIG_IO_TARGET_VCXO: 
-            break;
-        case CHIPCONFIG_IO_TARGET_EOL: 
-            break;
-        default:
-            dh->command.mode_stat = CHIPCONFIG_INVALID_TARGET;
-            FILE_LOG(logERROR) << "Invalid Chip Config Target";
-    }
- 
-    return sizeof(struct APSEthernetHeader) + sizeof(uint32_t);
+void DummyAPS::eprom_io(const APSEthernetPacket & request, const udp::endpoint & sender) {
+	APSEthernetPacket ack;
+	ack.header.command.mode_stat = EPROM_SUCCESS;
+	if (request.header.command.r_w) {
+		ack.payload.resize(request.header.command.cnt);
+		flash_.read(request.header.addr, ack.payload.data(), ack.payload.size());
+	} else if (request.header.command.mode_stat == EPROM_ERASE) {
+		if (request.header.addr % 65536) {
+			ack.header.command.mode_stat = EPROM_OPERATION_FAILED;
+		} else {
+			flash_.erase(request.header.addr, 65536);
+		}
+	} else {
+		size_t numWords = std::min(static_cast<size_t>(request.header.command.cnt), request.payload.size());
+		flash_.write(request.header.addr, request.payload.data(), numWords);
+	}
+	send_ack(ack, request, sender);
 }
 
+void DummyAPS::fpga_config(const APSEthernetPacket & request, const udp::endpoint & sender, bool ackRequested) {
+	APSEthernetPacket ack;
+	ack.header.command.mode_stat = FPGACONFIG_SUCCESS;
+	size_t numWords = request.header.command.cnt;
+	if (numWords > request.payload.size()) {
+		ack.header.command.mode_stat = FPGACONFIG_INVALID_CNT;
+		numWords = request.payload.size();
+	}
+	bitFile_.write(request.header.addr, request.payload.data(), numWords);
+	if (ackRequested) {
+		send_ack(ack, request, sender);
+	}
+}
 
+void DummyAPS::reboot() {
+	FILE_LOG(logINFO) << ip_ << " rebooting";
+	//The user logic comes back with fresh registers and memory
+	memory_ = SparseMemory();
+	spiReadback_.clear();
+	statusRegs_.sendPacketCount = 0;
+	statusRegs_.receivePacketCount = 0;
+	statusRegs_.sequenceSkipCount = 0;
+	statusRegs_.sequenceDupCount = 0;
+	lastSeqNum_ = 0;
+	bootTime_ = std::chrono::steady_clock::now();
+}
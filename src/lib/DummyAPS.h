@@ -1,71 +1,122 @@
+/*
+ * DummyAPS.h
+ *
+ * Emulates the APS2 end of the UDP protocol so the library can be exercised without hardware
+ *
+ * Each DummyAPS listens on its own IP address at APS_PROTO and answers:
+ *  - STATUS with the 84 byte host status bank
+ *  - USERIO reads and writes into a sparse model of the memory map
+ *  - CHIPCONFIGIO by running the SPI instruction stream against models of the DAC and PLL registers
+ *  - EPROMIO reads, writes and 64KB sector erases into a sparse model of the flash
+ *  - FPGACONFIG data (acknowledged unless NOACK) and FPGACONFIG_CTRL/RESET reboots
+ *  - RUNCHIPCONFIG with a success acknowledge
+ * Acknowledges echo the request's sequence number and command word with the ACK bit set and carry no address.
+ *
+ * Link impairments (delay, loss, duplication and reordering) can be applied to packets in both directions to
+ * exercise the library's retry and windowing logic. Sequence number skips and duplicates are counted in the
+ * status bank the way the firmware does.
+ */
 
 #ifndef DUMMYAPS_H_
 #define DUMMYAPS_H_
 
-#include <vector>
-#include <string>
-#include <cstdio>
-#include <map>
-#include <sstream>
-#include <set>
-#include <chrono>
+#include "headings.h"
+#include "APSEthernetPacket.h"
 
-#include "aps2.h"
+#include "asio.hpp"
+#include <random>
+#include <functional>
 
-using std::vector;
-using std::string;
-using std::map;
-using std::ostringstream;
+using asio::ip::udp;
 
-using namespace APS2;
-
-class DummyAPS
-{
+//Word addressed memory that only stores the pages that have been written
+class SparseMemory {
 public:
-	
-	unsigned char * packetCallback(const void * data, size_t & length);  
+	SparseMemory(const uint32_t & fill=0) : fill_(fill) {};
 
-	DummyAPS( string dev);
-	~DummyAPS() {};
+	//Addresses are in bytes and word aligned
+	void write(const uint32_t & addr, const uint32_t * data, size_t numWords);
+	void read(const uint32_t & addr, uint32_t * data, size_t numWords) const;
+	void erase(const uint32_t & addr, size_t numBytes);
+	size_t num_pages() const { return pages_.size(); };
 
-	
 private:
+	static const size_t PAGE_WORDS = 4096;
+	unordered_map<uint32_t, vector<uint32_t>> pages_;
+	uint32_t fill_;
+};
 
-	struct DACRegisters {
-		uint8_t interrupt;
-		uint8_t controller;
-		uint8_t sd;
-		uint8_t msdMhd;
-	};
-
-	static const int frameLenWords = 375;
-
-	uint32_t outboundPacket_[frameLenWords];
-	uint32_t *outboundPacketPtr_;
-	struct APS_Status_Registers statusRegs_;
-
-	uint16_t seqnum_;
-
-	std::chrono::time_point<std::chrono::steady_clock> bootTime_;
-
-	size_t reset();
-
-	unsigned int uptime();
+//Applied independently to every packet going either way
+struct LinkImpairments {
+	double delayMS = 0;        //fixed one way delay
+	double jitterMS = 0;       //extra delay drawn uniformly from [0, jitterMS)
+	double dropRate = 0;       //probability a packet is lost
+	double duplicateRate = 0;  //probability a packet is delivered twice
+	double reorderRate = 0;    //probability a packet is held back by reorderMS so later packets overtake it
+	double reorderMS = 1;
+
+	bool active() const {
+		return delayMS > 0 || jitterMS > 0 || dropRate > 0 || duplicateRate > 0 || reorderRate > 0;
+	}
+};
 
-	size_t recv_fpga_file(uint32_t * data,  size_t & length);
-	size_t select_fpga_program();
-	size_t user_io(uint32_t * data,  size_t & length);
-	size_t chip_config(uint32_t * data,  size_t & length);
+class DummyAPS {
+public:
+	DummyAPS(asio::io_service &, const string & ip, const uint64_t & macAddr);
 
-	size_t status(uint32_t * data,  size_t & length);
+	void set_impairments(const LinkImpairments &, const unsigned & seed);
+	//Number of packets dropped, duplicated and reordered so far
+	string impairment_stats() const;
 
-	uint8_t pll_cycles_;
-	uint8_t pll_bypass_;
+	DummyAPS(const DummyAPS &) = delete;
+	DummyAPS & operator=(const DummyAPS &) = delete;
 
-	vector<DACRegisters> dacs;
+	//Run a request as if it had arrived on our socket; used to hand over enumerate broadcasts
+	void handle_packet(const APSEthernetPacket &, const udp::endpoint &);
 
-	map<uint32_t, uint32_t> user_registers_;
+	string ip() const { return ip_; };
 
+private:
+	void setup_receive();
+	void impair(const std::function<void()> &);
+	void send_ack(APSEthernetPacket &, const APSEthernetPacket &, const udp::endpoint &);
+
+	void status(const APSEthernetPacket &, const udp::endpoint &);
+	void user_io(const APSEthernetPacket &, const udp::endpoint &, bool);
+	void chip_config(const APSEthernetPacket &, const udp::endpoint &);
+	void eprom_io(const APSEthernetPacket &, const udp::endpoint &);
+	void fpga_config(const APSEthernetPacket &, const udp::endpoint &, bool);
+	void reboot();
+
+	uint8_t & SPI_register(uint8_t target, uint16_t addr);
+
+	string ip_;
+	MACAddr macAddr_;
+
+	asio::io_service & ios_;
+	udp::socket socket_;
+	uint8_t receivedData_[2048];
+	udp::endpoint senderEndpoint_;
+	vector<uint8_t> sendBuffer_;
+
+	APSStatusBank_t statusRegs_;
+	uint16_t lastSeqNum_;
+	//Sequence check of the packet being handled; reported in the SEQ bit of its acknowledge
+	enum SEQ_ERROR {SEQ_OK, SEQ_SKIP, SEQ_DUPLICATE} seqError_;
+	std::chrono::steady_clock::time_point bootTime_;
+
+	SparseMemory memory_;
+	SparseMemory flash_;
+	SparseMemory bitFile_;
+
+	//SPI device registers and the bytes read back by the last CHIPCONFIGIO instruction stream
+	vector<uint8_t> dacRegs_[2];
+	map<uint16_t, uint8_t> pllRegs_;
+	vector<uint8_t> spiReadback_;
+
+	LinkImpairments impairments_;
+	std::mt19937 rng_;
+	size_t numDropped_, numDuplicated_, numReordered_;
 };
 
-#endif
+#endif /* DUMMYAPS_H_ */
@@ -0,0 +1,98 @@
+#include "EndianSwap.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define APS2_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef void (*SwapKernel)(const uint8_t *, uint8_t *, size_t);
+
+void swap_words_scalar(const uint8_t * src, uint8_t * dst, size_t numWords) {
+	for (size_t ct = 0; ct < numWords; ct++, src += 4, dst += 4) {
+		uint8_t word[4] = {src[3], src[2], src[1], src[0]};
+		memcpy(dst, word, 4);
+	}
+}
+
+#ifdef APS2_X86_SIMD
+
+__attribute__((target("ssse3")))
+void swap_words_ssse3(const uint8_t * src, uint8_t * dst, size_t numWords) {
+	const __m128i mask = _mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+	size_t ct = 0;
+	for (; ct + 4 <= numWords; ct += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4*ct));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4*ct), _mm_shuffle_epi8(v, mask));
+	}
+	swap_words_scalar(src + 4*ct, dst + 4*ct, numWords - ct);
+}
+
+__attribute__((target("avx2")))
+void swap_words_avx2(const uint8_t * src, uint8_t * dst, size_t numWords) {
+	//the shuffle works within each 128-bit lane so the mask is repeated
+	const __m256i mask = _mm256_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+	                                     12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+	size_t ct = 0;
+	for (; ct + 8 <= numWords; ct += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4*ct));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 4*ct), _mm256_shuffle_epi8(v, mask));
+	}
+	swap_words_ssse3(src + 4*ct, dst + 4*ct, numWords - ct);
+}
+
+#endif //APS2_X86_SIMD
+
+struct KernelChoice {
+	SwapKernel kernel;
+	const char * name;
+};
+
+KernelChoice choose_kernel() {
+#ifdef APS2_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return {swap_words_avx2, "avx2"};
+	if (__builtin_cpu_supports("ssse3")) return {swap_words_ssse3, "ssse3"};
+#endif
+	return {swap_words_scalar, "scalar"};
+}
+
+const KernelChoice & kernel_choice() {
+	//initialized once on first use; thread-safe under C++11 static initialization rules
+	static const KernelChoice choice = choose_kernel();
+	return choice;
+}
+
+bool host_is_big_endian() {
+	const uint32_t probe = 1;
+	uint8_t firstByte;
+	memcpy(&firstByte, &probe, 1);
+	return firstByte == 0;
+}
+
+void swap_words(const uint8_t * src, uint8_t * dst, size_t numWords) {
+	//Network order is big-endian so there is nothing to swap on a big-endian host
+	static const bool bigEndian = host_is_big_endian();
+	if (bigEndian) {
+		memmove(dst, src, 4*numWords);
+	} else {
+		kernel_choice().kernel(src, dst, numWords);
+	}
+}
+
+} //anonymous namespace
+
+void host_to_network(const uint32_t * src, uint8_t * dst, size_t numWords) {
+	swap_words(reinterpret_cast<const uint8_t *>(src), dst, numWords);
+}
+
+void network_to_host(const uint8_t * src, uint32_t * dst, size_t numWords) {
+	swap_words(src, reinterpret_cast<uint8_t *>(dst), numWords);
+}
+
+const char * endian_swap_kernel() {
+	return kernel_choice().name;
+}
@@ -0,0 +1,25 @@
+/*
+ * EndianSwap.h
+ *
+ * Bulk conversion of 32-bit words between host and network (big-endian) byte order
+ *
+ * The byte shuffle is vectorized with SSSE3 or AVX2 when the CPU supports it (checked once at run time)
+ * and falls back to a scalar loop otherwise.
+ */
+
+#ifndef ENDIANSWAP_H_
+#define ENDIANSWAP_H_
+
+#include <cstddef>
+#include <cstdint>
+
+//Write numWords host order words to dst in network byte order; dst need not be aligned
+void host_to_network(const uint32_t * src, uint8_t * dst, size_t numWords);
+
+//Read numWords network byte order words from src into host order; src need not be aligned
+void network_to_host(const uint8_t * src, uint32_t * dst, size_t numWords);
+
+//Name of the kernel picked for this CPU e.g. "avx2", "ssse3" or "scalar"
+const char * endian_swap_kernel();
+
+#endif /* ENDIANSWAP_H_ */
@@ -0,0 +1,188 @@
+#include "RegisterBatch.h"
+#include "APS2.h"
+
+RegisterBatch::RegisterBatch(APS2 & aps) : aps_(aps) {};
+
+RegisterBatch::~RegisterBatch() {
+	//Nothing goes to the device unless flush() was called, e.g. when unwinding from an exception
+	if (!ops_.empty()) {
+		FILE_LOG(logWARNING) << "Dropping " << ops_.size() << " unflushed register operations for " << aps_.deviceSerial_;
+	}
+}
+
+void RegisterBatch::write_register(const uint32_t & addr, const uint32_t & data) {
+	ops_.push_back({CSR_WRITE, addr, {data}, {}});
+}
+
+std::future<uint32_t> RegisterBatch::read_register(const uint32_t & addr) {
+	ops_.push_back({CSR_READ, addr, {}, {}});
+	return ops_.back().result.get_future();
+}
+
+void RegisterBatch::write_SPI(const vector<uint32_t> & msg) {
+	ops_.push_back({SPI_WRITE, 0, msg, {}});
+}
+
+std::future<uint32_t> RegisterBatch::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr) {
+	ops_.push_back({SPI_READ, 0, aps_.build_SPI_read_msg(target, addr), {}});
+	return ops_.back().result.get_future();
+}
+
+void RegisterBatch::flush() {
+	/*
+	 * Run the queued operations in order, grouping runs of the same kind of operation.
+	 * If anything fails the outstanding reads get the exception and it is rethrown.
+	 */
+	size_t ct = 0;
+	try {
+		while (ct < ops_.size()) {
+			//Find the end of this run; SPI reads and writes are handled together
+			bool isSPI = (ops_[ct].type == SPI_WRITE) || (ops_[ct].type == SPI_READ);
+			size_t end = ct + 1;
+			while (end < ops_.size() &&
+				(isSPI ? (ops_[end].type == SPI_WRITE || ops_[end].type == SPI_READ) : (ops_[end].type == ops_[ct].type))) {
+				end++;
+			}
+
+			switch (ops_[ct].type) {
+				case CSR_WRITE:
+					flush_CSR_writes(ct, end);
+					break;
+				case CSR_READ:
+					flush_CSR_reads(ct, end);
+					break;
+				default:
+					flush_SPI(ct, end);
+					break;
+			}
+			ct = end;
+		}
+	}
+	catch (...) {
+		for ( ; ct < ops_.size(); ct++) {
+			if (ops_[ct].type == CSR_READ || ops_[ct].type == SPI_READ) {
+				//some reads in the failed run may already have their value
+				try {
+					ops_[ct].result.set_exception(std::current_exception());
+				}
+				catch (std::future_error &) {}
+			}
+		}
+		ops_.clear();
+		throw;
+	}
+	ops_.clear();
+}
+
+void RegisterBatch::flush_CSR_writes(size_t start, size_t end) {
+	//Merge writes to consecutive addresses and send everything as one chunk with a single acknowledge
+	vector<APSEthernetPacket> packets;
+	vector<std::pair<uint32_t, vector<uint32_t>>> segments;
+	for (size_t ct = start; ct < end; ct++) {
+		if (!segments.empty() && (segments.back().first + 4*segments.back().second.size() == ops_[ct].addr)) {
+			segments.back().second.push_back(ops_[ct].data[0]);
+		} else {
+			segments.push_back({ops_[ct].addr, ops_[ct].data});
+		}
+	}
+	for (auto & segment : segments) {
+		auto segmentPackets = aps_.pack_data(segment.first, segment.second);
+		std::move(segmentPackets.begin(), segmentPackets.end(), std::back_inserter(packets));
+		aps_.update_CSR_shadow(segment.first, nullptr, segment.second.size());
+	}
+	FILE_LOG(logDEBUG2) << "Register batch: " << (end - start) << " CSR writes in " << packets.size() << " packets";
+
+	unsigned numPackets = packets.size();
+	if (aps_.ethernetRM_->send(aps_.deviceSerial_, std::move(packets), numPackets) != 0) {
+		throw APS2_RECEIVE_TIMEOUT;
+	}
+	for (auto & segment : segments) {
+		aps_.update_CSR_shadow(segment.first, segment.second.data(), segment.second.size());
+	}
+}
+
+void RegisterBatch::flush_CSR_reads(size_t start, size_t end) {
+	//Serve what we can from the register shadow and pipeline the rest
+	vector<APSEthernetPacket> requests;
+	vector<vector<size_t>> requestOps;
+	for (size_t ct = start; ct < end; ct++) {
+		uint32_t addr = ops_[ct].addr;
+		if (APS2::is_cached_CSR(addr) && aps_.csrShadowValid_[(addr - CSR_AXI_OFFSET) / 4]) {
+			ops_[ct].result.set_value(aps_.csrShadow_[(addr - CSR_AXI_OFFSET) / 4]);
+			continue;
+		}
+		if (!requests.empty() && requests.back().header.command.cnt < MAX_PAYLOAD_WORDS &&
+			(requests.back().header.addr + 4*requests.back().header.command.cnt == addr)) {
+			requests.back().header.command.cnt++;
+		} else {
+			APSEthernetPacket readReq;
+			readReq.header.command.r_w = 1;
+			readReq.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+			readReq.header.command.cnt = 1;
+			readReq.header.addr = addr;
+			requests.push_back(readReq);
+			requestOps.push_back({});
+		}
+		requestOps.back().push_back(ct);
+	}
+	if (requests.empty()) {
+		return;
+	}
+	FILE_LOG(logDEBUG2) << "Register batch: " << (end - start) << " CSR reads in " << requests.size() << " requests";
+
+	//As in APS2::read_memory a short response is requested again; only values the device sent reach the shadow
+	const unsigned MAX_READ_RETRIES = 3;
+	for (unsigned retries = 0; !requests.empty(); retries++) {
+		auto responses = aps_.ethernetRM_->query(aps_.deviceSerial_, requests, aps_.readWindow_);
+		vector<APSEthernetPacket> shortRequests;
+		vector<vector<size_t>> shortRequestOps;
+		for (size_t req = 0; req < responses.size(); req++) {
+			const auto & payload = responses[req].payload;
+			if (payload.size() < requestOps[req].size()) {
+				FILE_LOG(logWARNING) << "Register read of " << requestOps[req].size() << " words from " << hexn<8> <<
+					requests[req].header.addr << " returned only " << std::dec << payload.size();
+				shortRequests.push_back(requests[req]);
+				shortRequestOps.push_back(std::move(requestOps[req]));
+				continue;
+			}
+			aps_.update_CSR_shadow(requests[req].header.addr, payload.data(), requestOps[req].size());
+			for (size_t word = 0; word < requestOps[req].size(); word++) {
+				ops_[requestOps[req][word]].result.set_value(payload[word]);
+			}
+		}
+		if (!shortRequests.empty() && retries == MAX_READ_RETRIES) {
+			FILE_LOG(logERROR) << "Giving up on register reads after short responses";
+			throw APS2_RECEIVE_TIMEOUT;
+		}
+		requests.swap(shortRequests);
+		requestOps.swap(shortRequestOps);
+	}
+}
+
+void RegisterBatch::flush_SPI(size_t start, size_t end) {
+	//Accumulate SPI writes into one message; a read sends the message with its own instructions and then fetches the result
+	vector<uint32_t> msg;
+	auto send_msg = [&]() {
+		if (msg.empty()) return;
+		aps_.write_SPI(msg);
+		msg.clear();
+	};
+
+	for (size_t ct = start; ct < end; ct++) {
+		const auto & instructions = ops_[ct].data;
+		if (msg.size() + instructions.size() > MAX_SPI_BATCH_WORDS) {
+			send_msg();
+		}
+		msg.insert(msg.end(), instructions.begin(), instructions.end());
+		if (ops_[ct].type == SPI_READ) {
+			if (instructions.empty()) {
+				//invalid target; APS2::read_SPI returns 0 as well
+				ops_[ct].result.set_value(0);
+				continue;
+			}
+			send_msg();
+			ops_[ct].result.set_value(aps_.read_SPI_response());
+		}
+	}
+	send_msg();
+}
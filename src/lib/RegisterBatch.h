@@ -0,0 +1,58 @@
+/*
+ * RegisterBatch.h
+ *
+ * Queue CSR and SPI operations for an APS2 and send them in as few packets as possible
+ *
+ * Operations are run in the order they were queued when flush() is called:
+ *  - runs of CSR writes go out back-to-back with a single acknowledge; contiguous addresses share a packet
+ *  - runs of CSR reads are pipelined; contiguous addresses share a request
+ *  - SPI writes are packed into one CHIPCONFIGIO payload which is sent along with the next SPI read's instructions
+ * Read results are delivered through futures that become ready during flush(). Operations still queued when the
+ * batch is destroyed are dropped, so an exception between queueing and flush() sends nothing.
+ */
+
+#ifndef REGISTERBATCH_H_
+#define REGISTERBATCH_H_
+
+#include "headings.h"
+#include <future>
+
+class APS2;
+
+class RegisterBatch {
+public:
+	RegisterBatch(APS2 &);
+	//Drops anything not flushed; reads among them get a broken promise
+	~RegisterBatch();
+
+	RegisterBatch(const RegisterBatch &) = delete;
+	RegisterBatch & operator=(const RegisterBatch &) = delete;
+
+	void write_register(const uint32_t & addr, const uint32_t & data);
+	std::future<uint32_t> read_register(const uint32_t & addr);
+
+	//SPI instruction words as built by APS2::build_DAC_SPI_msg and friends (no end of message)
+	void write_SPI(const vector<uint32_t> &);
+	std::future<uint32_t> read_SPI(const CHIPCONFIG_IO_TARGET &, const uint16_t &);
+
+	void flush();
+
+private:
+	enum OP_TYPE {CSR_WRITE, CSR_READ, SPI_WRITE, SPI_READ};
+
+	struct Operation {
+		OP_TYPE type;
+		uint32_t addr;
+		vector<uint32_t> data;
+		std::promise<uint32_t> result;
+	};
+
+	APS2 & aps_;
+	vector<Operation> ops_;
+
+	void flush_CSR_writes(size_t, size_t);
+	void flush_CSR_reads(size_t, size_t);
+	void flush_SPI(size_t, size_t);
+};
+
+#endif /* REGISTERBATCH_H_ */
@@ -0,0 +1,335 @@
+#include "SequenceSimulator.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define APS2_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+//Instruction header op codes and engine op codes; see doc/instruction-set.rst
+enum OPCODE {WAVEFORM=0, MARKER, WAIT, LOAD_REPEAT, REPEAT, CMP, GOTO, CALL, RETURN, SYNC, PREFETCH};
+enum ENGINE_OPCODE {PLAY=0, WAIT_FOR_TRIG, WAIT_FOR_SYNC};
+enum CMP_CODE {EQUAL=0, NOT_EQUAL, GREATER_THAN, LESS_THAN};
+
+const uint64_t PAYLOAD_MASK = (uint64_t(1) << 56) - 1;
+const int SAMPLES_PER_ADDRESS = 4;
+
+typedef void (*FillKernel)(int16_t *, int16_t, size_t);
+
+void fill_samples_scalar(int16_t * dst, int16_t value, size_t numSamples) {
+	for (size_t ct = 0; ct < numSamples; ct++) {
+		dst[ct] = value;
+	}
+}
+
+#ifdef APS2_X86_SIMD
+
+__attribute__((target("sse2")))
+void fill_samples_sse2(int16_t * dst, int16_t value, size_t numSamples) {
+	const __m128i v = _mm_set1_epi16(value);
+	size_t ct = 0;
+	for (; ct + 8 <= numSamples; ct += 8) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + ct), v);
+	}
+	fill_samples_scalar(dst + ct, value, numSamples - ct);
+}
+
+__attribute__((target("avx2")))
+void fill_samples_avx2(int16_t * dst, int16_t value, size_t numSamples) {
+	const __m256i v = _mm256_set1_epi16(value);
+	size_t ct = 0;
+	for (; ct + 32 <= numSamples; ct += 32) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + ct), v);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + ct + 16), v);
+	}
+	fill_samples_sse2(dst + ct, value, numSamples - ct);
+}
+
+#endif //APS2_X86_SIMD
+
+FillKernel choose_kernel() {
+#ifdef APS2_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return fill_samples_avx2;
+	if (__builtin_cpu_supports("sse2")) return fill_samples_sse2;
+#endif
+	return fill_samples_scalar;
+}
+
+//T/A pairs can hold a level for millions of samples so this is the hot loop of most simulations
+void fill_samples(int16_t * dst, int16_t value, size_t numSamples) {
+	static const FillKernel kernel = choose_kernel();
+	kernel(dst, value, numSamples);
+}
+
+//Grow an engine's output by numSamples and return where they go
+template <typename T>
+T * extend(vector<T> & buffer, const size_t & numSamples) {
+	size_t start = buffer.size();
+	buffer.resize(start + numSamples);
+	return buffer.data() + start;
+}
+
+} //anonymous namespace
+
+SequenceSimulator::SequenceSimulator(const vector<uint64_t> & instructions, const vector<int16_t> & wfA, const vector<int16_t> & wfB) :
+	stats{0, 0, 0, 0, 0}, instructions_(instructions), instructionCounter_{0}, repeatCounter_{0}, cmpRegister_{0},
+	cmpPending_{false}, cmpResult_{false}, waveformTime_{0}, markerTime_{0, 0, 0, 0}, triggerInterval_{0}, nextTrigger_{0},
+	instructionLimit_{uint64_t(1) << 30}, outputStart_{0} {
+	const vector<int16_t> * waveforms[2] = {&wfA, &wfB};
+	for (int ch = 0; ch < 2; ch++) {
+		waveforms_[ch].resize(waveforms[ch]->size());
+		std::transform(waveforms[ch]->begin(), waveforms[ch]->end(), waveforms_[ch].begin(), [](const int16_t & sample) {
+			return std::max<int16_t>(-(MAX_WF_AMP + 1), std::min<int16_t>(MAX_WF_AMP, sample));
+		});
+	}
+}
+
+void SequenceSimulator::set_trigger_interval(const uint64_t & interval) {
+	triggerInterval_ = interval;
+}
+
+void SequenceSimulator::set_comparison_values(const vector<uint8_t> & values) {
+	cmpValues_ = values;
+}
+
+void SequenceSimulator::set_instruction_limit(const uint64_t & limit) {
+	instructionLimit_ = limit;
+}
+
+SIMULATION_STOP SequenceSimulator::run(const uint64_t & numTriggers) {
+	/*
+	 * The decoder is modelled as infinitely fast: every WAVEFORM and MARKER instruction goes straight onto its engine's
+	 * queue and only WAIT and SYNC hold the engines together. The write flag therefore has no effect on the output.
+	 */
+	uint64_t triggersLeft = numTriggers;
+	for (uint64_t executed = 0; ; executed++) {
+		if (instructionCounter_ >= instructions_.size()) {
+			FILE_LOG(logWARNING) << "Sequence ran off the end of instruction memory at " << instructionCounter_;
+			sync_engines();
+			return STOP_SEQUENCE_END;
+		}
+		if (executed == instructionLimit_) {
+			FILE_LOG(logWARNING) << "Sequence simulation stopped after " << executed << " instructions without reaching a WAIT";
+			return STOP_INSTRUCTION_LIMIT;
+		}
+
+		uint64_t instruction = instructions_[instructionCounter_];
+		uint64_t payload = instruction & PAYLOAD_MASK;
+		uint8_t opCode = instruction >> 60;
+		//A CMP result is held through other instructions until the next GOTO, CALL or RETURN, which it conditions
+		bool taken = true;
+		if (opCode == GOTO || opCode == CALL || opCode == RETURN) {
+			taken = !cmpPending_ || cmpResult_;
+			cmpPending_ = false;
+		}
+		instructionCounter_++;
+		stats.instructions++;
+
+		switch (opCode) {
+		case WAVEFORM:
+			//Engine level waits only appear in the payloads of WAIT and SYNC which are handled below
+			if (((payload >> 46) & 0x3) == PLAY) {
+				play_waveform(payload & 0xffffff, (payload >> 24) & 0x1fffff, (payload >> 45) & 0x1);
+			}
+			break;
+		case MARKER:
+			if (((payload >> 46) & 0x3) == PLAY) {
+				play_marker((instruction >> 58) & 0x3, payload & 0xffffffff, (payload >> 32) & 0x1, (payload >> 33) & 0xf);
+			}
+			break;
+		case WAIT:
+			sync_engines();
+			if (triggersLeft == 0) {
+				//Leave the WAIT to be executed again by the next run
+				instructionCounter_--;
+				stats.instructions--;
+				return STOP_TRIGGER_LIMIT;
+			}
+			trigger_engines();
+			triggersLeft--;
+			break;
+		case LOAD_REPEAT:
+			repeatCounter_ = payload & 0xffff;
+			break;
+		case REPEAT:
+			//A count of N-1 plays the loop body N times
+			if (repeatCounter_ > 0) {
+				repeatCounter_--;
+				jump(payload & 0x3ffffff);
+			}
+			break;
+		case CMP: {
+			uint8_t mask = payload & 0xff;
+			switch ((payload >> 8) & 0x3) {
+			case EQUAL:
+				cmpResult_ = (cmpRegister_ == mask);
+				break;
+			case NOT_EQUAL:
+				cmpResult_ = (cmpRegister_ != mask);
+				break;
+			case GREATER_THAN:
+				cmpResult_ = (cmpRegister_ > mask);
+				break;
+			case LESS_THAN:
+				cmpResult_ = (cmpRegister_ < mask);
+				break;
+			}
+			cmpPending_ = true;
+			break;
+		}
+		case GOTO:
+			if (taken) {
+				jump(payload & 0x3ffffff);
+			}
+			break;
+		case CALL:
+			if (taken) {
+				stack_.emplace_back(instructionCounter_, repeatCounter_);
+				stats.maxStackDepth = std::max(stats.maxStackDepth, stack_.size());
+				jump(payload & 0x3ffffff);
+			}
+			break;
+		case RETURN:
+			if (taken) {
+				if (stack_.empty()) {
+					FILE_LOG(logERROR) << "RETURN with an empty stack at instruction " << instructionCounter_ - 1;
+					throw APS2_INVALID_SEQUENCE;
+				}
+				instructionCounter_ = stack_.back().first;
+				repeatCounter_ = stack_.back().second;
+				stack_.pop_back();
+			}
+			break;
+		case SYNC:
+			sync_engines();
+			break;
+		case PREFETCH:
+			//Cache refills are not timed; the engines are assumed to have enough queued to cover them
+			stats.prefetches++;
+			break;
+		default:
+			FILE_LOG(logERROR) << "Unknown op code " << (instruction >> 60) << " at instruction " << instructionCounter_ - 1;
+			throw APS2_INVALID_SEQUENCE;
+		}
+	}
+}
+
+void SequenceSimulator::clear_output() {
+	//Engines may have run ahead of each other so keep what any of them has rendered past the slowest
+	uint64_t newStart = *std::min_element(markerTime_, markerTime_ + 4);
+	newStart = std::min(newStart, waveformTime_);
+	size_t numDropped = newStart - outputStart_;
+	for (auto & buffer : analog_) {
+		buffer.erase(buffer.begin(), buffer.begin() + numDropped);
+	}
+	for (auto & buffer : markers_) {
+		buffer.erase(buffer.begin(), buffer.begin() + numDropped);
+	}
+	outputStart_ = newStart;
+	triggerTimes_.clear();
+}
+
+const vector<int16_t> & SequenceSimulator::get_analog(const int & dac) const {
+	if (dac < 0 || dac > 1) {
+		throw APS2_INVALID_DAC;
+	}
+	return analog_[dac];
+}
+
+const vector<uint8_t> & SequenceSimulator::get_marker(const int & marker) const {
+	if (marker < 0 || marker > 3) {
+		throw std::out_of_range("No such marker");
+	}
+	return markers_[marker];
+}
+
+uint64_t SequenceSimulator::output_start() const {
+	return outputStart_;
+}
+
+const vector<uint64_t> & SequenceSimulator::trigger_times() const {
+	return triggerTimes_;
+}
+
+void SequenceSimulator::play_waveform(const uint64_t & address, const uint64_t & count, const bool & timeAmplitude) {
+	size_t start = SAMPLES_PER_ADDRESS*address;
+	size_t numSamples = SAMPLES_PER_ADDRESS*count;
+	for (int ch = 0; ch < 2; ch++) {
+		const vector<int16_t> & waveform = waveforms_[ch];
+		if (start + (timeAmplitude ? 1 : numSamples) > waveform.size()) {
+			FILE_LOG(logERROR) << "Waveform at address " << address << " with count " << count << " runs past the end of channel " <<
+				ch + 1 << " waveform memory at instruction " << instructionCounter_ - 1;
+			throw APS2_INVALID_SEQUENCE;
+		}
+		int16_t * dst = extend(analog_[ch], numSamples);
+		if (timeAmplitude) {
+			fill_samples(dst, waveform[start], numSamples);
+		} else {
+			memcpy(dst, waveform.data() + start, numSamples*sizeof(int16_t));
+		}
+	}
+	waveformTime_ += numSamples;
+}
+
+void SequenceSimulator::play_marker(const int & marker, const uint64_t & count, const bool & state, const uint8_t & transition) {
+	//The last quad-sample of the count is the transition word, its lowest bit first
+	if (count == 0) {
+		return;
+	}
+	size_t numSamples = SAMPLES_PER_ADDRESS*count;
+	uint8_t * dst = extend(markers_[marker], numSamples);
+	memset(dst, state, numSamples - SAMPLES_PER_ADDRESS);
+	for (int ct = 0; ct < SAMPLES_PER_ADDRESS; ct++) {
+		dst[numSamples - SAMPLES_PER_ADDRESS + ct] = (transition >> ct) & 0x1;
+	}
+	markerTime_[marker] += numSamples;
+}
+
+uint64_t SequenceSimulator::sync_engines() {
+	//Engines that finish early sit at zero until the last one is done
+	uint64_t time = std::max(waveformTime_, *std::max_element(markerTime_, markerTime_ + 4));
+	for (auto & buffer : analog_) {
+		buffer.resize(time - outputStart_, 0);
+	}
+	for (auto & buffer : markers_) {
+		buffer.resize(time - outputStart_, 0);
+	}
+	waveformTime_ = time;
+	std::fill(markerTime_, markerTime_ + 4, time);
+	return time;
+}
+
+void SequenceSimulator::trigger_engines() {
+	/*
+	 * The engines are all waiting at the current time. With a trigger interval the trigger is the first one at or
+	 * after now; any that came while the engines were busy are counted as missed.
+	 */
+	uint64_t time = waveformTime_;
+	if (triggerInterval_ > 0) {
+		if (nextTrigger_ < time) {
+			uint64_t numMissed = (time - nextTrigger_ + triggerInterval_ - 1) / triggerInterval_;
+			stats.missedTriggers += numMissed;
+			nextTrigger_ += numMissed*triggerInterval_;
+		}
+		time = nextTrigger_;
+		nextTrigger_ += triggerInterval_;
+		//Idle until the trigger arrives
+		waveformTime_ = time;
+		sync_engines();
+	}
+	triggerTimes_.push_back(time);
+	cmpRegister_ = cmpValues_.empty() ? 0 : cmpValues_[stats.triggers % cmpValues_.size()];
+	stats.triggers++;
+}
+
+void SequenceSimulator::jump(const uint64_t & address) {
+	if (address >= instructions_.size()) {
+		FILE_LOG(logERROR) << "Jump to " << address << " past the end of the sequence at instruction " << instructionCounter_ - 1;
+		throw APS2_INVALID_SEQUENCE;
+	}
+	instructionCounter_ = address;
+}
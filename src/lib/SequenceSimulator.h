@@ -0,0 +1,90 @@
+/*
+ * SequenceSimulator.h
+ *
+ * Host side model of the APS2 sequencer for checking what a sequence outputs without hardware
+ *
+ * Runs the instructions given to APS2::write_sequence against the channel waveform memories and renders the two
+ * analog outputs and four markers sample by sample. The timing model is described in doc/sequencer.rst. Malformed
+ * sequences (jumps or waveforms out of range, RETURN with an empty stack) throw APS2_INVALID_SEQUENCE.
+ */
+
+#ifndef SEQUENCESIMULATOR_H_
+#define SEQUENCESIMULATOR_H_
+
+#include "headings.h"
+#include "APS2_errno.h"
+
+enum SIMULATION_STOP {STOP_TRIGGER_LIMIT, STOP_INSTRUCTION_LIMIT, STOP_SEQUENCE_END};
+
+struct SimulationStats {
+	uint64_t instructions;
+	uint64_t triggers;
+	//Triggers that arrived while an engine was still busy and were ignored
+	uint64_t missedTriggers;
+	uint64_t prefetches;
+	size_t maxStackDepth;
+};
+
+class SequenceSimulator {
+public:
+	//Waveforms are in DAC units as given to set_waveform and are saturated to the DAC range
+	SequenceSimulator(const vector<uint64_t> &, const vector<int16_t> &, const vector<int16_t> &);
+
+	//Trigger period in samples; the default of 0 triggers as soon as every engine is waiting
+	void set_trigger_interval(const uint64_t &);
+	//Values the comparison register takes on successive triggers, cycling when they run out (default 0)
+	void set_comparison_values(const vector<uint8_t> &);
+	//Instructions a single run may execute before giving up, to catch loops with no WAIT (default 2^30)
+	void set_instruction_limit(const uint64_t &);
+
+	//Run until numTriggers more triggers have been accepted and the next WAIT is reached. A later call picks up
+	//where the last one stopped so a long sequence can be simulated a few triggers at a time with clear_output()
+	//in between.
+	SIMULATION_STOP run(const uint64_t &);
+
+	//Drop the rendered output; the next samples rendered start at output_start()
+	void clear_output();
+
+	const vector<int16_t> & get_analog(const int &) const;
+	//Markers are numbered 0-3 by engine select
+	const vector<uint8_t> & get_marker(const int &) const;
+	//Sample time of the first rendered sample and of each trigger accepted since the last clear_output()
+	uint64_t output_start() const;
+	const vector<uint64_t> & trigger_times() const;
+
+	SimulationStats stats;
+
+private:
+	vector<uint64_t> instructions_;
+	vector<int16_t> waveforms_[2];
+
+	//Control flow state
+	uint64_t instructionCounter_;
+	uint16_t repeatCounter_;
+	vector<std::pair<uint64_t, uint16_t>> stack_;
+	uint8_t cmpRegister_;
+	bool cmpPending_;
+	bool cmpResult_;
+
+	//Each engine's time in samples since the start of the simulation
+	uint64_t waveformTime_;
+	uint64_t markerTime_[4];
+
+	uint64_t triggerInterval_;
+	uint64_t nextTrigger_;
+	vector<uint8_t> cmpValues_;
+	uint64_t instructionLimit_;
+
+	uint64_t outputStart_;
+	vector<int16_t> analog_[2];
+	vector<uint8_t> markers_[4];
+	vector<uint64_t> triggerTimes_;
+
+	void play_waveform(const uint64_t &, const uint64_t &, const bool &);
+	void play_marker(const int &, const uint64_t &, const bool &, const uint8_t &);
+	uint64_t sync_engines();
+	void trigger_engines();
+	void jump(const uint64_t &);
+};
+
+#endif /* SEQUENCESIMULATOR_H_ */
@@ -0,0 +1,149 @@
+#include "UploadSession.h"
+#include "APS2.h"
+
+UploadSession::UploadSession(APS2 & aps) : aps_(aps), owner_(this) {
+	if (aps_.uploadSession_) {
+		owner_ = aps_.uploadSession_;
+	}
+	else {
+		aps_.uploadSession_ = this;
+	}
+};
+
+UploadSession::~UploadSession() {
+	/*
+	 * Only an explicit flush() sends anything. A queue still here means the upload was abandoned, e.g. by an
+	 * exception part way through a load, so it is dropped rather than leaving a partial sequence on the device.
+	 * The host copies were already updated for the queued blocks and no longer match the device.
+	 */
+	if (owner_ != this) {
+		return;
+	}
+	if (!segments_.empty() || !streams_.empty()) {
+		FILE_LOG(logWARNING) << "Dropping " << segments_.size() + streams_.size() << " unflushed uploads for " << aps_.deviceSerial_;
+		aps_.invalidate_memory_copies();
+	}
+	aps_.uploadSession_ = nullptr;
+}
+
+void UploadSession::write_memory(const uint32_t & addr, vector<uint32_t> && data) {
+	owner_->segments_.emplace_back(addr, std::move(data));
+}
+
+void UploadSession::write_memory_stream(const uint32_t & addr, std::function<bool(vector<uint32_t> &)> next) {
+	owner_->streams_.emplace_back(addr, std::move(next));
+}
+
+void UploadSession::flush() {
+	/*
+	 * Send the queued blocks and then the streams bracketed by a single cache disable/enable.
+	 * A failure leaves the device memory unknown so the waveform copies are dropped before rethrowing.
+	 */
+	if (owner_ != this || (segments_.empty() && streams_.empty())) {
+		return;
+	}
+	//Take the queue so a failure does not leave it for the destructor to report again
+	auto segments = std::move(segments_);
+	segments_.clear();
+	auto streams = std::move(streams_);
+	streams_.clear();
+
+	size_t numWords = 0;
+	for (auto & segment : segments) {
+		numWords += segment.second.size();
+	}
+	FILE_LOG(logDEBUG2) << "Uploading " << numWords << " words in " << segments.size() << " blocks and " <<
+		streams.size() << " streams";
+
+	try {
+		// disable cache
+		aps_.write_memory(CACHE_CONTROL_ADDR, 0);
+
+		if (!segments.empty()) {
+			aps_.write_memory_ranges(segments);
+		}
+		for (auto & stream : streams) {
+			send_stream(stream.first, stream.second);
+		}
+
+		// enable cache
+		aps_.write_memory(CACHE_CONTROL_ADDR, 1);
+	}
+	catch (...) {
+		aps_.invalidate_memory_copies();
+		throw;
+	}
+}
+
+void UploadSession::send_stream(const uint32_t & addr, const std::function<bool(vector<uint32_t> &)> & next) {
+	/*
+	 * Make the chunks on a producer thread and send them from this one as they become ready.
+	 * An error on either side stops both; the producer's is rethrown here.
+	 */
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<vector<uint32_t>> chunks;
+	bool done = false, abort = false;
+	std::exception_ptr error;
+
+	std::thread producer([&]() {
+		try {
+			bool more = true;
+			while (more) {
+				vector<uint32_t> chunk;
+				more = next(chunk);
+				std::unique_lock<std::mutex> guard(lock);
+				cond.wait(guard, [&](){ return chunks.size() < UPLOAD_STREAM_DEPTH || abort; });
+				if (abort) {
+					break;
+				}
+				if (!chunk.empty()) {
+					chunks.push_back(std::move(chunk));
+					cond.notify_all();
+				}
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> guard(lock);
+			error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+		cond.notify_all();
+	});
+
+	uint32_t chunkAddr = addr;
+	size_t numWords = 0;
+	try {
+		while (true) {
+			vector<std::pair<uint32_t, vector<uint32_t>>> segment(1);
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				cond.wait(guard, [&](){ return !chunks.empty() || done; });
+				if (error || chunks.empty()) {
+					break;
+				}
+				segment[0] = {chunkAddr, std::move(chunks.front())};
+				chunks.pop_front();
+				cond.notify_all();
+			}
+			aps_.write_memory_ranges(segment);
+			chunkAddr += 4*segment[0].second.size();
+			numWords += segment[0].second.size();
+		}
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			abort = true;
+		}
+		cond.notify_all();
+		producer.join();
+		throw;
+	}
+	producer.join();
+	if (error) {
+		std::rethrow_exception(error);
+	}
+	FILE_LOG(logDEBUG2) << "Streamed " << numWords << " words to address " << myhex << addr;
+}
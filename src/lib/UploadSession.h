@@ -0,0 +1,50 @@
+/*
+ * UploadSession.h
+ *
+ * Collect waveform and sequence memory writes for an APS2 and send them with the cache disabled only once
+ *
+ * While a session is open every waveform and sequence upload on the APS2 is queued on it instead of being sent.
+ * flush() then disables the cache, sends all the queued blocks in one windowed transfer and re-enables the cache.
+ * Nothing is sent without flush(); a session destroyed with blocks still queued drops them.
+ * Sessions nest: one opened while another is open on the same APS2 passes its blocks to the outer one and its
+ * own flush() does nothing.
+ *
+ * Blocks too big to hold in memory can be queued as streams. Their chunks are produced on a separate thread
+ * during flush() while the ones already made are sent, with at most UPLOAD_STREAM_DEPTH chunks waiting.
+ */
+
+#ifndef UPLOADSESSION_H_
+#define UPLOADSESSION_H_
+
+#include "headings.h"
+#include <functional>
+
+class APS2;
+
+class UploadSession {
+public:
+	UploadSession(APS2 &);
+	//Drops anything not flushed and forgets what the device memory holds
+	~UploadSession();
+
+	UploadSession(const UploadSession &) = delete;
+	UploadSession & operator=(const UploadSession &) = delete;
+
+	//Queue a block of memory words at a byte address
+	void write_memory(const uint32_t & addr, vector<uint32_t> && data);
+	//Queue a block made a chunk at a time; next fills in the next chunk and returns false after the last one
+	void write_memory_stream(const uint32_t & addr, std::function<bool(vector<uint32_t> &)> next);
+
+	void flush();
+
+private:
+	APS2 & aps_;
+	//The session that owns the queue; this one unless nested
+	UploadSession * owner_;
+	vector<std::pair<uint32_t, vector<uint32_t>>> segments_;
+	vector<std::pair<uint32_t, std::function<bool(vector<uint32_t> &)>>> streams_;
+
+	void send_stream(const uint32_t &, const std::function<bool(vector<uint32_t> &)> &);
+};
+
+#endif /* UPLOADSESSION_H_ */
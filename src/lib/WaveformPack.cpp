@@ -0,0 +1,285 @@
+#include "WaveformPack.h"
+#include "constants.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define APS2_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef int (*FloatPackKernel)(const float *, const uint8_t *, size_t, float, float, uint32_t *);
+typedef int (*IntPackKernel)(const int16_t *, const uint8_t *, size_t, float, float, uint32_t *);
+
+//Clipping limits in DAC units; signed integer data is asymmetric: can go to -8192 but only up to 8191.
+const float MAX_SAMPLE = MAX_WF_AMP;
+const float MIN_SAMPLE = -(MAX_WF_AMP + 1);
+
+inline uint32_t merge_marker(int32_t sample, uint8_t marker) {
+	return (static_cast<uint32_t>(sample) & 0x3FFF) | ((marker & 0x3u) << 14);
+}
+
+inline uint32_t prep_sample(float scaled, uint8_t marker, int & clipped) {
+	//Only values that would truncate past the limits count as clipped
+	if (scaled >= MAX_SAMPLE + 1) clipped |= WAVEFORM_CLIPPED_HIGH;
+	if (scaled <= MIN_SAMPLE - 1) clipped |= WAVEFORM_CLIPPED_LOW;
+	//Written so a NaN ends up at the top of the range like it does in the vector kernels
+	if (!(scaled <= MAX_SAMPLE)) scaled = MAX_SAMPLE;
+	if (scaled < MIN_SAMPLE) scaled = MIN_SAMPLE;
+	return merge_marker(static_cast<int32_t>(scaled), marker);
+}
+
+inline uint32_t prep_sample(int16_t val, uint8_t marker, int & clipped) {
+	int32_t sample = val;
+	if (sample > MAX_WF_AMP) {
+		clipped |= WAVEFORM_CLIPPED_HIGH;
+		sample = MAX_WF_AMP;
+	}
+	if (sample < -(MAX_WF_AMP + 1)) {
+		clipped |= WAVEFORM_CLIPPED_LOW;
+		sample = -(MAX_WF_AMP + 1);
+	}
+	return merge_marker(sample, marker);
+}
+
+bool is_identity(float scale, float offset) {
+	return scale == 1.0f && offset == 0.0f;
+}
+
+int pack_waveform_scalar(const float * waveform, const uint8_t * markers, size_t numPoints,
+                         float scale, float offset, uint32_t * dst) {
+	int clipped = 0;
+	for (size_t ct = 0; ct + 1 < numPoints; ct += 2) {
+		*dst++ = (prep_sample(MAX_WF_AMP*(scale*waveform[ct] + offset), markers[ct], clipped) << 16) |
+		          prep_sample(MAX_WF_AMP*(scale*waveform[ct+1] + offset), markers[ct+1], clipped);
+	}
+	return clipped;
+}
+
+int pack_waveform_scalar(const int16_t * waveform, const uint8_t * markers, size_t numPoints,
+                         float scale, float offset, uint32_t * dst) {
+	int clipped = 0;
+	if (is_identity(scale, offset)) {
+		for (size_t ct = 0; ct + 1 < numPoints; ct += 2) {
+			*dst++ = (prep_sample(waveform[ct], markers[ct], clipped) << 16) | prep_sample(waveform[ct+1], markers[ct+1], clipped);
+		}
+	}
+	else {
+		//Integer samples are already in DAC units so only the offset needs scaling
+		const float ampOffset = MAX_WF_AMP*offset;
+		for (size_t ct = 0; ct + 1 < numPoints; ct += 2) {
+			*dst++ = (prep_sample(scale*waveform[ct] + ampOffset, markers[ct], clipped) << 16) |
+			          prep_sample(scale*waveform[ct+1] + ampOffset, markers[ct+1], clipped);
+		}
+	}
+	return clipped;
+}
+
+#ifdef APS2_X86_SIMD
+
+//Merge 8 samples with their markers, swap each pair so the first sample is in the upper half and store 4 words
+__attribute__((target("sse2")))
+inline void store_samples_sse2(__m128i samples, const uint8_t * markers, uint32_t * dst) {
+	__m128i marks = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(markers)), _mm_setzero_si128());
+	samples = _mm_and_si128(samples, _mm_set1_epi16(0x3FFF));
+	samples = _mm_or_si128(samples, _mm_slli_epi16(_mm_and_si128(marks, _mm_set1_epi16(0x3)), 14));
+	samples = _mm_or_si128(_mm_slli_epi32(samples, 16), _mm_srli_epi32(samples, 16));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), samples);
+}
+
+//Clip 8 scaled samples in DAC units, note any clipping and store them
+__attribute__((target("sse2")))
+inline void store_scaled_sse2(__m128 a, __m128 b, const uint8_t * markers, uint32_t * dst, __m128 & high, __m128 & low) {
+	const __m128 vHigh = _mm_set1_ps(MAX_SAMPLE + 1);
+	const __m128 vLow = _mm_set1_ps(MIN_SAMPLE - 1);
+	high = _mm_or_ps(high, _mm_or_ps(_mm_cmpge_ps(a, vHigh), _mm_cmpge_ps(b, vHigh)));
+	low = _mm_or_ps(low, _mm_or_ps(_mm_cmple_ps(a, vLow), _mm_cmple_ps(b, vLow)));
+	//min returns its second operand for a NaN
+	a = _mm_max_ps(_mm_min_ps(a, _mm_set1_ps(MAX_SAMPLE)), _mm_set1_ps(MIN_SAMPLE));
+	b = _mm_max_ps(_mm_min_ps(b, _mm_set1_ps(MAX_SAMPLE)), _mm_set1_ps(MIN_SAMPLE));
+	//the clamp keeps the truncated values in int16 range so the saturating pack does not change them
+	store_samples_sse2(_mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)), markers, dst);
+}
+
+__attribute__((target("sse2")))
+int pack_waveform_sse2(const float * waveform, const uint8_t * markers, size_t numPoints,
+                       float scale, float offset, uint32_t * dst) {
+	const __m128 vScale = _mm_set1_ps(scale);
+	const __m128 vOffset = _mm_set1_ps(offset);
+	const __m128 vAmp = _mm_set1_ps(MAX_WF_AMP);
+	__m128 high = _mm_setzero_ps();
+	__m128 low = _mm_setzero_ps();
+
+	size_t ct = 0;
+	for (; ct + 8 <= numPoints; ct += 8, dst += 4) {
+		__m128 a = _mm_mul_ps(vAmp, _mm_add_ps(_mm_mul_ps(vScale, _mm_loadu_ps(waveform + ct)), vOffset));
+		__m128 b = _mm_mul_ps(vAmp, _mm_add_ps(_mm_mul_ps(vScale, _mm_loadu_ps(waveform + ct + 4)), vOffset));
+		store_scaled_sse2(a, b, markers + ct, dst, high, low);
+	}
+
+	int clipped = pack_waveform_scalar(waveform + ct, markers + ct, numPoints - ct, scale, offset, dst);
+	if (_mm_movemask_ps(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+	if (_mm_movemask_ps(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	return clipped;
+}
+
+__attribute__((target("sse2")))
+int pack_waveform_sse2(const int16_t * waveform, const uint8_t * markers, size_t numPoints,
+                       float scale, float offset, uint32_t * dst) {
+	size_t ct = 0;
+	int clipped = 0;
+	if (is_identity(scale, offset)) {
+		//No arithmetic; just saturate to 14 bits
+		const __m128i vMax = _mm_set1_epi16(MAX_WF_AMP);
+		const __m128i vMin = _mm_set1_epi16(-(MAX_WF_AMP + 1));
+		__m128i high = _mm_setzero_si128();
+		__m128i low = _mm_setzero_si128();
+		for (; ct + 8 <= numPoints; ct += 8, dst += 4) {
+			__m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(waveform + ct));
+			high = _mm_or_si128(high, _mm_cmpgt_epi16(samples, vMax));
+			low = _mm_or_si128(low, _mm_cmplt_epi16(samples, vMin));
+			store_samples_sse2(_mm_max_epi16(_mm_min_epi16(samples, vMax), vMin), markers + ct, dst);
+		}
+		if (_mm_movemask_epi8(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+		if (_mm_movemask_epi8(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	}
+	else {
+		const __m128 vScale = _mm_set1_ps(scale);
+		const __m128 vOffset = _mm_set1_ps(MAX_WF_AMP*offset);
+		__m128 high = _mm_setzero_ps();
+		__m128 low = _mm_setzero_ps();
+		for (; ct + 8 <= numPoints; ct += 8, dst += 4) {
+			__m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(waveform + ct));
+			//sign extend to 32 bits by unpacking into the upper halves and shifting back down
+			__m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+			__m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+			a = _mm_add_ps(_mm_mul_ps(vScale, a), vOffset);
+			b = _mm_add_ps(_mm_mul_ps(vScale, b), vOffset);
+			store_scaled_sse2(a, b, markers + ct, dst, high, low);
+		}
+		if (_mm_movemask_ps(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+		if (_mm_movemask_ps(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	}
+	return clipped | pack_waveform_scalar(waveform + ct, markers + ct, numPoints - ct, scale, offset, dst);
+}
+
+//AVX2 versions of the helpers above for 16 samples at a time
+__attribute__((target("avx2")))
+inline void store_samples_avx2(__m256i samples, const uint8_t * markers, uint32_t * dst) {
+	__m256i marks = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(markers)));
+	samples = _mm256_and_si256(samples, _mm256_set1_epi16(0x3FFF));
+	samples = _mm256_or_si256(samples, _mm256_slli_epi16(_mm256_and_si256(marks, _mm256_set1_epi16(0x3)), 14));
+	samples = _mm256_or_si256(_mm256_slli_epi32(samples, 16), _mm256_srli_epi32(samples, 16));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), samples);
+}
+
+__attribute__((target("avx2")))
+inline void store_scaled_avx2(__m256 a, __m256 b, const uint8_t * markers, uint32_t * dst, __m256 & high, __m256 & low) {
+	const __m256 vHigh = _mm256_set1_ps(MAX_SAMPLE + 1);
+	const __m256 vLow = _mm256_set1_ps(MIN_SAMPLE - 1);
+	high = _mm256_or_ps(high, _mm256_or_ps(_mm256_cmp_ps(a, vHigh, _CMP_GE_OQ), _mm256_cmp_ps(b, vHigh, _CMP_GE_OQ)));
+	low = _mm256_or_ps(low, _mm256_or_ps(_mm256_cmp_ps(a, vLow, _CMP_LE_OQ), _mm256_cmp_ps(b, vLow, _CMP_LE_OQ)));
+	a = _mm256_max_ps(_mm256_min_ps(a, _mm256_set1_ps(MAX_SAMPLE)), _mm256_set1_ps(MIN_SAMPLE));
+	b = _mm256_max_ps(_mm256_min_ps(b, _mm256_set1_ps(MAX_SAMPLE)), _mm256_set1_ps(MIN_SAMPLE));
+	//the pack works within each 128-bit lane so put the quarters back in order afterwards
+	__m256i samples = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+	store_samples_avx2(_mm256_permute4x64_epi64(samples, _MM_SHUFFLE(3,1,2,0)), markers, dst);
+}
+
+__attribute__((target("avx2")))
+int pack_waveform_avx2(const float * waveform, const uint8_t * markers, size_t numPoints,
+                       float scale, float offset, uint32_t * dst) {
+	const __m256 vScale = _mm256_set1_ps(scale);
+	const __m256 vOffset = _mm256_set1_ps(offset);
+	const __m256 vAmp = _mm256_set1_ps(MAX_WF_AMP);
+	__m256 high = _mm256_setzero_ps();
+	__m256 low = _mm256_setzero_ps();
+
+	size_t ct = 0;
+	for (; ct + 16 <= numPoints; ct += 16, dst += 8) {
+		__m256 a = _mm256_mul_ps(vAmp, _mm256_add_ps(_mm256_mul_ps(vScale, _mm256_loadu_ps(waveform + ct)), vOffset));
+		__m256 b = _mm256_mul_ps(vAmp, _mm256_add_ps(_mm256_mul_ps(vScale, _mm256_loadu_ps(waveform + ct + 8)), vOffset));
+		store_scaled_avx2(a, b, markers + ct, dst, high, low);
+	}
+
+	int clipped = pack_waveform_sse2(waveform + ct, markers + ct, numPoints - ct, scale, offset, dst);
+	if (_mm256_movemask_ps(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+	if (_mm256_movemask_ps(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	return clipped;
+}
+
+__attribute__((target("avx2")))
+int pack_waveform_avx2(const int16_t * waveform, const uint8_t * markers, size_t numPoints,
+                       float scale, float offset, uint32_t * dst) {
+	size_t ct = 0;
+	int clipped = 0;
+	if (is_identity(scale, offset)) {
+		const __m256i vMax = _mm256_set1_epi16(MAX_WF_AMP);
+		const __m256i vMin = _mm256_set1_epi16(-(MAX_WF_AMP + 1));
+		__m256i high = _mm256_setzero_si256();
+		__m256i low = _mm256_setzero_si256();
+		for (; ct + 16 <= numPoints; ct += 16, dst += 8) {
+			__m256i samples = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(waveform + ct));
+			high = _mm256_or_si256(high, _mm256_cmpgt_epi16(samples, vMax));
+			low = _mm256_or_si256(low, _mm256_cmpgt_epi16(vMin, samples));
+			store_samples_avx2(_mm256_max_epi16(_mm256_min_epi16(samples, vMax), vMin), markers + ct, dst);
+		}
+		if (_mm256_movemask_epi8(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+		if (_mm256_movemask_epi8(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	}
+	else {
+		const __m256 vScale = _mm256_set1_ps(scale);
+		const __m256 vOffset = _mm256_set1_ps(MAX_WF_AMP*offset);
+		__m256 high = _mm256_setzero_ps();
+		__m256 low = _mm256_setzero_ps();
+		for (; ct + 16 <= numPoints; ct += 16, dst += 8) {
+			__m256 a = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(waveform + ct))));
+			__m256 b = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(waveform + ct + 8))));
+			a = _mm256_add_ps(_mm256_mul_ps(vScale, a), vOffset);
+			b = _mm256_add_ps(_mm256_mul_ps(vScale, b), vOffset);
+			store_scaled_avx2(a, b, markers + ct, dst, high, low);
+		}
+		if (_mm256_movemask_ps(high)) clipped |= WAVEFORM_CLIPPED_HIGH;
+		if (_mm256_movemask_ps(low)) clipped |= WAVEFORM_CLIPPED_LOW;
+	}
+	return clipped | pack_waveform_sse2(waveform + ct, markers + ct, numPoints - ct, scale, offset, dst);
+}
+
+#endif //APS2_X86_SIMD
+
+struct KernelChoice {
+	FloatPackKernel floatKernel;
+	IntPackKernel intKernel;
+	const char * name;
+};
+
+KernelChoice choose_kernel() {
+#ifdef APS2_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return {pack_waveform_avx2, pack_waveform_avx2, "avx2"};
+	if (__builtin_cpu_supports("sse2")) return {pack_waveform_sse2, pack_waveform_sse2, "sse2"};
+#endif
+	return {pack_waveform_scalar, pack_waveform_scalar, "scalar"};
+}
+
+const KernelChoice & kernel_choice() {
+	//initialized once on first use; thread-safe under C++11 static initialization rules
+	static const KernelChoice choice = choose_kernel();
+	return choice;
+}
+
+} //anonymous namespace
+
+int pack_waveform(const float * waveform, const uint8_t * markers, size_t numPoints,
+                  float scale, float offset, uint32_t * dst) {
+	return kernel_choice().floatKernel(waveform, markers, numPoints, scale, offset, dst);
+}
+
+int pack_waveform(const int16_t * waveform, const uint8_t * markers, size_t numPoints,
+                  float scale, float offset, uint32_t * dst) {
+	return kernel_choice().intKernel(waveform, markers, numPoints, scale, offset, dst);
+}
+
+const char * waveform_pack_kernel() {
+	return kernel_choice().name;
+}
@@ -0,0 +1,42 @@
+/*
+ * WaveformPack.h
+ *
+ * Conversion of float waveforms and markers into the packed words the APS2 waveform memory holds
+ *
+ * Each sample is scaled, offset, clipped to the signed 14-bit DAC range and merged with its 2 marker bits
+ * in a single pass. Float waveforms are in units of full scale and int16 waveforms in DAC units. The pass is vectorized with SSE2 or AVX2 when the CPU supports it (checked once at
+ * run time) and falls back to a scalar loop otherwise.
+ */
+
+#ifndef WAVEFORMPACK_H_
+#define WAVEFORMPACK_H_
+
+#include <cstddef>
+#include <cstdint>
+
+//Flags returned by pack_waveform when samples had to be clipped
+enum WAVEFORM_CLIP {
+	WAVEFORM_CLIPPED_HIGH = 1,
+	WAVEFORM_CLIPPED_LOW = 2
+};
+
+/*
+ * Pack numPoints samples (a multiple of 2) into numPoints/2 words of dst. Each sample becomes
+ * int16(MAX_WF_AMP*(scale*waveform + offset)) saturated to [-(MAX_WF_AMP+1), MAX_WF_AMP] in bits 0-13
+ * with the bottom 2 bits of its marker in bits 14-15. Each word holds two samples with the first in
+ * the upper half. Returns a combination of WAVEFORM_CLIP flags.
+ */
+int pack_waveform(const float * waveform, const uint8_t * markers, size_t numPoints,
+                  float scale, float offset, uint32_t * dst);
+
+/*
+ * As above for samples already in DAC units: each becomes scale*waveform + MAX_WF_AMP*offset. With the
+ * identity scale and offset the samples are only saturated and no floating point work is done.
+ */
+int pack_waveform(const int16_t * waveform, const uint8_t * markers, size_t numPoints,
+                  float scale, float offset, uint32_t * dst);
+
+//Name of the kernel picked for this CPU e.g. "avx2", "sse2" or "scalar"
+const char * waveform_pack_kernel();
+
+#endif /* WAVEFORMPACK_H_ */
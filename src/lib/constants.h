@@ -25,6 +25,22 @@ static const size_t MAX_LL_LENGTH = (1 << 24);
 static const int APS_READTIMEOUT = 1000;
 static const int APS_WRITETIMEOUT = 500;
 
+//Bulk memory writes are acknowledged every WRITE_ACK_INTERVAL packets with up to WRITE_WINDOW chunks in flight
+static const unsigned WRITE_ACK_INTERVAL = 20;
+static const unsigned WRITE_WINDOW = 4;
+//Number of read requests kept outstanding when a memory read is split into multiple packets
+static const unsigned READ_WINDOW = 16;
+//Changed runs of waveform words closer than this are uploaded together rather than as separate writes
+static const size_t WAVEFORM_MERGE_GAP = 32;
+//Instructions read, packed and sent at a time when streaming a sequence from file; a multiple of 128
+static const size_t SEQUENCE_CHUNK_LENGTH = (1 << 16);
+//Number of packed chunks a stream may have waiting to be sent
+static const size_t UPLOAD_STREAM_DEPTH = 4;
+
+// ethernet frame payload = 1500bytes - 20bytes IPV4 and 8 bytes UDP and 24 bytes APS header (with address field) = 1448bytes = 362 words
+// for unknown reasons, we see occasional failures when using packets that large. 256 seems to be more stable.
+static const uint32_t MAX_PAYLOAD_WORDS = 256;
+
 static const int MAX_PHASE_TEST_CNT = 20;
 
 //Chip config SPI commands for setting up DAC,PLL,VXCO
@@ -235,6 +251,14 @@ static const uint32_t DAC_BIST_CHB_PH2_ADDR = CSR_AXI_OFFSET + 16*4;
 static const uint32_t DMA_STATUS_ADDR    = CSR_AXI_OFFSET + 17*4;
 static const uint32_t SATA_STATUS_ADDR   = CSR_AXI_OFFSET + 18*4;
 static const uint32_t INIT_STATUS_ADDR   = CSR_AXI_OFFSET + 19*4;
+static const uint32_t NUM_CSR_REGS       = 20;
+
+//CSRs the hardware updates on its own; these are never served from the host side register shadow
+static const uint32_t VOLATILE_CSR_ADDRS[] = {
+	PLL_STATUS_ADDR, PHASE_COUNT_A_ADDR, PHASE_COUNT_B_ADDR, CACHE_STATUS_ADDR, TRIGGER_WORD_ADDR,
+	DAC_BIST_CHA_PH1_ADDR, DAC_BIST_CHA_PH2_ADDR, DAC_BIST_CHB_PH1_ADDR, DAC_BIST_CHB_PH2_ADDR,
+	DMA_STATUS_ADDR, SATA_STATUS_ADDR
+};
 
 
 static const uint32_t MEMORY_ADDR = 0x00000000u;
@@ -268,6 +292,9 @@ static const int MIG_C1_CAL_BIT    = 27;
 static const int AXI_RESET_BIT     = 21;
 static const int AXI_RESETN_BIT    = 20;
 
+//Most SPI instruction words RegisterBatch packs into a single CHIPCONFIGIO packet; PLL_INIT sends 26 in one go
+static const size_t MAX_SPI_BATCH_WORDS = 32;
+
 //DAC SPI Addresses
 static const uint8_t DAC_SYNC_ADDR = 0x0;
 static const uint8_t DAC_INTERRUPT_ADDR = 0x1; // LVDS[7] SYNC[6]
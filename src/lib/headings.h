@@ -17,6 +17,7 @@
 #include <cstring>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <unordered_map>
 #include <map>
 #include <set>
@@ -28,6 +29,7 @@
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <bitset>
  
 using std::endl;
 using std::vector;
@@ -43,6 +45,7 @@ using std::runtime_error;
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <utility>
 #include <chrono>
@@ -106,6 +109,24 @@ vector<T> h5array2vector(const H5::H5File * h5File, const string & dataPath, con
    return vecOut;
  };
 
+//Helper function for reading count elements starting at offset from a 1D dataset; extra dimensions must be 1
+template <typename T>
+void h5array2buffer(const H5::DataSet & h5Array, const hsize_t & offset, const hsize_t & count, T * buffer, const H5::DataType & dt = H5::PredType::NATIVE_DOUBLE)
+ {
+   H5::DataSpace fileSpace = h5Array.getSpace();
+   int rank = fileSpace.getSimpleExtentNdims();
+   vector<hsize_t> start(rank, 0), extent(rank, 1);
+   start[0] = offset;
+   extent[0] = count;
+   fileSpace.selectHyperslab(H5S_SELECT_SET, extent.data(), start.data());
+
+   H5::DataSpace memSpace(1, &count);
+   h5Array.read(buffer, dt, memSpace, fileSpace);
+
+   memSpace.close();
+   fileSpace.close();
+ };
+
 //Helper function for saving 1D dataset from H5 files
 template <typename T>
 int vector2h5array(vector<T> & vectIn, const H5::H5File * h5File, const string & name, const string & dataPath, const H5::DataType & dt = H5::PredType::NATIVE_DOUBLE)
@@ -159,6 +180,12 @@ T h5element2element(const string & name, const H5::Group * group, const H5::Data
 	return element;
 }
 
+//The HDF5 library is not necessarily built thread-safe so serialize every use of it through this lock
+inline std::mutex & h5_mutex() {
+	static std::mutex h5Mutex;
+	return h5Mutex;
+}
+
 inline int mymod(int a, int b) {
 	int c = a % b;
 	if (c < 0)
@@ -8,12 +8,22 @@
 #include "headings.h"
 #include "libaps2.h"
 #include "APS2.h"
+#include "BinarySequence.h"
 #include "APSEthernet.h"
 #include "asio.hpp"
 
+//Each connected device carries its own lock so calls to different devices run in parallel
+//while calls to the same device are serialized
+struct APS2Device {
+	APS2Device(const string & serial) : aps(serial) {};
+	APS2 aps;
+	std::mutex lock;
+};
+
 weak_ptr<APSEthernet> ethernetRM; //resource manager for the asio ethernet interface
-map<string, APS2> APSs; //map to hold on to the APS instances
+map<string, shared_ptr<APS2Device>> APSs; //map to hold on to the APS instances
 set<string> deviceSerials; // set of APSs that responded to an enumerate broadcast
+std::mutex registryLock; //guards ethernetRM, APSs and deviceSerials but is never held while talking to a device
 
 // stub class to close the logger file handle when the driver goes out of scope
 class InitAndCleanUp {
@@ -37,6 +47,7 @@ InitAndCleanUp initandcleanup_;
 
 //Return the shared_ptr to the Ethernet interface
 shared_ptr<APSEthernet> get_interface() {
+	std::lock_guard<std::mutex> lock(registryLock);
 	//See if we have to setup our own RM
 	shared_ptr<APSEthernet> myEthernetRM = ethernetRM.lock();
 
@@ -48,22 +59,28 @@ shared_ptr<APSEthernet> get_interface() {
 	return myEthernetRM;
 }
 
+//Look up a device; holding the shared_ptr keeps it alive even if another thread disconnects it meanwhile
+shared_ptr<APS2Device> get_device(const string & deviceSerial) {
+	std::lock_guard<std::mutex> lock(registryLock);
+	auto iter = APSs.find(deviceSerial);
+	return (iter == APSs.end()) ? nullptr : iter->second;
+}
+
 //Define a couple of templated wrapper functions to make library calls and catch thrown errors
+//Both take the device's lock for the duration of the call
 //First one for void calls
 template<typename F, typename... Args>
 APS2_STATUS aps2_call(const char* deviceSerial, F func, Args... args){
+	auto device = get_device(deviceSerial);
+	if (!device) {
+		return APS2_UNCONNECTED;
+	}
 	try {
-		(APSs.at(deviceSerial).*func)(args...);
+		std::lock_guard<std::mutex> lock(device->lock);
+		(device->aps.*func)(args...);
 		//Nothing thrown then assume OK
 		return APS2_OK;
 	}
-	catch (std::out_of_range e) {
-		if (APSs.find(deviceSerial) == APSs.end()) {
-			return APS2_UNCONNECTED;
-		} else {
-			return APS2_UNKNOWN_ERROR;
-		}
-	}
 	catch (APS2_STATUS status) {
 		return status;
 	}
@@ -75,18 +92,16 @@ APS2_STATUS aps2_call(const char* deviceSerial, F func, Args... args){
 //and one for to store getter values in pointer passed to library
 template<typename R, typename F, typename... Args>
 APS2_STATUS aps2_getter(const char* deviceSerial, F func, R* resPtr, Args... args){
+	auto device = get_device(deviceSerial);
+	if (!device) {
+		return APS2_UNCONNECTED;
+	}
 	try {
-		*resPtr = (APSs.at(deviceSerial).*func)(args...);
+		std::lock_guard<std::mutex> lock(device->lock);
+		*resPtr = (device->aps.*func)(args...);
 		//Nothing thrown then assume OK
 		return APS2_OK;
 	}
-	catch (std::out_of_range e) {
-		if (APSs.find(deviceSerial) == APSs.end()) {
-			return APS2_UNCONNECTED;
-		} else {
-			return APS2_UNKNOWN_ERROR;
-		}
-	}
 	catch (APS2_STATUS status) {
 		return status;
 	}
@@ -95,6 +110,49 @@ APS2_STATUS aps2_getter(const char* deviceSerial, F func, R* resPtr, Args... arg
 	}
 }
 
+//Fan a call out across several devices at once with one thread per distinct device
+//func(idx) handles entry idx of the serials array; repeated serials are run in order on the same thread
+//Per-device results go in statuses (if not null) and the first failure in array order is returned
+template<typename F>
+APS2_STATUS aps2_multi_call(const char** deviceSerialsIn, unsigned int numDevices, APS2_STATUS* statuses, F func){
+	vector<APS2_STATUS> localStatuses;
+	if (!statuses) {
+		localStatuses.resize(numDevices);
+		statuses = localStatuses.data();
+	}
+
+	map<string, vector<unsigned int>> devIndices;
+	for (unsigned int ct = 0; ct < numDevices; ct++) {
+		devIndices[string(deviceSerialsIn[ct])].push_back(ct);
+		statuses[ct] = APS2_UNKNOWN_ERROR;
+	}
+
+	vector<std::thread> workers;
+	try {
+		for (auto & kv : devIndices) {
+			const vector<unsigned int> & indices = kv.second;
+			workers.emplace_back([&indices, &func, statuses](){
+				for (auto idx : indices) {
+					statuses[idx] = func(idx);
+				}
+			});
+		}
+	}
+	catch (std::system_error & e) {
+		FILE_LOG(logERROR) << "Unable to start device thread: " << e.what();
+	}
+	for (auto & worker : workers) {
+		worker.join();
+	}
+
+	for (unsigned int ct = 0; ct < numDevices; ct++) {
+		if (statuses[ct] != APS2_OK) {
+			return statuses[ct];
+		}
+	}
+	return APS2_OK;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -113,7 +171,9 @@ APS2_STATUS get_numDevices(unsigned int* numDevices) {
 	Returns the number of APS2s that respond to a broadcast status request.
 	*/
 	try {
-		deviceSerials = get_interface()->enumerate();
+		auto serials = get_interface()->enumerate();
+		std::lock_guard<std::mutex> lock(registryLock);
+		deviceSerials = serials;
 		*numDevices = deviceSerials.size();
 		return APS2_OK;
 	}
@@ -131,6 +191,7 @@ APS2_STATUS get_deviceSerials(const char** deviceSerialsOut) {
 	enumerated device ip addresses.
 	Assumes sufficient memory has been allocated
 	*/
+	std::lock_guard<std::mutex> lock(registryLock);
 	size_t ct = 0;
 	for (auto & serial : deviceSerials) {
 		deviceSerialsOut[ct] = serial.c_str();
@@ -144,14 +205,22 @@ APS2_STATUS connect_APS(const char* deviceSerial) {
 	Connect to a device specified by serial number string
 	*/
 	string serial = string(deviceSerial);
+	auto interface = get_interface();
 	// create the APS2 object if it is not already in the map
-	if (APSs.find(serial) == APSs.end()) {
-		APSs[serial] = APS2(serial);
+	shared_ptr<APS2Device> device;
+	{
+		std::lock_guard<std::mutex> lock(registryLock);
+		auto & entry = APSs[serial];
+		if (!entry) {
+			entry = std::make_shared<APS2Device>(serial);
+		}
+		device = entry;
 	}
 	//Can't seem to bind the interface lvalue to ‘std::shared_ptr<APSEthernet>&&’
 	// return aps2_call(deviceSerial, &APS2::connect, get_interface());
 	try {
-		APSs.at(deviceSerial).connect(get_interface());
+		std::lock_guard<std::mutex> lock(device->lock);
+		device->aps.connect(std::move(interface));
 		return APS2_OK;
 	}
 	catch (APS2_STATUS status) {
@@ -167,6 +236,7 @@ APS2_STATUS disconnect_APS(const char* deviceSerial) {
 	Tear-down connection to APS specified by serial number string.
 	*/
 	APS2_STATUS status = aps2_call(deviceSerial, &APS2::disconnect);
+	std::lock_guard<std::mutex> lock(registryLock);
 	APSs.erase(string(deviceSerial));
 	return status;
 }
@@ -221,13 +291,34 @@ APS2_STATUS set_markers(const char* deviceSerial, int channelNum, uint8_t* data,
 }
 
 APS2_STATUS write_sequence(const char* deviceSerial, uint64_t* data, uint32_t numWords) {
-	return aps2_call(deviceSerial, &APS2::write_sequence, vector<uint64_t>(data, data+numWords));
+	return aps2_call(deviceSerial, static_cast<void(APS2::*)(const vector<uint64_t>&)>(&APS2::write_sequence),
+						vector<uint64_t>(data, data+numWords));
+}
+
+APS2_STATUS load_sequence(const char* deviceSerial, int16_t* wfA, int numPtsA, int16_t* wfB, int numPtsB, uint64_t* instructions, uint32_t numWords) {
+	//specialize the templated APS2::load_sequence here
+	return aps2_call(deviceSerial,
+						static_cast<void(APS2::*)(const vector<int16_t>&, const vector<int16_t>&, const vector<uint64_t>&)>(&APS2::load_sequence),
+						vector<int16_t>(wfA, wfA+numPtsA), vector<int16_t>(wfB, wfB+numPtsB), vector<uint64_t>(instructions, instructions+numWords));
 }
 
 APS2_STATUS load_sequence_file(const char* deviceSerial, const char* seqFile) {
 	return aps2_call(deviceSerial, &APS2::load_sequence_file, string(seqFile));
 }
 
+APS2_STATUS convert_sequence_file(const char* h5File, const char* binaryFile) {
+	try {
+		BinarySequence::convert(string(h5File), string(binaryFile));
+		return APS2_OK;
+	}
+	catch (APS2_STATUS status) {
+		return status;
+	}
+	catch (...) {
+		return APS2_UNKNOWN_ERROR;
+	}
+}
+
 APS2_STATUS clear_channel_data(const char* deviceSerial) {
 	return aps2_call(deviceSerial, &APS2::clear_channel_data);
 }
@@ -244,6 +335,36 @@ APS2_STATUS get_runState(const char* deviceSerial, RUN_STATE* state) {
 	return aps2_getter(deviceSerial, &APS2::get_runState, state);
 }
 
+APS2_STATUS load_sequence_file_multi(const char** deviceSerials, unsigned int numDevices, const char** seqFiles, APS2_STATUS* statuses) {
+	return aps2_multi_call(deviceSerials, numDevices, statuses, [&](unsigned int idx){
+		return load_sequence_file(deviceSerials[idx], seqFiles[idx]);
+	});
+}
+
+APS2_STATUS set_waveform_float_multi(const char** deviceSerials, unsigned int numDevices, int channelNum, float** data, int* numPts, APS2_STATUS* statuses) {
+	return aps2_multi_call(deviceSerials, numDevices, statuses, [&](unsigned int idx){
+		return set_waveform_float(deviceSerials[idx], channelNum, data[idx], numPts[idx]);
+	});
+}
+
+APS2_STATUS set_waveform_int_multi(const char** deviceSerials, unsigned int numDevices, int channelNum, int16_t** data, int* numPts, APS2_STATUS* statuses) {
+	return aps2_multi_call(deviceSerials, numDevices, statuses, [&](unsigned int idx){
+		return set_waveform_int(deviceSerials[idx], channelNum, data[idx], numPts[idx]);
+	});
+}
+
+APS2_STATUS run_multi(const char** deviceSerials, unsigned int numDevices, APS2_STATUS* statuses) {
+	return aps2_multi_call(deviceSerials, numDevices, statuses, [&](unsigned int idx){
+		return run(deviceSerials[idx]);
+	});
+}
+
+APS2_STATUS stop_multi(const char** deviceSerials, unsigned int numDevices, APS2_STATUS* statuses) {
+	return aps2_multi_call(deviceSerials, numDevices, statuses, [&](unsigned int idx){
+		return stop(deviceSerials[idx]);
+	});
+}
+
 //Expects a null-terminated character array
 APS2_STATUS set_log(const char* fileNameArr) {
 
@@ -297,6 +418,9 @@ APS2_STATUS trigger(const char* deviceSerial) {
 APS2_STATUS set_channel_offset(const char* deviceSerial, int channelNum, float offset) {
 	return aps2_call(deviceSerial, &APS2::set_channel_offset, channelNum, offset);
 }
+APS2_STATUS set_channel_offset_mode(const char* deviceSerial, int channelNum, OFFSET_MODE mode) {
+	return aps2_call(deviceSerial, &APS2::set_channel_offset_mode, channelNum, mode);
+}
 APS2_STATUS set_channel_scale(const char* deviceSerial, int channelNum, float scale) {
 	return aps2_call(deviceSerial, &APS2::set_channel_scale, channelNum, scale);
 }
@@ -307,6 +431,9 @@ APS2_STATUS set_channel_enabled(const char* deviceSerial, int channelNum, int en
 APS2_STATUS get_channel_offset(const char* deviceSerial, int channelNum, float* offset) {
 	return aps2_getter(deviceSerial, &APS2::get_channel_offset, offset, channelNum);
 }
+APS2_STATUS get_channel_offset_mode(const char* deviceSerial, int channelNum, OFFSET_MODE* mode) {
+	return aps2_getter(deviceSerial, &APS2::get_channel_offset_mode, mode, channelNum);
+}
 APS2_STATUS get_channel_scale(const char* deviceSerial, int channelNum, float* scale) {
 	return aps2_getter(deviceSerial, &APS2::get_channel_scale, scale, channelNum);
 }
@@ -325,24 +452,20 @@ APS2_STATUS write_memory(const char* deviceSerial, uint32_t addr, uint32_t* data
 }
 
 APS2_STATUS read_memory(const char* deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords) {
-	try {
-		auto readData = APSs[string(deviceSerial)].read_memory(addr, numWords);
-		std::copy(readData.begin(), readData.end(), data);	
-	}
-	catch (APS2_STATUS status) {
-		return status;
-	}
-	catch (...) {
-		return APS2_UNKNOWN_ERROR;
-	}
-	
-	return APS2_OK;
+	vector<uint32_t> readData;
+	APS2_STATUS status = aps2_getter(deviceSerial, &APS2::read_memory, &readData, addr, numWords);
+	std::copy(readData.begin(), readData.end(), data);
+	return status;
 }
 
 APS2_STATUS read_register(const char* deviceSerial, uint32_t addr, uint32_t* result) {
 	return read_memory(deviceSerial, addr, result, 1);
 }
 
+APS2_STATUS set_transfer_window(const char* deviceSerial, unsigned int ackInterval, unsigned int writeWindow, unsigned int readWindow) {
+	return aps2_call(deviceSerial, &APS2::set_transfer_window, ackInterval, writeWindow, readWindow);
+}
+
 int program_FPGA(const char* deviceSerial, const char* bitFile) {
 	return aps2_call(deviceSerial, &APS2::program_FPGA, string(bitFile));
 }
@@ -352,13 +475,16 @@ int write_flash(const char* deviceSerial, uint32_t addr, uint32_t* data, uint32_
 }
 
 int read_flash(const char* deviceSerial, uint32_t addr, uint32_t numWords, uint32_t* data) {
-	auto readData = APSs[string(deviceSerial)].read_flash(addr, numWords);
+	vector<uint32_t> readData;
+	APS2_STATUS status = aps2_getter(deviceSerial, &APS2::read_flash, &readData, addr, numWords);
 	std::copy(readData.begin(), readData.end(), data);
-	return 0;
+	return status;
 }
 
 uint64_t get_mac_addr(const char* deviceSerial) {
-	return APSs[string(deviceSerial)].get_mac_addr();
+	uint64_t mac = 0;
+	aps2_getter(deviceSerial, &APS2::get_mac_addr, &mac);
+	return mac;
 }
 
 APS2_STATUS set_mac_addr(const char* deviceSerial, uint64_t mac) {
@@ -367,7 +493,11 @@ APS2_STATUS set_mac_addr(const char* deviceSerial, uint64_t mac) {
 
 APS2_STATUS get_ip_addr(const char* deviceSerial, char* ipAddrPtr) {
 	try {
-		uint32_t ipAddr = APSs[string(deviceSerial)].get_ip_addr();
+		uint32_t ipAddr;
+		APS2_STATUS status = aps2_getter(deviceSerial, &APS2::get_ip_addr, &ipAddr);
+		if (status != APS2_OK) {
+			return status;
+		}
 		string ipAddrStr = asio::ip::address_v4(ipAddr).to_string();
 		ipAddrStr.copy(ipAddrPtr, ipAddrStr.size(), 0);
 		return APS2_OK;
@@ -397,7 +527,11 @@ APS2_STATUS set_dhcp_enable(const char* deviceSerial, const int enable) {
 int run_DAC_BIST(const char* deviceSerial, const int dac, int16_t* data, unsigned int length, uint32_t* results){
 	vector<int16_t> testVec(data, data+length);
 	vector<uint32_t> tmpResults;
-	int passed = APSs[string(deviceSerial)].run_DAC_BIST(dac, testVec, tmpResults);
+	int passed;
+	APS2_STATUS status = aps2_getter(deviceSerial, &APS2::run_DAC_BIST, &passed, dac, testVec, std::ref(tmpResults));
+	if (status != APS2_OK) {
+		return status;
+	}
 	std::copy(tmpResults.begin(), tmpResults.end(), results);
 	return passed;
 }
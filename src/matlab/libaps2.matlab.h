@@ -29,6 +29,7 @@ typedef enum APS2_STATUS APS2_STATUS;
 typedef enum TRIGGER_SOURCE TRIGGER_SOURCE;
 typedef enum RUN_MODE RUN_MODE;
 typedef enum RUN_STATE RUN_STATE;
+typedef enum OFFSET_MODE OFFSET_MODE;
 typedef enum TLogLevel TLogLevel;
 
 EXPORT const char* get_error_msg(APS2_STATUS);
@@ -51,6 +52,8 @@ EXPORT APS2_STATUS get_sampleRate(const char*, unsigned int*);
 
 EXPORT APS2_STATUS set_channel_offset(const char*, int, float);
 EXPORT APS2_STATUS get_channel_offset(const char*, int, float*);
+EXPORT APS2_STATUS set_channel_offset_mode(const char*, int, OFFSET_MODE);
+EXPORT APS2_STATUS get_channel_offset_mode(const char*, int, OFFSET_MODE*);
 EXPORT APS2_STATUS set_channel_scale(const char*, int, float);
 EXPORT APS2_STATUS get_channel_scale(const char*, int, float*);
 EXPORT APS2_STATUS set_channel_enabled(const char*, int, int);
@@ -67,10 +70,12 @@ EXPORT APS2_STATUS set_waveform_int(const char*, int, short*, int);
 EXPORT APS2_STATUS set_markers(const char*, int, char*, int);
 
 EXPORT APS2_STATUS write_sequence(const char*, uint64_t*, unsigned int);
+EXPORT APS2_STATUS load_sequence(const char*, short*, int, short*, int, uint64_t*, unsigned int);
 
 EXPORT APS2_STATUS set_run_mode(const char*, RUN_MODE);
 
 EXPORT APS2_STATUS load_sequence_file(const char*, const char*);
+EXPORT APS2_STATUS convert_sequence_file(const char*, const char*);
 
 EXPORT APS2_STATUS clear_channel_data(const char*);
 
@@ -78,6 +83,13 @@ EXPORT APS2_STATUS run(const char*);
 EXPORT APS2_STATUS stop(const char*);
 EXPORT APS2_STATUS get_runState(const char*, RUN_STATE*);
 
+//Multi-device versions act on an array of devices concurrently and fill in a status for each device
+EXPORT APS2_STATUS load_sequence_file_multi(const char**, unsigned int, const char**, APS2_STATUS*);
+EXPORT APS2_STATUS set_waveform_float_multi(const char**, unsigned int, int, float**, int*, APS2_STATUS*);
+EXPORT APS2_STATUS set_waveform_int_multi(const char**, unsigned int, int, short**, int*, APS2_STATUS*);
+EXPORT APS2_STATUS run_multi(const char**, unsigned int, APS2_STATUS*);
+EXPORT APS2_STATUS stop_multi(const char**, unsigned int, APS2_STATUS*);
+
 EXPORT APS2_STATUS set_log(const char*);
 EXPORT APS2_STATUS set_logging_level(TLogLevel);
 
@@ -93,6 +105,7 @@ EXPORT APS2_STATUS set_dhcp_enable(const char*, const int*);
 EXPORT APS2_STATUS write_memory(const char*, unsigned int, unsigned int*, unsigned int);
 EXPORT APS2_STATUS read_memory(const char*, unsigned int, unsigned int*, unsigned int);
 EXPORT APS2_STATUS read_register(const char*, unsigned int, unsigned int*);
+EXPORT APS2_STATUS set_transfer_window(const char*, unsigned int, unsigned int, unsigned int);
 EXPORT int program_FPGA(const char*, const char*);
 
 EXPORT int write_flash(const char*, unsigned int, unsigned int*, unsigned int);
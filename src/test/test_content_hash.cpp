@@ -0,0 +1,97 @@
+/*
+Checks content_hash against the XXH64 reference values and that editing any single word of a block changes its hash.
+
+Upload skipping and the binary sequence checksums both rely on this. Returns non-zero on failure; run through ctest.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <cstring>
+
+#include "ContentHash.h"
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+int main()
+{
+	int numFailures = 0;
+
+	//Reference values from the xxHash project's XXH64
+	struct Reference {
+		vector<uint8_t> data;
+		uint64_t seed;
+		uint64_t hash;
+	};
+	const char * spam = "Nobody inspects the spammish repetition";
+	vector<uint8_t> counting(768);
+	for (size_t ct = 0; ct < counting.size(); ct++) {
+		counting[ct] = ct % 256;
+	}
+	vector<Reference> references = {
+		{{}, 0, 0xef46db3751d8e999ull},
+		{{'a'}, 0, 0xd24ec4f1a98c6e5bull},
+		{{'a', 'b', 'c'}, 0, 0x44bc2cf5ad770999ull},
+		{{'a', 'b', 'c'}, 12345, 0x01700e64f6f23509ull},
+		{vector<uint8_t>(spam, spam + strlen(spam)), 0, 0xfbcea83c8a378bf1ull},
+		{vector<uint8_t>(counting.begin(), counting.begin() + 101), 0, 0xe99038495f85381eull},
+		{counting, 0, 0x8e03c838c596036full},
+		{counting, 12345, 0x6ecac135863f12b2ull},
+	};
+	for (auto & ref : references) {
+		uint64_t hash = content_hash(ref.data.data(), ref.data.size(), ref.seed);
+		if (hash != ref.hash) {
+			cout << "XXH64 of " << ref.data.size() << " bytes with seed " << ref.seed << " gave " << std::hex <<
+				hash << " not " << ref.hash << std::dec << endl;
+			numFailures++;
+		}
+	}
+
+	//Flip one bit of each word in turn, in blocks of instruction and waveform sized words with odd length tails
+	std::mt19937_64 generator(42);
+	for (size_t numWords : {1, 3, 4, 5, 1023, 4096}) {
+		vector<uint64_t> words(numWords);
+		for (auto & word : words) {
+			word = generator();
+		}
+		uint64_t original = content_hash(words.data(), words.size()*sizeof(uint64_t));
+		for (size_t ct = 0; ct < numWords; ct++) {
+			for (int bit : {0, 17, 63}) {
+				words[ct] ^= uint64_t(1) << bit;
+				if (content_hash(words.data(), words.size()*sizeof(uint64_t)) == original) {
+					cout << "Changing bit " << bit << " of word " << ct << " of " << numWords << " did not change the hash" << endl;
+					numFailures++;
+				}
+				words[ct] ^= uint64_t(1) << bit;
+			}
+		}
+		vector<int16_t> samples(4*numWords + 2);
+		for (auto & sample : samples) {
+			sample = generator() % 16384 - 8192;
+		}
+		original = content_hash(samples.data(), samples.size()*sizeof(int16_t));
+		for (size_t ct = 0; ct < samples.size(); ct++) {
+			samples[ct]++;
+			if (content_hash(samples.data(), samples.size()*sizeof(int16_t)) == original) {
+				cout << "Changing sample " << ct << " of " << samples.size() << " did not change the hash" << endl;
+				numFailures++;
+			}
+			samples[ct]--;
+		}
+	}
+
+	//Chaining through the seed depends on the order of the blocks
+	vector<uint64_t> blockA(16, 1), blockB(16, 2);
+	uint64_t ab = content_hash(blockB.data(), 128, content_hash(blockA.data(), 128));
+	uint64_t ba = content_hash(blockA.data(), 128, content_hash(blockB.data(), 128));
+	if (ab == ba) {
+		cout << "Chained hash does not depend on block order" << endl;
+		numFailures++;
+	}
+
+	cout << (numFailures ? "FAILED" : "passed") << endl;
+	return numFailures ? 1 : 0;
+}
@@ -0,0 +1,384 @@
+/*
+Regression checks for SequenceSimulator.
+
+Small hand-built sequences are run and their samples and markers compared with what doc/sequencer.rst and
+doc/instruction-set.rst say they should be. examples/ramsey.h5, whose path is the only argument, is then simulated
+for 100 triggers and its output hashes compared with those simulate_sequence reported when the file was added; that
+only guards against changes in behaviour. Returns non-zero on failure; run through ctest.
+*/
+
+#include <iostream>
+#include <iomanip>
+
+#include "headings.h"
+#include "SequenceSimulator.h"
+#include "ContentHash.h"
+
+using std::cout;
+using std::endl;
+
+namespace {
+
+//Instruction words as laid out in doc/instruction-set.rst
+enum OPCODE {WAVEFORM=0, MARKER, WAIT, LOAD_REPEAT, REPEAT, CMP, GOTO, CALL, RETURN, SYNC, PREFETCH};
+
+uint64_t header(const uint64_t & opCode, const uint64_t & engine = 0) {
+	return ((opCode << 4) | (engine << 2) | 0x1) << 56;
+}
+
+uint64_t waveform(const uint64_t & address, const uint64_t & count, const bool & timeAmplitude = false) {
+	return header(WAVEFORM) | (uint64_t(timeAmplitude) << 45) | (count << 24) | address;
+}
+
+uint64_t marker(const uint64_t & engine, const uint64_t & count, const bool & state, const uint8_t & transition) {
+	return header(MARKER, engine) | (uint64_t(transition) << 33) | (uint64_t(state) << 32) | count;
+}
+
+uint64_t wait_for_trigger() {
+	return header(WAIT) | (uint64_t(1) << 46);
+}
+
+uint64_t wait_for_sync() {
+	return header(SYNC) | (uint64_t(2) << 46);
+}
+
+uint64_t cmp_equal(const uint8_t & mask) {
+	return header(CMP) | mask;
+}
+
+uint64_t goto_address(const uint64_t & address) {
+	return header(GOTO) | address;
+}
+
+uint64_t load_repeat(const uint16_t & count) {
+	return header(LOAD_REPEAT) | count;
+}
+
+uint64_t repeat(const uint64_t & address) {
+	return header(REPEAT) | address;
+}
+
+uint64_t call(const uint64_t & address) {
+	return header(CALL) | address;
+}
+
+uint64_t return_() {
+	return header(RETURN);
+}
+
+//Waveform memories with a different value in every sample so any misplaced sample shows
+vector<int16_t> test_waveform(const int & ch) {
+	vector<int16_t> wf(64);
+	for (size_t ct = 0; ct < wf.size(); ct++) {
+		wf[ct] = (ch == 0 ? 1 : -1) * int16_t(100 + ct);
+	}
+	return wf;
+}
+
+//The samples of waveform memory from quad-sample address for count quad-samples
+vector<int16_t> samples(const vector<int16_t> & wf, const size_t & address, const size_t & count) {
+	return vector<int16_t>(wf.begin() + 4*address, wf.begin() + 4*(address + count));
+}
+
+template <typename T>
+vector<T> concat(std::initializer_list<vector<T>> parts) {
+	vector<T> result;
+	for (auto & part : parts) {
+		result.insert(result.end(), part.begin(), part.end());
+	}
+	return result;
+}
+
+template <typename T>
+int compare(const string & name, const vector<T> & actual, const vector<T> & expected) {
+	if (actual == expected) {
+		return 0;
+	}
+	cout << name << ": got " << actual.size() << " samples, expected " << expected.size();
+	for (size_t ct = 0; ct < std::min(actual.size(), expected.size()); ct++) {
+		if (actual[ct] != expected[ct]) {
+			cout << "; first difference at sample " << ct << ": " << int(actual[ct]) << " not " << int(expected[ct]);
+			break;
+		}
+	}
+	cout << endl;
+	return 1;
+}
+
+//Run up to the first WAIT and drop it so the output holds only the shots that follow
+void start(SequenceSimulator & simulator) {
+	simulator.run(0);
+	simulator.clear_output();
+}
+
+int check_time_amplitude() {
+	//A T/A pair holds the sample at its address for the whole count; a plain waveform after it plays as stored
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		waveform(2, 3, true),
+		waveform(1, 1),
+		goto_address(1)
+	};
+	vector<int16_t> wfA = test_waveform(0), wfB = test_waveform(1);
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	start(simulator);
+	simulator.run(1);
+	int numFailures = 0;
+	numFailures += compare("T/A analog A", simulator.get_analog(0), concat({vector<int16_t>(12, wfA[8]), samples(wfA, 1, 1)}));
+	numFailures += compare("T/A analog B", simulator.get_analog(1), concat({vector<int16_t>(12, wfB[8]), samples(wfB, 1, 1)}));
+	return numFailures;
+}
+
+int check_repeat() {
+	//A repeat count of N-1 plays the loop body N times
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		load_repeat(2),
+		waveform(1, 1),
+		repeat(3),
+		waveform(2, 1),
+		goto_address(1)
+	};
+	vector<int16_t> wfA = test_waveform(0), wfB = test_waveform(1);
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	start(simulator);
+	simulator.run(1);
+	auto loop = samples(wfA, 1, 1);
+	return compare("REPEAT analog A", simulator.get_analog(0), concat({loop, loop, loop, samples(wfA, 2, 1)}));
+}
+
+int check_call_return() {
+	/*
+	 * The outer loop plays A twice and calls a subroutine with its own loop each time; RETURN has to restore the
+	 * outer repeat counter or the outer loop would only run once
+	 */
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		load_repeat(1),
+		waveform(1, 1),
+		call(8),
+		repeat(3),
+		waveform(3, 1),
+		goto_address(1),
+		//subroutine
+		load_repeat(2),
+		waveform(2, 1),
+		repeat(9),
+		return_()
+	};
+	vector<int16_t> wfA = test_waveform(0), wfB = test_waveform(1);
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	start(simulator);
+	simulator.run(1);
+	auto outer = samples(wfA, 1, 1), inner = samples(wfA, 2, 1);
+	int numFailures = compare("CALL/RETURN analog A", simulator.get_analog(0),
+		concat({outer, inner, inner, inner, outer, inner, inner, inner, samples(wfA, 3, 1)}));
+	if (simulator.stats.maxStackDepth != 1) {
+		cout << "CALL/RETURN stack depth was " << simulator.stats.maxStackDepth << " not 1" << endl;
+		numFailures++;
+	}
+	return numFailures;
+}
+
+int check_markers() {
+	/*
+	 * A marker holds its state for all but the last quad-sample of the count, which is the transition word with its
+	 * lowest bit first. The engines line up at the WAIT so the shorter outputs are padded with zeros.
+	 */
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		marker(1, 3, true, 0x2),
+		marker(2, 1, false, 0xc),
+		waveform(1, 2),
+		goto_address(1)
+	};
+	vector<int16_t> wfA = test_waveform(0), wfB = test_waveform(1);
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	start(simulator);
+	simulator.run(1);
+	int numFailures = 0;
+	numFailures += compare("marker 1", simulator.get_marker(0), vector<uint8_t>(12, 0));
+	numFailures += compare("marker 2", simulator.get_marker(1), vector<uint8_t>{1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0});
+	numFailures += compare("marker 3", simulator.get_marker(2), vector<uint8_t>{0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0});
+	numFailures += compare("marker 4", simulator.get_marker(3), vector<uint8_t>(12, 0));
+	numFailures += compare("marker shot analog A", simulator.get_analog(0), concat({samples(wfA, 1, 2), vector<int16_t>(4, 0)}));
+	return numFailures;
+}
+
+int check_trigger_interval() {
+	/*
+	 * Each shot plays 40 samples against triggers every 30 samples. The trigger at 0 is taken; the one at 30 comes
+	 * while the waveform is still playing and is missed, so the next shot waits idle for the trigger at 60, and so on.
+	 */
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		waveform(0, 10),
+		goto_address(1)
+	};
+	vector<int16_t> wfA = test_waveform(0), wfB = test_waveform(1);
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	simulator.set_trigger_interval(30);
+	start(simulator);
+
+	int numFailures = 0;
+	vector<uint64_t> triggerTimes;
+	for (int shot = 0; shot < 3; shot++) {
+		simulator.run(1);
+		triggerTimes.push_back(simulator.trigger_times().front());
+		if (shot == 1) {
+			numFailures += compare("trigger interval shot 2 analog A", simulator.get_analog(0),
+				concat({vector<int16_t>(20, 0), samples(wfA, 0, 10)}));
+		}
+		simulator.clear_output();
+	}
+	if (triggerTimes != vector<uint64_t>{0, 60, 120} || simulator.stats.missedTriggers != 2 || simulator.stats.triggers != 3) {
+		cout << "Trigger interval: triggers at";
+		for (auto time : triggerTimes) {
+			cout << " " << time;
+		}
+		cout << " with " << simulator.stats.missedTriggers << " missed, expected 0 60 120 with 2 missed" << endl;
+		numFailures++;
+	}
+
+	//With triggers further apart than a shot none are missed
+	SequenceSimulator slowTriggers(instructions, wfA, wfB);
+	slowTriggers.set_trigger_interval(50);
+	slowTriggers.run(3);
+	if (slowTriggers.stats.missedTriggers != 0) {
+		cout << "Trigger interval longer than a shot missed " << slowTriggers.stats.missedTriggers << " triggers" << endl;
+		numFailures++;
+	}
+	return numFailures;
+}
+
+int check_ramsey(const string & fileName) {
+	vector<int16_t> wfA, wfB;
+	vector<uint64_t> instructions;
+	try {
+		H5::H5File H5SeqFile(fileName, H5F_ACC_RDONLY);
+		wfA = h5array2vector<int16_t>(&H5SeqFile, "chan_1/waveforms", H5::PredType::NATIVE_INT16);
+		wfB = h5array2vector<int16_t>(&H5SeqFile, "chan_2/waveforms", H5::PredType::NATIVE_INT16);
+		instructions = h5array2vector<uint64_t>(&H5SeqFile, "chan_1/instructions", H5::PredType::NATIVE_UINT64);
+		H5SeqFile.close();
+	}
+	catch (H5::Exception & e) {
+		cout << "Unable to read " << fileName << endl;
+		return 1;
+	}
+
+	//Shot by shot as simulate_sequence does so the hashes can be compared with its output
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	const uint64_t numTriggers = 100;
+	uint64_t hashes[6] = {0};
+	uint64_t numSamples = 0;
+	for (uint64_t shot = 0; shot <= numTriggers; shot++) {
+		if (simulator.run(shot == 0 ? 0 : 1) != STOP_TRIGGER_LIMIT) {
+			cout << "ramsey stopped early at shot " << shot << endl;
+			return 1;
+		}
+		for (int ch = 0; ch < 2; ch++) {
+			const vector<int16_t> & samples = simulator.get_analog(ch);
+			hashes[ch] = content_hash(samples.data(), samples.size()*sizeof(int16_t), hashes[ch]);
+		}
+		for (int marker = 0; marker < 4; marker++) {
+			const vector<uint8_t> & samples = simulator.get_marker(marker);
+			hashes[2 + marker] = content_hash(samples.data(), samples.size(), hashes[2 + marker]);
+		}
+		numSamples += simulator.get_analog(0).size();
+		simulator.clear_output();
+	}
+
+	int numFailures = 0;
+	const uint64_t expected[6] = {0x23377d6799d6afb5ull, 0x3042cc79338c7a37ull, 0x62b06f1d39fefca9ull,
+		0x4ea487494af5d175ull, 0x4ea487494af5d175ull, 0x4ea487494af5d175ull};
+	const char * names[6] = {"analog A", "analog B", "marker 1", "marker 2", "marker 3", "marker 4"};
+	for (int ct = 0; ct < 6; ct++) {
+		if (hashes[ct] != expected[ct]) {
+			cout << "ramsey " << names[ct] << " hash is " << std::hex << std::setw(16) << std::setfill('0') << hashes[ct] <<
+				" not " << std::setw(16) << expected[ct] << std::dec << endl;
+			numFailures++;
+		}
+	}
+	if (numSamples != 9916400 || simulator.stats.instructions != 1101 || simulator.stats.missedTriggers != 0) {
+		cout << "ramsey rendered " << numSamples << " samples from " << simulator.stats.instructions << " instructions with " <<
+			simulator.stats.missedTriggers << " missed triggers" << endl;
+		numFailures++;
+	}
+	return numFailures;
+}
+
+int check_cmp() {
+	/*
+	 * CMP; WAVEFORM; GOTO skips the second waveform only when the comparison is true, so with the comparison register
+	 * alternating 0, 1 the shots alternate between two waveforms and one
+	 */
+	vector<uint64_t> instructions = {
+		wait_for_sync(),
+		wait_for_trigger(),
+		cmp_equal(1),
+		waveform(0, 3),
+		goto_address(6),
+		waveform(4, 3),
+		goto_address(1)
+	};
+	vector<int16_t> wf(64, 100);
+	SequenceSimulator simulator(instructions, wf, wf);
+	simulator.set_comparison_values({0, 1});
+	simulator.run(0);
+	simulator.clear_output();
+
+	int numFailures = 0;
+	size_t shotLengths[4];
+	for (int shot = 0; shot < 4; shot++) {
+		simulator.run(1);
+		shotLengths[shot] = simulator.get_analog(0).size();
+		simulator.clear_output();
+	}
+	for (int shot = 0; shot < 4; shot++) {
+		if (shotLengths[shot] != shotLengths[shot % 2] || shotLengths[shot] == 0) {
+			numFailures++;
+		}
+	}
+	if (shotLengths[0] == shotLengths[1]) {
+		numFailures++;
+	}
+	if (numFailures) {
+		cout << "CMP; WAVEFORM; GOTO shot lengths were";
+		for (auto shotLength : shotLengths) {
+			cout << " " << shotLength;
+		}
+		cout << endl;
+	}
+	return numFailures;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		cout << "Usage: test_simulator path/to/ramsey.h5" << endl;
+		return 1;
+	}
+	int numFailures = 0;
+	try {
+		numFailures += check_time_amplitude();
+		numFailures += check_repeat();
+		numFailures += check_call_return();
+		numFailures += check_markers();
+		numFailures += check_trigger_interval();
+		numFailures += check_cmp();
+		numFailures += check_ramsey(argv[1]);
+	}
+	catch (APS2_STATUS status) {
+		cout << "Simulation threw " << status << endl;
+		numFailures++;
+	}
+	cout << (numFailures ? "FAILED" : "passed") << endl;
+	return numFailures ? 1 : 0;
+}
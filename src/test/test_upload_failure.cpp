@@ -0,0 +1,94 @@
+/*
+Checks that a waveform load that fails part way leaves the host copies of waveform memory unknown.
+
+When one channel's fill throws nothing is sent, so the other channel must not go on believing the device holds its new
+waveform; if it did, loading that waveform again would be skipped and leave stale samples on the instrument. Needs no
+device since a failed load sends nothing. Returns non-zero on failure; run through ctest.
+*/
+
+#include <iostream>
+
+#include "headings.h"
+#include "APS2.h"
+
+using std::cout;
+using std::endl;
+
+class APS2TestAccess {
+public:
+	static void write_waveforms(APS2 & aps, const std::function<void(const int &)> & fill) {
+		aps.write_waveforms(fill);
+	}
+
+	static void set_waveform(APS2 & aps, const int & ch, const vector<int16_t> & data) {
+		aps.channels_[ch].set_waveform(data);
+	}
+
+	//Whether uploading the channel's current waveform would send anything; brings the copy up to date as an upload would
+	static bool upload_needed(APS2 & aps, const int & ch) {
+		return !aps.waveform_segments(ch).empty();
+	}
+};
+
+namespace {
+
+vector<int16_t> ramp(const size_t & length, const int16_t & step) {
+	vector<int16_t> data(length);
+	for (size_t ct = 0; ct < length; ct++) {
+		data[ct] = int16_t((ct * step) % 8192);
+	}
+	return data;
+}
+
+int check_failed_load(const int & failingChannel) {
+	APS2 aps("test");
+	vector<int16_t> oldWaveforms[2] = {ramp(1024, 1), ramp(1024, 2)};
+	vector<int16_t> newWaveforms[2] = {ramp(1024, 3), ramp(1024, 5)};
+
+	//Stand in for a successful upload of the old waveforms
+	for (int ch = 0; ch < 2; ch++) {
+		APS2TestAccess::set_waveform(aps, ch, oldWaveforms[ch]);
+		APS2TestAccess::upload_needed(aps, ch);
+	}
+
+	bool threw = false;
+	try {
+		APS2TestAccess::write_waveforms(aps, [&](const int & ch) {
+			APS2TestAccess::set_waveform(aps, ch, newWaveforms[ch]);
+			if (ch == failingChannel) {
+				throw APS2_SEQFILE_FAIL;
+			}
+		});
+	}
+	catch (APS2_STATUS status) {
+		threw = (status == APS2_SEQFILE_FAIL);
+	}
+	if (!threw) {
+		cout << "Failing channel " << failingChannel << "'s error was not passed on" << endl;
+		return 1;
+	}
+
+	//Nothing was sent so loading the new waveforms again has to send both in full
+	int numFailures = 0;
+	for (int ch = 0; ch < 2; ch++) {
+		APS2TestAccess::set_waveform(aps, ch, newWaveforms[ch]);
+		if (!APS2TestAccess::upload_needed(aps, ch)) {
+			cout << "After channel " << failingChannel << " failed channel " << ch <<
+				" still claims the device holds a waveform it was never sent" << endl;
+			numFailures++;
+		}
+	}
+	return numFailures;
+}
+
+}
+
+int main()
+{
+	int numFailures = 0;
+	for (int failingChannel = 0; failingChannel < 2; failingChannel++) {
+		numFailures += check_failed_load(failingChannel);
+	}
+	cout << (numFailures ? "FAILED" : "passed") << endl;
+	return numFailures ? 1 : 0;
+}
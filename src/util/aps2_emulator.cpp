@@ -0,0 +1,170 @@
+/*
+Emulates one or more APS2s on loopback addresses so the library and utilities can be run without hardware.
+
+Each emulated device answers on its own IP at the APS2 port and a listener on the loopback broadcast address
+hands them the enumerate status requests. A fleet of devices takes consecutive addresses from --ip and is
+served from a single thread. The emulated devices share the APS2 port with the library, which the library only
+allows when APS2_SHARE_PORT is set, so set it and point any libaps2 program on the same machine at it, e.g.
+
+  export APS2_SHARE_PORT=1
+  aps2_emulator --ip=127.0.0.2 --numDevices=8 &
+  test_comms
+
+Packets in both directions can be delayed, dropped, duplicated and reordered to see how the library copes
+with a lossy network.
+*/
+
+#include <iostream>
+#include <cstdlib>
+
+#include "headings.h"
+#include "libaps2.h"
+#include "DummyAPS.h"
+
+#include "../C++/helpers.h"
+#include "../C++/optionparser.h"
+
+enum  optionIndex { UNKNOWN, HELP, IP_ADDR, NUM_DEVICES, DELAY, JITTER, DROP, DUPLICATE, REORDER, SEED, LOG_LEVEL};
+const option::Descriptor usage[] =
+{
+	{UNKNOWN, 0,"" , ""    , option::Arg::None, "USAGE: aps2_emulator [options]\n\n"
+	                                         "Options:" },
+	{HELP,    0,"" , "help", option::Arg::None, "  --help  \tPrint usage and exit." },
+	{IP_ADDR, 0,"", "ip", option::Arg::Required, "  --ip  \t(optional) Loopback IP address of the (first) emulated device (default=127.0.0.2)." },
+	{NUM_DEVICES, 0,"", "numDevices", option::Arg::Numeric, "  --numDevices  \t(optional) Number of devices to emulate on consecutive addresses (default=1)." },
+	{DELAY, 0,"", "delay", option::Arg::Numeric, "  --delay  \t(optional) One way packet delay in ms (default=0)." },
+	{JITTER, 0,"", "jitter", option::Arg::Numeric, "  --jitter  \t(optional) Random extra delay of up to this many ms (default=0)." },
+	{DROP, 0,"", "drop", option::Arg::Numeric, "  --drop  \t(optional) Probability a packet is dropped (default=0)." },
+	{DUPLICATE, 0,"", "duplicate", option::Arg::Numeric, "  --duplicate  \t(optional) Probability a packet is delivered twice (default=0)." },
+	{REORDER, 0,"", "reorder", option::Arg::Numeric, "  --reorder  \t(optional) Probability a packet is held back 1 ms so later packets overtake it (default=0)." },
+	{SEED, 0,"", "seed", option::Arg::Numeric, "  --seed  \t(optional) Random seed for the impairments (default=0)." },
+	{LOG_LEVEL,  0,"", "logLevel", option::Arg::Numeric, "  --logLevel  \t(optional) Logging level level to print to console (optional; default=2/INFO)." },
+	{UNKNOWN, 0,"" ,  ""   , option::Arg::None, "\nExamples:\n"
+	                                         "  aps2_emulator\n"
+	                                         "  aps2_emulator --ip=127.0.0.5 --logLevel=5\n"
+	                                         "  aps2_emulator --numDevices=64\n"
+	                                         "  aps2_emulator --drop=0.001 --reorder=0.01 --delay=0.1 --jitter=0.05\n" },
+	{0,0,0,0,0,0}
+};
+
+//Listens for enumerate broadcasts on the loopback broadcast address and passes them on to the devices
+class BroadcastListener {
+public:
+	BroadcastListener(asio::io_service & ios, vector<DummyAPS*> devices) : socket_(ios), devices_(devices) {
+		socket_.open(udp::v4());
+		socket_.set_option(asio::socket_base::reuse_address(true));
+		socket_.bind(udp::endpoint(asio::ip::address_v4::from_string("127.255.255.255"), APS_PROTO));
+		setup_receive();
+	}
+
+private:
+	void setup_receive() {
+		socket_.async_receive_from(
+			asio::buffer(receivedData_, sizeof(receivedData_)), senderEndpoint_,
+			[this](std::error_code ec, std::size_t bytesReceived) {
+				if (!ec && bytesReceived >= APSEthernetPacket::NUM_HEADER_BYTES - 4) {
+					APSEthernetPacket packet(vector<uint8_t>(receivedData_, receivedData_ + bytesReceived));
+					if (packet.header.command.cmd == static_cast<uint32_t>(APS_COMMANDS::STATUS)) {
+						for (auto device : devices_) {
+							device->handle_packet(packet, senderEndpoint_);
+						}
+					}
+				}
+				setup_receive();
+		});
+	}
+
+	udp::socket socket_;
+	vector<DummyAPS*> devices_;
+	uint8_t receivedData_[2048];
+	udp::endpoint senderEndpoint_;
+};
+
+int main(int argc, char* argv[])
+{
+	print_title("BBN APS2 Emulator");
+
+	argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+	option::Stats  stats(usage, argc, argv);
+	option::Option *options = new option::Option[stats.options_max];
+	option::Option *buffer = new option::Option[stats.buffer_max];
+	option::Parser parse(usage, argc, argv, options, buffer);
+
+	if (parse.error())
+	 return -1;
+
+	if (options[HELP]) {
+		option::printUsage(std::cout, usage);
+		return 0;
+	}
+
+	for (option::Option* opt = options[UNKNOWN]; opt; opt = opt->next())
+	 std::cout << "Unknown option: " << opt->name << "\n";
+
+	//Logging level
+	TLogLevel logLevel = logINFO;
+	if (options[LOG_LEVEL]) {
+		logLevel = TLogLevel(atoi(options[LOG_LEVEL].arg));
+	}
+	set_logging_level(logLevel);
+	set_log("stdout");
+
+	string ip = "127.0.0.2";
+	if (options[IP_ADDR]) {
+		ip = string(options[IP_ADDR].arg);
+	}
+
+	int numDevices = 1;
+	if (options[NUM_DEVICES]) {
+		numDevices = atoi(options[NUM_DEVICES].arg);
+	}
+	if (numDevices < 1) {
+		std::cerr << "Need at least one device.";
+		return -1;
+	}
+
+	LinkImpairments impairments;
+	if (options[DELAY]) impairments.delayMS = atof(options[DELAY].arg);
+	if (options[JITTER]) impairments.jitterMS = atof(options[JITTER].arg);
+	if (options[DROP]) impairments.dropRate = atof(options[DROP].arg);
+	if (options[DUPLICATE]) impairments.duplicateRate = atof(options[DUPLICATE].arg);
+	if (options[REORDER]) impairments.reorderRate = atof(options[REORDER].arg);
+	unsigned seed = options[SEED] ? atoi(options[SEED].arg) : 0;
+
+	asio::io_service ios;
+	try {
+		//Devices take consecutive addresses and a MAC address made from the bottom of their IP
+		vector<std::unique_ptr<DummyAPS>> devices;
+		vector<DummyAPS*> devicePtrs;
+		uint32_t firstIP = asio::ip::address_v4::from_string(ip).to_ulong();
+		for (int ct = 0; ct < numDevices; ct++) {
+			string deviceIP = asio::ip::address_v4(firstIP + ct).to_string();
+			devices.emplace_back(new DummyAPS(ios, deviceIP, 0x4651DB000000ull | ((firstIP + ct) & 0xffffff)));
+			if (impairments.active()) {
+				devices.back()->set_impairments(impairments, seed + ct);
+			}
+			devicePtrs.push_back(devices.back().get());
+		}
+		BroadcastListener listener(ios, devicePtrs);
+
+		//Run until interrupted
+		asio::signal_set signals(ios, SIGINT, SIGTERM);
+		signals.async_wait([&ios](const std::error_code &, int) { ios.stop(); });
+
+		cout << concol::CYAN << "Emulating " << numDevices << " APS2" << (numDevices > 1 ? "s" : "") << " from " << ip <<
+			" to " << devices.back()->ip() << "; Ctrl-C to stop" << concol::RESET << endl;
+		ios.run();
+
+		if (impairments.active()) {
+			for (auto & device : devices) {
+				cout << device->impairment_stats() << endl;
+			}
+		}
+	}
+	catch (std::exception & e) {
+		cout << concol::RED << "Emulator failed: " << e.what() << concol::RESET << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+Counts heap allocations on the transmit path.
+
+Compares allocating APSEthernetPacket::serialize() against serialize_into() a reused buffer and
+measures the steady state cost of a no-acknowledge bulk send through APSEthernet to a loopback address.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <cstdlib>
+#include <chrono>
+
+#include "headings.h"
+#include "constants.h"
+#include "APSEthernet.h"
+#include "EndianSwap.h"
+
+#include <concol.h>
+
+using std::cout;
+using std::endl;
+
+//Count allocations made by this thread; the receive thread in APSEthernet is left out on purpose
+static thread_local size_t allocCount = 0;
+
+void * operator new(size_t size) {
+  allocCount++;
+  if (void * ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+vector<APSEthernetPacket> make_packets(size_t numPackets) {
+  vector<APSEthernetPacket> packets;
+  for (size_t ct = 0; ct < numPackets; ct++) {
+    APSCommand_t command = { .packed=0 };
+    command.cmd = static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+    command.cnt = MAX_PAYLOAD_WORDS;
+    APSEthernetPacket packet(command, 4*MAX_PAYLOAD_WORDS*ct);
+    packet.payload.assign(MAX_PAYLOAD_WORDS, ct);
+    packets.push_back(packet);
+  }
+  return packets;
+}
+
+void report(const string & name, size_t allocs, size_t numPackets, double durationUS) {
+  cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(3)
+       << std::setw(10) << static_cast<double>(allocs)/numPackets << " allocs/packet"
+       << std::setw(10) << durationUS/numPackets << " us/packet" << endl;
+}
+
+int main(int argc, char* argv[]) {
+
+  concol::concolinit();
+  cout << concol::RED << "BBN AP2 Transmit Allocation Benchmark" << concol::RESET << endl;
+  cout << "Payload byte swap kernel: " << endian_swap_kernel() << endl;
+
+  const size_t numPackets = 10000;
+  auto packets = make_packets(numPackets);
+
+  //Allocating serialize
+  size_t bytes = 0;
+  allocCount = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (auto & packet : packets) {
+    bytes += packet.serialize().size();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  report("serialize()", allocCount, numPackets, std::chrono::duration<double, std::micro>(stop-start).count());
+
+  //Serialize into a reused buffer
+  vector<uint8_t> buffer(APSEthernetPacket::MAX_NUM_BYTES);
+  allocCount = 0;
+  start = std::chrono::steady_clock::now();
+  for (auto & packet : packets) {
+    bytes += packet.serialize_into(buffer.data(), buffer.size());
+  }
+  stop = std::chrono::steady_clock::now();
+  report("serialize_into()", allocCount, numPackets, std::chrono::duration<double, std::micro>(stop-start).count());
+
+  //Bulk send without acknowledges to a loopback address nobody answers on
+  //The first send sizes the transmit buffer; the timed sends should then only allocate for the packet vector move
+  APSEthernet ethernet;
+  string serial = "127.0.0.3";
+  ethernet.connect(serial);
+  ethernet.send(serial, make_packets(16), 0);
+
+  auto sendPackets = make_packets(numPackets);
+  allocCount = 0;
+  start = std::chrono::steady_clock::now();
+  ethernet.send(serial, std::move(sendPackets), 0);
+  stop = std::chrono::steady_clock::now();
+  report("APSEthernet::send (no acknowledge)", allocCount, numPackets, std::chrono::duration<double, std::micro>(stop-start).count());
+
+  ethernet.disconnect(serial);
+
+  //Keep the serialize loops from being optimized away
+  return bytes == 0;
+}
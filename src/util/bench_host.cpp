@@ -0,0 +1,331 @@
+/*
+Microbenchmarks for the host side CPU work of an upload, with no network involved.
+
+Times Channel::prep_waveform, APS2::pack_sequence, APS2::pack_data and
+APSEthernetPacket serialization at the sizes real uploads use (up to 128k sample waveforms and
+16M instruction sequences), plus SequenceSimulator on a sequence of short pulses. Like Google Benchmark, each case is repeated until it has run for at
+least --minTime seconds and the time per iteration and throughput are reported.
+*/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <numeric>
+
+#include "headings.h"
+#include "libaps2.h"
+#include "APS2.h"
+#include "Channel.h"
+#include "APSEthernetPacket.h"
+#include "WaveformPack.h"
+#include "SequenceSimulator.h"
+
+#include "../C++/helpers.h"
+#include "../C++/optionparser.h"
+
+enum  optionIndex { UNKNOWN, HELP, FILTER, MIN_TIME, FORMAT};
+const option::Descriptor usage[] =
+{
+	{UNKNOWN, 0,"" , ""    , option::Arg::None, "USAGE: bench_host [options]\n\n"
+	                                         "Options:" },
+	{HELP,    0,"" , "help", option::Arg::None, "  --help  \tPrint usage and exit." },
+	{FILTER, 0,"", "filter", option::Arg::Required, "  --filter  \t(optional) Only run benchmarks whose name contains this string." },
+	{MIN_TIME, 0,"", "minTime", option::Arg::Numeric, "  --minTime  \t(optional) Minimum seconds to run each benchmark for (default=0.5)." },
+	{FORMAT, 0,"", "format", option::Arg::Required, "  --format  \t(optional) console or json (default=console)." },
+	{UNKNOWN, 0,"" ,  ""   , option::Arg::None, "\nExamples:\n"
+	                                         "  bench_host\n"
+	                                         "  bench_host --filter=prep_waveform --minTime=2\n"
+	                                         "  bench_host --format=json > host.json\n" },
+	{0,0,0,0,0,0}
+};
+
+//Passed to each benchmark; the timed region is the keep_running() loop so setup is not counted
+class BenchState {
+public:
+	BenchState(const size_t & arg, const size_t & maxIterations) :
+		arg{arg}, itemsProcessed{0}, bytesProcessed{0}, iterations_{0}, maxIterations_{maxIterations} {};
+
+	bool keep_running() {
+		if (iterations_ == 0) {
+			start_ = std::chrono::steady_clock::now();
+		}
+		if (iterations_ == maxIterations_) {
+			stop_ = std::chrono::steady_clock::now();
+			return false;
+		}
+		iterations_++;
+		return true;
+	}
+
+	double elapsed() const {
+		return std::chrono::duration<double>(stop_ - start_).count();
+	}
+
+	size_t iterations() const { return iterations_; };
+
+	size_t arg;
+	//Per iteration
+	size_t itemsProcessed;
+	size_t bytesProcessed;
+
+private:
+	size_t iterations_;
+	size_t maxIterations_;
+	std::chrono::steady_clock::time_point start_, stop_;
+};
+
+struct Benchmark {
+	string name;
+	std::function<void(BenchState &)> func;
+	size_t arg;
+};
+
+//Keeps the compiler from optimizing away results nothing else reads
+static volatile uint64_t sink;
+
+template <typename T>
+void consume(const vector<T> & data) {
+	sink = data.size() ? static_cast<uint64_t>(data[data.size() / 2]) : 0;
+}
+
+vector<float> random_waveform(size_t numPoints, float amplitude) {
+	std::mt19937 generator(numPoints);
+	std::uniform_real_distribution<float> distribution(-amplitude, amplitude);
+	vector<float> waveform(numPoints);
+	for (auto & val : waveform) {
+		val = distribution(generator);
+	}
+	return waveform;
+}
+
+vector<uint8_t> random_markers(size_t numPoints) {
+	std::mt19937 generator(numPoints);
+	std::uniform_int_distribution<int> distribution(0, 3);
+	vector<uint8_t> markers(numPoints);
+	for (auto & val : markers) {
+		val = distribution(generator);
+	}
+	return markers;
+}
+
+void BM_prep_waveform(BenchState & state, float amplitude) {
+	Channel channel(0);
+	channel.set_waveform(random_waveform(state.arg, amplitude));
+	channel.set_markers(random_markers(state.arg));
+	while (state.keep_running()) {
+		consume(channel.prep_waveform());
+	}
+	state.itemsProcessed = state.arg;
+	state.bytesProcessed = state.arg * sizeof(float);
+}
+
+void BM_prep_waveform_int(BenchState & state, float scale) {
+	//Integer waveforms as load_sequence_file gives them
+	vector<int16_t> waveform(state.arg);
+	std::mt19937 generator(state.arg);
+	std::uniform_int_distribution<int> distribution(-MAX_WF_AMP, MAX_WF_AMP);
+	for (auto & val : waveform) {
+		val = distribution(generator);
+	}
+	Channel channel(0);
+	channel.set_waveform(waveform);
+	channel.set_markers(random_markers(state.arg));
+	channel.set_scale(scale);
+	while (state.keep_running()) {
+		consume(channel.prep_waveform());
+	}
+	state.itemsProcessed = state.arg;
+	state.bytesProcessed = state.arg * sizeof(int16_t);
+}
+
+void BM_pack_sequence(BenchState & state) {
+	vector<uint64_t> instructions(state.arg);
+	std::iota(instructions.begin(), instructions.end(), 0x1000000000000000ull);
+	while (state.keep_running()) {
+		consume(APS2::pack_sequence(instructions));
+	}
+	state.itemsProcessed = state.arg;
+	state.bytesProcessed = state.arg * sizeof(uint64_t);
+}
+
+void BM_pack_data(BenchState & state) {
+	vector<uint32_t> data(state.arg);
+	std::iota(data.begin(), data.end(), 0);
+	while (state.keep_running()) {
+		auto packets = APS2::pack_data(0, data);
+		sink = packets.size();
+	}
+	state.itemsProcessed = state.arg;
+	state.bytesProcessed = state.arg * sizeof(uint32_t);
+}
+
+void BM_serialize(BenchState & state) {
+	//A full upload's worth of packets serialized one by one
+	vector<uint32_t> data(state.arg);
+	std::iota(data.begin(), data.end(), 0);
+	auto packets = APS2::pack_data(0, data);
+	while (state.keep_running()) {
+		for (auto & packet : packets) {
+			consume(packet.serialize());
+		}
+	}
+	state.itemsProcessed = packets.size();
+	state.bytesProcessed = state.arg * sizeof(uint32_t);
+}
+
+void BM_serialize_into(BenchState & state) {
+	vector<uint32_t> data(state.arg);
+	std::iota(data.begin(), data.end(), 0);
+	auto packets = APS2::pack_data(0, data);
+	vector<uint8_t> buffer(APSEthernetPacket::MAX_NUM_BYTES);
+	while (state.keep_running()) {
+		for (auto & packet : packets) {
+			sink = packet.serialize_into(buffer.data(), buffer.size());
+		}
+	}
+	state.itemsProcessed = packets.size();
+	state.bytesProcessed = state.arg * sizeof(uint32_t);
+}
+
+void BM_simulate_sequence(BenchState & state) {
+	//One shot of state.arg instructions: short waveforms, T/A pairs and markers in equal numbers
+	const uint64_t waveform = 0x0100000000000000ull, marker = 0x1100000000000000ull, taFlag = uint64_t(1) << 45;
+	vector<uint64_t> instructions = {0x9100800000000000ull, 0x2100400000000000ull};
+	for (size_t ct = 0; instructions.size() + 1 < state.arg; ct++) {
+		switch (ct % 3) {
+		case 0:
+			instructions.push_back(waveform | (uint64_t(16) << 24) | (ct % 64));
+			break;
+		case 1:
+			instructions.push_back(waveform | taFlag | (uint64_t(32) << 24) | (ct % 64));
+			break;
+		case 2:
+			instructions.push_back(marker | (uint64_t(0xc) << 33) | 48);
+			break;
+		}
+	}
+	instructions.push_back(0x6000000000000000ull);
+	vector<int16_t> wf(4096);
+	std::iota(wf.begin(), wf.end(), 0);
+	SequenceSimulator simulator(instructions, wf, wf);
+	simulator.run(0);
+	while (state.keep_running()) {
+		simulator.run(1);
+		consume(simulator.get_analog(0));
+		simulator.clear_output();
+	}
+	state.itemsProcessed = state.arg;
+	state.bytesProcessed = state.arg * sizeof(uint64_t);
+}
+
+//Run with growing iteration counts until the benchmark lasts at least minTime
+BenchState run_benchmark(const Benchmark & bench, double minTime) {
+	size_t iterations = 1;
+	while (true) {
+		BenchState state(bench.arg, iterations);
+		bench.func(state);
+		if (state.elapsed() >= minTime || iterations >= 1000000000) {
+			return state;
+		}
+		//Aim a little past minTime, growing by at most 10x at a time
+		double scale = state.elapsed() > 0 ? 1.4 * minTime / state.elapsed() : 10;
+		iterations = std::max(iterations + 1, static_cast<size_t>(iterations * std::min(scale, 10.0)));
+	}
+}
+
+string format_time(double seconds) {
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1);
+	if (seconds < 1e-6) out << seconds * 1e9 << " ns";
+	else if (seconds < 1e-3) out << seconds * 1e6 << " us";
+	else if (seconds < 1) out << seconds * 1e3 << " ms";
+	else out << seconds << " s";
+	return out.str();
+}
+
+int main(int argc, char* argv[])
+{
+	argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+	option::Stats  stats(usage, argc, argv);
+	option::Option *options = new option::Option[stats.options_max];
+	option::Option *buffer = new option::Option[stats.buffer_max];
+	option::Parser parse(usage, argc, argv, options, buffer);
+
+	if (parse.error())
+	 return -1;
+
+	if (options[HELP]) {
+		option::printUsage(std::cout, usage);
+		return 0;
+	}
+
+	for (option::Option* opt = options[UNKNOWN]; opt; opt = opt->next())
+	 std::cout << "Unknown option: " << opt->name << "\n";
+
+	string filter = options[FILTER] ? options[FILTER].arg : "";
+	double minTime = options[MIN_TIME] ? atof(options[MIN_TIME].arg) : 0.5;
+	bool json = options[FORMAT] && string(options[FORMAT].arg) == "json";
+
+	//Clipping warnings would otherwise be logged on every iteration
+	set_logging_level(logERROR);
+
+	const size_t waveformLength = MAX_WF_LENGTH;
+	const size_t sequenceLength = MAX_LL_LENGTH;
+	vector<Benchmark> benchmarks = {
+		{"prep_waveform", [](BenchState & state) { BM_prep_waveform(state, 1.0); }, 4096},
+		{"prep_waveform", [](BenchState & state) { BM_prep_waveform(state, 1.0); }, waveformLength},
+		{"prep_waveform_clipped", [](BenchState & state) { BM_prep_waveform(state, 1.5); }, waveformLength},
+		{"prep_waveform_int", [](BenchState & state) { BM_prep_waveform_int(state, 1.0); }, waveformLength},
+		{"prep_waveform_int_scaled", [](BenchState & state) { BM_prep_waveform_int(state, 0.8); }, waveformLength},
+		{"pack_sequence", BM_pack_sequence, 4096},
+		{"pack_sequence", BM_pack_sequence, sequenceLength},
+		{"pack_data", BM_pack_data, waveformLength / 2},
+		{"pack_data", BM_pack_data, 2 * sequenceLength},
+		{"serialize", BM_serialize, waveformLength / 2},
+		{"serialize_into", BM_serialize_into, waveformLength / 2},
+		{"simulate_sequence", BM_simulate_sequence, 1 << 20},
+	};
+
+	if (!json) {
+		print_title("BBN APS2 Host Side Microbenchmarks");
+		cout << "Waveform packing kernel: " << waveform_pack_kernel() << endl << endl;
+		cout << std::left << std::setw(34) << "Benchmark" << std::right << std::setw(14) << "Time" <<
+			std::setw(12) << "Iterations" << std::setw(16) << "Items/s" << std::setw(14) << "MB/s" << endl;
+		cout << string(90, '-') << endl;
+	}
+	else {
+		cout << "{\n  \"benchmarks\": [";
+	}
+
+	bool first = true;
+	for (auto & bench : benchmarks) {
+		string fullName = bench.name + "/" + std::to_string(bench.arg);
+		if (fullName.find(filter) == string::npos) {
+			continue;
+		}
+		BenchState state = run_benchmark(bench, minTime);
+		double perIteration = state.elapsed() / state.iterations();
+		double itemsPerSecond = state.itemsProcessed / perIteration;
+		double MBPerSecond = state.bytesProcessed / perIteration / (1 << 20);
+		if (!json) {
+			cout << std::left << std::setw(34) << fullName << std::right << std::setw(14) << format_time(perIteration) <<
+				std::setw(12) << state.iterations() << std::setw(16) << std::scientific << std::setprecision(3) << itemsPerSecond <<
+				std::setw(14) << std::fixed << std::setprecision(1) << MBPerSecond << endl;
+		}
+		else {
+			cout << (first ? "\n" : ",\n") << std::setprecision(6) << "    {\"name\": \"" << fullName << "\", \"iterations\": " <<
+				state.iterations() << ", \"time_ns\": " << perIteration * 1e9 << ", \"items_per_second\": " <<
+				itemsPerSecond << ", \"bytes_per_second\": " << state.bytesProcessed / perIteration << "}";
+		}
+		first = false;
+	}
+
+	if (json) {
+		cout << "\n  ]\n}" << endl;
+	}
+
+	return 0;
+}
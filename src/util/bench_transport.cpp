@@ -0,0 +1,350 @@
+/*
+Benchmarks the host<->APS2 transport and writes the results as JSON so they can be compared between releases.
+
+For every combination of payload size and write acknowledge interval it measures bulk write and read throughput,
+first on one device and then on all the selected devices at once. It also measures the round trip latency of
+single register reads, the latency of software triggers and the time init_APS takes. Works against hardware
+or aps2_emulator, e.g.
+
+  aps2_emulator --numDevices=4 &
+  APS2_SHARE_PORT=1 bench_transport --numDevices=4 --sizes=65536,4194304 --ackIntervals=1,20,50 --output=transport.json
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+#include "headings.h"
+#include "libaps2.h"
+
+#include "../C++/helpers.h"
+#include "../C++/optionparser.h"
+
+enum  optionIndex { UNKNOWN, HELP, SIZES, ACK_INTERVALS, WRITE_WINDOW_OPT, READ_WINDOW_OPT, NUM_DEVICES, REPEATS,
+                    NUM_READS, NUM_TRIGGERS, NUM_INITS, OUTPUT, LOG_LEVEL};
+const option::Descriptor usage[] =
+{
+	{UNKNOWN, 0,"" , ""    , option::Arg::None, "USAGE: bench_transport [options]\n\n"
+	                                         "Options:" },
+	{HELP,    0,"" , "help", option::Arg::None, "  --help  \tPrint usage and exit." },
+	{SIZES, 0,"", "sizes", option::Arg::Required, "  --sizes  \t(optional) Comma separated bulk transfer sizes in bytes (default=4096,65536,1048576,4194304)." },
+	{ACK_INTERVALS, 0,"", "ackIntervals", option::Arg::Required, "  --ackIntervals  \t(optional) Comma separated packets per write acknowledge (default=library default)." },
+	{WRITE_WINDOW_OPT, 0,"", "writeWindow", option::Arg::Numeric, "  --writeWindow  \t(optional) Write chunks kept in flight (default=library default)." },
+	{READ_WINDOW_OPT, 0,"", "readWindow", option::Arg::Numeric, "  --readWindow  \t(optional) Read requests kept in flight (default=library default)." },
+	{NUM_DEVICES, 0,"", "numDevices", option::Arg::Numeric, "  --numDevices  \t(optional) Number of enumerated devices to use; 0 for all (default=1)." },
+	{REPEATS, 0,"", "repeats", option::Arg::Numeric, "  --repeats  \t(optional) Repeats of each bulk transfer (default=5)." },
+	{NUM_READS, 0,"", "numReads", option::Arg::Numeric, "  --numReads  \t(optional) Single register reads for the latency percentiles (default=10000)." },
+	{NUM_TRIGGERS, 0,"", "numTriggers", option::Arg::Numeric, "  --numTriggers  \t(optional) Software triggers to time (default=1000)." },
+	{NUM_INITS, 0,"", "numInits", option::Arg::Numeric, "  --numInits  \t(optional) Forced init_APS calls to time; 0 to skip (default=1)." },
+	{OUTPUT, 0,"", "output", option::Arg::Required, "  --output  \t(optional) File to write the JSON results to (default=bench_transport.json)." },
+	{LOG_LEVEL,  0,"", "logLevel", option::Arg::Numeric, "  --logLevel  \t(optional) Logging level level to print to console (optional; default=1/WARNING)." },
+	{UNKNOWN, 0,"" ,  ""   , option::Arg::None, "\nExamples:\n"
+	                                         "  bench_transport\n"
+	                                         "  bench_transport --sizes=1024,1048576 --ackIntervals=1,5,20,50 --output=transport.json\n"
+	                                         "  bench_transport --numDevices=0 --numInits=0\n" },
+	{0,0,0,0,0,0}
+};
+
+//Bulk transfers go to the start of the sequence DRAM and latency reads to a register the host never caches
+static const uint32_t BENCH_MEMORY_ADDR = MEMORY_ADDR;
+static const uint32_t LATENCY_REGISTER = PLL_STATUS_ADDR;
+
+vector<size_t> parse_list(const char * arg) {
+	vector<size_t> values;
+	std::stringstream ss(arg);
+	string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			values.push_back(std::stoul(item));
+		}
+	}
+	return values;
+}
+
+//Summary statistics of a set of timings in microseconds
+struct Timings {
+	vector<double> samples;
+
+	void add(std::chrono::steady_clock::duration duration) {
+		samples.push_back(std::chrono::duration<double, std::micro>(duration).count());
+	}
+
+	double percentile(double pct) {
+		std::sort(samples.begin(), samples.end());
+		size_t idx = std::min(samples.size() - 1, static_cast<size_t>(pct / 100 * samples.size()));
+		return samples[idx];
+	}
+
+	double mean() const {
+		return std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+	}
+
+	string json() {
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3) << "{\"count\": " << samples.size() << ", \"mean_us\": " << mean() <<
+			", \"min_us\": " << percentile(0) << ", \"p50_us\": " << percentile(50) << ", \"p99_us\": " << percentile(99) <<
+			", \"p99.9_us\": " << percentile(99.9) << ", \"max_us\": " << samples.back() << "}";
+		return out.str();
+	}
+};
+
+//Run func on every device at once and time until the last one finishes; func is passed the device index
+APS2_STATUS time_devices(const vector<string> & serials, std::function<APS2_STATUS(size_t)> func, Timings & timings) {
+	vector<APS2_STATUS> statuses(serials.size(), APS2_OK);
+	vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t ct = 0; ct < serials.size(); ct++) {
+		threads.emplace_back([&, ct]() { statuses[ct] = func(ct); });
+	}
+	for (auto & thread : threads) {
+		thread.join();
+	}
+	timings.add(std::chrono::steady_clock::now() - start);
+	for (auto status : statuses) {
+		if (status != APS2_OK) return status;
+	}
+	return APS2_OK;
+}
+
+//Bulk write and read throughput for one transfer size and acknowledge interval on a set of devices
+string bench_throughput(const vector<string> & serials, size_t numBytes, size_t ackInterval, unsigned writeWindow,
+	                    unsigned readWindow, unsigned repeats) {
+
+	for (auto & serial : serials) {
+		set_transfer_window(serial.c_str(), ackInterval, writeWindow, readWindow);
+	}
+
+	std::mt19937 generator(numBytes);
+	std::uniform_int_distribution<uint32_t> wordDistribution;
+	vector<uint32_t> writeData(numBytes / 4);
+	std::generate(writeData.begin(), writeData.end(), [&]() { return wordDistribution(generator); });
+	vector<vector<uint32_t>> readData(serials.size(), vector<uint32_t>(writeData.size()));
+
+	Timings writeTimings, readTimings;
+	bool verified = true;
+	for (unsigned ct = 0; ct < repeats; ct++) {
+		APS2_STATUS status = time_devices(serials, [&](size_t idx) {
+			return write_memory(serials[idx].c_str(), BENCH_MEMORY_ADDR, writeData.data(), writeData.size());
+		}, writeTimings);
+		if (status != APS2_OK) {
+			throw status;
+		}
+		status = time_devices(serials, [&](size_t idx) {
+			return read_memory(serials[idx].c_str(), BENCH_MEMORY_ADDR, readData[idx].data(), readData[idx].size());
+		}, readTimings);
+		if (status != APS2_OK) {
+			throw status;
+		}
+		for (auto & data : readData) {
+			verified &= (data == writeData);
+		}
+	}
+
+	//Throughput is over all devices and quoted for the median repeat
+	double totalMB = static_cast<double>(numBytes * serials.size()) / (1 << 20);
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3) << "{\"devices\": " << serials.size() << ", \"bytes\": " << numBytes <<
+		", \"ack_interval\": " << ackInterval << ", \"write_window\": " << writeWindow << ", \"read_window\": " << readWindow <<
+		", \"write_MBps\": " << totalMB / (writeTimings.percentile(50) / 1e6) <<
+		", \"read_MBps\": " << totalMB / (readTimings.percentile(50) / 1e6) <<
+		", \"write\": " << writeTimings.json() << ", \"read\": " << readTimings.json() <<
+		", \"verified\": " << (verified ? "true" : "false") << "}";
+	return out.str();
+}
+
+string bench_register_latency(const string & serial, unsigned numReads) {
+	Timings timings;
+	uint32_t regVal;
+	for (unsigned ct = 0; ct < numReads; ct++) {
+		auto start = std::chrono::steady_clock::now();
+		APS2_STATUS status = read_register(serial.c_str(), LATENCY_REGISTER, &regVal);
+		timings.add(std::chrono::steady_clock::now() - start);
+		if (status != APS2_OK) {
+			throw status;
+		}
+	}
+	return timings.json();
+}
+
+string bench_trigger_latency(const string & serial, unsigned numTriggers) {
+	TRIGGER_SOURCE oldSource;
+	get_trigger_source(serial.c_str(), &oldSource);
+	set_trigger_source(serial.c_str(), SOFTWARE);
+	Timings timings;
+	for (unsigned ct = 0; ct < numTriggers; ct++) {
+		auto start = std::chrono::steady_clock::now();
+		APS2_STATUS status = trigger(serial.c_str());
+		timings.add(std::chrono::steady_clock::now() - start);
+		if (status != APS2_OK) {
+			throw status;
+		}
+	}
+	set_trigger_source(serial.c_str(), oldSource);
+	return timings.json();
+}
+
+string bench_init(const string & serial, unsigned numInits) {
+	Timings timings;
+	for (unsigned ct = 0; ct < numInits; ct++) {
+		auto start = std::chrono::steady_clock::now();
+		APS2_STATUS status = init_APS(serial.c_str(), 1);
+		timings.add(std::chrono::steady_clock::now() - start);
+		if (status != APS2_OK) {
+			throw status;
+		}
+	}
+	return timings.json();
+}
+
+string timestamp() {
+	std::time_t now = std::time(nullptr);
+	char buf[32];
+	std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+	return string(buf);
+}
+
+int main(int argc, char* argv[])
+{
+	print_title("BBN APS2 Transport Benchmark");
+
+	argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+	option::Stats  stats(usage, argc, argv);
+	option::Option *options = new option::Option[stats.options_max];
+	option::Option *buffer = new option::Option[stats.buffer_max];
+	option::Parser parse(usage, argc, argv, options, buffer);
+
+	if (parse.error())
+	 return -1;
+
+	if (options[HELP]) {
+		option::printUsage(std::cout, usage);
+		return 0;
+	}
+
+	for (option::Option* opt = options[UNKNOWN]; opt; opt = opt->next())
+	 std::cout << "Unknown option: " << opt->name << "\n";
+
+	//Logging level
+	TLogLevel logLevel = logWARNING;
+	if (options[LOG_LEVEL]) {
+		logLevel = TLogLevel(atoi(options[LOG_LEVEL].arg));
+	}
+	set_logging_level(logLevel);
+	set_log("stdout");
+
+	vector<size_t> sizes = options[SIZES] ? parse_list(options[SIZES].arg) : vector<size_t>{4096, 65536, 1048576, 4194304};
+	vector<size_t> ackIntervals = options[ACK_INTERVALS] ? parse_list(options[ACK_INTERVALS].arg) : vector<size_t>{WRITE_ACK_INTERVAL};
+	unsigned writeWindow = options[WRITE_WINDOW_OPT] ? atoi(options[WRITE_WINDOW_OPT].arg) : WRITE_WINDOW;
+	unsigned readWindow = options[READ_WINDOW_OPT] ? atoi(options[READ_WINDOW_OPT].arg) : READ_WINDOW;
+	string outputFile = options[OUTPUT] ? options[OUTPUT].arg : "bench_transport.json";
+	unsigned numDevices = options[NUM_DEVICES] ? atoi(options[NUM_DEVICES].arg) : 1;
+	unsigned repeats = options[REPEATS] ? std::max(atoi(options[REPEATS].arg), 1) : 5;
+	unsigned numReads = options[NUM_READS] ? std::max(atoi(options[NUM_READS].arg), 1) : 10000;
+	unsigned numTriggers = options[NUM_TRIGGERS] ? std::max(atoi(options[NUM_TRIGGERS].arg), 1) : 1000;
+	unsigned numInits = options[NUM_INITS] ? atoi(options[NUM_INITS].arg) : 1;
+
+	//Transfers are whole words
+	for (auto & size : sizes) {
+		size = std::max<size_t>(size & ~static_cast<size_t>(3), 4);
+	}
+
+	cout << concol::CYAN << "Enumerating devices" << concol::RESET << endl;
+	unsigned numFound = 0;
+	get_numDevices(&numFound);
+	if (numFound < 1) {
+		cout << concol::RED << "No APS2 devices connected! Exiting..." << concol::RESET << endl;
+		return -1;
+	}
+	vector<const char*> serialBuffer(numFound);
+	get_deviceSerials(serialBuffer.data());
+	vector<string> serials(serialBuffer.begin(), serialBuffer.end());
+	std::sort(serials.begin(), serials.end());
+	if (numDevices == 0 || numDevices > numFound) {
+		numDevices = numFound;
+	}
+	serials.resize(numDevices);
+
+	std::ostringstream json;
+	try {
+		for (auto & serial : serials) {
+			if (connect_APS(serial.c_str()) != APS2_OK) {
+				throw APS2_FAILED_TO_CONNECT;
+			}
+			stop(serial.c_str());
+		}
+
+		vector<string> firmwareVersions;
+		for (auto & serial : serials) {
+			uint32_t version;
+			get_firmware_version(serial.c_str(), &version);
+			std::ostringstream ss;
+			ss << "\"0x" << std::hex << version << "\"";
+			firmwareVersions.push_back(ss.str());
+		}
+
+		json << "{\n  \"benchmark\": \"bench_transport\",\n  \"timestamp\": \"" << timestamp() << "\",\n";
+		json << "  \"devices\": [";
+		for (size_t ct = 0; ct < serials.size(); ct++) {
+			json << (ct ? ", " : "") << "{\"serial\": \"" << serials[ct] << "\", \"firmware\": " << firmwareVersions[ct] << "}";
+		}
+		json << "],\n";
+
+		if (numInits > 0) {
+			cout << concol::CYAN << "Timing init_APS" << concol::RESET << endl;
+			json << "  \"init_APS\": " << bench_init(serials[0], numInits) << ",\n";
+		}
+
+		cout << concol::CYAN << "Timing " << numReads << " register reads" << concol::RESET << endl;
+		json << "  \"register_latency\": " << bench_register_latency(serials[0], numReads) << ",\n";
+
+		cout << concol::CYAN << "Timing " << numTriggers << " software triggers" << concol::RESET << endl;
+		json << "  \"trigger_latency\": " << bench_trigger_latency(serials[0], numTriggers) << ",\n";
+
+		//Single device first and then the whole set if there is more than one
+		vector<vector<string>> deviceSets = {{serials[0]}};
+		if (serials.size() > 1) {
+			deviceSets.push_back(serials);
+		}
+		json << "  \"throughput\": [";
+		bool first = true;
+		for (auto & deviceSet : deviceSets) {
+			for (auto ackInterval : ackIntervals) {
+				for (auto size : sizes) {
+					cout << concol::CYAN << "Timing " << size << " byte transfers to " << deviceSet.size() <<
+						" device" << (deviceSet.size() > 1 ? "s" : "") << " with an acknowledge every " << ackInterval <<
+						" packets" << concol::RESET << endl;
+					json << (first ? "\n    " : ",\n    ") <<
+						bench_throughput(deviceSet, size, ackInterval, writeWindow, readWindow, repeats);
+					first = false;
+				}
+			}
+		}
+		json << "\n  ]\n}\n";
+
+		for (auto & serial : serials) {
+			disconnect_APS(serial.c_str());
+		}
+	}
+	catch (APS2_STATUS status) {
+		cout << concol::RED << "Benchmark failed: " << get_error_msg(status) << concol::RESET << endl;
+		return -1;
+	}
+
+	std::ofstream outFile(outputFile);
+	outFile << json.str();
+	if (!outFile) {
+		cout << concol::RED << "Unable to write results to " << outputFile << concol::RESET << endl;
+		return -1;
+	}
+	cout << concol::GREEN << "Results written to " << outputFile << concol::RESET << endl;
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+Convert HDF5 sequence files to the binary sequence format.
+
+The binary files hold the waveform and instruction data already laid out as APS2 memory words and are loaded by
+load_sequence_file without going through HDF5. See doc/formats.rst for the layout.
+*/
+
+#include <iostream>
+
+#include "headings.h"
+#include "libaps2.h"
+
+#include "../C++/helpers.h"
+#include "../C++/optionparser.h"
+
+enum  optionIndex { UNKNOWN, HELP, INPUT_FILE, OUTPUT_FILE, LOG_LEVEL};
+const option::Descriptor usage[] =
+{
+	{UNKNOWN, 0,"" , ""    , option::Arg::None, "USAGE: convert_sequence [options]\n\n"
+	                                         "Options:" },
+	{HELP,    0,"" , "help", option::Arg::None, "  --help  \tPrint usage and exit." },
+	{INPUT_FILE, 0,"", "input", option::Arg::Required, "  --input  \tHDF5 sequence file to convert." },
+	{OUTPUT_FILE, 0,"", "output", option::Arg::Required, "  --output  \t(optional) Binary sequence file to write (default=input with the extension replaced by .aps2)." },
+	{LOG_LEVEL,  0,"", "logLevel", option::Arg::Numeric, "  --logLevel  \t(optional) Logging level level to print to console (optional; default=2/INFO)." },
+	{UNKNOWN, 0,"" ,  ""   , option::Arg::None, "\nExamples:\n"
+	                                         "  convert_sequence --input=ramsey.h5\n"
+	                                         "  convert_sequence --input=ramsey.h5 --output=/tmp/ramsey.aps2\n" },
+	{0,0,0,0,0,0}
+};
+
+int main(int argc, char* argv[])
+{
+	print_title("BBN APS2 Sequence File Converter");
+
+	argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+	option::Stats  stats(usage, argc, argv);
+	option::Option *options = new option::Option[stats.options_max];
+	option::Option *buffer = new option::Option[stats.buffer_max];
+	option::Parser parse(usage, argc, argv, options, buffer);
+
+	if (parse.error())
+	 return -1;
+
+	if (options[HELP] || !options[INPUT_FILE]) {
+		option::printUsage(std::cout, usage);
+		return 0;
+	}
+
+	for (option::Option* opt = options[UNKNOWN]; opt; opt = opt->next())
+	 std::cout << "Unknown option: " << opt->name << "\n";
+
+	//Logging level
+	TLogLevel logLevel = logINFO;
+	if (options[LOG_LEVEL]) {
+		logLevel = TLogLevel(atoi(options[LOG_LEVEL].arg));
+	}
+	set_logging_level(logLevel);
+	set_log("stdout");
+
+	string input(options[INPUT_FILE].arg);
+	string output;
+	if (options[OUTPUT_FILE]) {
+		output = options[OUTPUT_FILE].arg;
+	}
+	else {
+		size_t dot = input.find_last_of('.');
+		size_t slash = input.find_last_of("/\\");
+		output = (dot != string::npos && (slash == string::npos || dot > slash) ? input.substr(0, dot) : input) + ".aps2";
+	}
+
+	APS2_STATUS status = convert_sequence_file(input.c_str(), output.c_str());
+	if (status != APS2_OK) {
+		cout << concol::RED << "Conversion failed: " << get_error_msg(status) << concol::RESET << endl;
+		return -1;
+	}
+	cout << concol::GREEN << "Wrote " << output << concol::RESET << endl;
+
+	return 0;
+}
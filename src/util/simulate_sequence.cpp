@@ -0,0 +1,190 @@
+/*
+Simulate what an APS2 will output for a sequence file without any hardware.
+
+Runs the sequence through SequenceSimulator one trigger at a time and reports the length of each shot, any triggers
+missed at the requested trigger interval and a hash of each output so runs can be compared in regression tests.
+The rendered samples can also be written out as CSV. Exits with 1 if any trigger was missed.
+*/
+
+#include <iostream>
+#include <chrono>
+
+#include "headings.h"
+#include "libaps2.h"
+#include "SequenceSimulator.h"
+#include "BinarySequence.h"
+#include "ContentHash.h"
+
+#include "../C++/helpers.h"
+#include "../C++/optionparser.h"
+
+enum  optionIndex { UNKNOWN, HELP, SEQ_FILE, NUM_TRIGGERS, TRIG_INTERVAL, CMP_VALUES, OUTPUT_FILE, LOG_LEVEL};
+const option::Descriptor usage[] =
+{
+	{UNKNOWN, 0,"" , ""    , option::Arg::None, "USAGE: simulate_sequence [options]\n\n"
+	                                         "Options:" },
+	{HELP,    0,"" , "help", option::Arg::None, "  --help  \tPrint usage and exit." },
+	{SEQ_FILE, 0,"", "file", option::Arg::Required, "  --file  \tHDF5 or binary sequence file to simulate." },
+	{NUM_TRIGGERS, 0,"", "triggers", option::Arg::Numeric, "  --triggers  \t(optional) Number of triggers to simulate (default=1)." },
+	{TRIG_INTERVAL, 0,"", "triggerInterval", option::Arg::Numeric, "  --triggerInterval  \t(optional) Trigger period in samples; 0 triggers as soon as the sequence is waiting (default=0)." },
+	{CMP_VALUES, 0,"", "cmp", option::Arg::Required, "  --cmp  \t(optional) Comma separated comparison register values for successive triggers (default=0)." },
+	{OUTPUT_FILE, 0,"", "output", option::Arg::Required, "  --output  \t(optional) Write the rendered samples to this CSV file." },
+	{LOG_LEVEL,  0,"", "logLevel", option::Arg::Numeric, "  --logLevel  \t(optional) Logging level level to print to console (optional; default=2/INFO)." },
+	{UNKNOWN, 0,"" ,  ""   , option::Arg::None, "\nExamples:\n"
+	                                         "  simulate_sequence --file=ramsey.h5\n"
+	                                         "  simulate_sequence --file=ramsey.aps2 --triggers=100 --triggerInterval=120000\n"
+	                                         "  simulate_sequence --file=feedback.h5 --triggers=4 --cmp=0,1,1,0 --output=feedback.csv\n" },
+	{0,0,0,0,0,0}
+};
+
+void read_sequence_file(const string & fileName, vector<int16_t> & wfA, vector<int16_t> & wfB, vector<uint64_t> & instructions) {
+	if (BinarySequence::is_binary_sequence(fileName)) {
+		BinarySequence sequence(fileName);
+		vector<uint8_t> markers;
+		wfA = sequence.read_waveform(0, markers);
+		wfB = sequence.read_waveform(1, markers);
+		instructions.resize(sequence.numInstructions);
+		sequence.read_instructions(0, instructions.size(), instructions.data());
+		return;
+	}
+	try {
+		H5::H5File H5SeqFile(fileName, H5F_ACC_RDONLY);
+		wfA = h5array2vector<int16_t>(&H5SeqFile, "chan_1/waveforms", H5::PredType::NATIVE_INT16);
+		wfB = h5array2vector<int16_t>(&H5SeqFile, "chan_2/waveforms", H5::PredType::NATIVE_INT16);
+		instructions = h5array2vector<uint64_t>(&H5SeqFile, "chan_1/instructions", H5::PredType::NATIVE_UINT64);
+		H5SeqFile.close();
+	}
+	catch (H5::Exception & e) {
+		throw APS2_SEQFILE_FAIL;
+	}
+}
+
+vector<uint8_t> parse_cmp_values(const string & arg) {
+	vector<uint8_t> values;
+	std::istringstream stream(arg);
+	string value;
+	while (std::getline(stream, value, ',')) {
+		values.push_back(uint8_t(atoi(value.c_str())));
+	}
+	return values;
+}
+
+int main(int argc, char* argv[])
+{
+	print_title("BBN APS2 Sequence Simulator");
+
+	argc-=(argc>0); argv+=(argc>0); // skip program name argv[0] if present
+	option::Stats  stats(usage, argc, argv);
+	option::Option *options = new option::Option[stats.options_max];
+	option::Option *buffer = new option::Option[stats.buffer_max];
+	option::Parser parse(usage, argc, argv, options, buffer);
+
+	if (parse.error())
+	 return -1;
+
+	if (options[HELP] || !options[SEQ_FILE]) {
+		option::printUsage(std::cout, usage);
+		return 0;
+	}
+
+	for (option::Option* opt = options[UNKNOWN]; opt; opt = opt->next())
+	 std::cout << "Unknown option: " << opt->name << "\n";
+
+	//Logging level
+	TLogLevel logLevel = logINFO;
+	if (options[LOG_LEVEL]) {
+		logLevel = TLogLevel(atoi(options[LOG_LEVEL].arg));
+	}
+	set_logging_level(logLevel);
+	set_log("stdout");
+
+	uint64_t numTriggers = options[NUM_TRIGGERS] ? strtoull(options[NUM_TRIGGERS].arg, nullptr, 10) : 1;
+
+	vector<int16_t> wfA, wfB;
+	vector<uint64_t> instructions;
+	try {
+		read_sequence_file(options[SEQ_FILE].arg, wfA, wfB, instructions);
+	}
+	catch (APS2_STATUS status) {
+		cout << concol::RED << "Unable to read sequence file: " << get_error_msg(status) << concol::RESET << endl;
+		return -1;
+	}
+	cout << "Sequence has " << instructions.size() << " instructions and " << wfA.size() << "/" << wfB.size() << " waveform samples" << endl;
+
+	SequenceSimulator simulator(instructions, wfA, wfB);
+	if (options[TRIG_INTERVAL]) {
+		simulator.set_trigger_interval(strtoull(options[TRIG_INTERVAL].arg, nullptr, 10));
+	}
+	if (options[CMP_VALUES]) {
+		simulator.set_comparison_values(parse_cmp_values(options[CMP_VALUES].arg));
+	}
+
+	std::ofstream csv;
+	if (options[OUTPUT_FILE]) {
+		csv.open(options[OUTPUT_FILE].arg);
+		csv << "sample,analog A,analog B,marker 1,marker 2,marker 3,marker 4\n";
+	}
+
+	/*
+	 * Run a trigger at a time and clear the output in between so long sequences do not have to fit in memory.
+	 * The first run renders up to the first WAIT; every run after covers one shot.
+	 */
+	uint64_t hashes[6] = {0};
+	uint64_t numSamples = 0;
+	double simTime = 0;
+	SIMULATION_STOP stop = STOP_TRIGGER_LIMIT;
+	for (uint64_t shot = 0; shot <= numTriggers && stop == STOP_TRIGGER_LIMIT; shot++) {
+		auto start = std::chrono::steady_clock::now();
+		try {
+			stop = simulator.run(shot == 0 ? 0 : 1);
+		}
+		catch (APS2_STATUS status) {
+			cout << concol::RED << "Simulation failed: " << get_error_msg(status) << concol::RESET << endl;
+			return -1;
+		}
+		simTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		size_t shotLength = simulator.get_analog(0).size();
+		for (int ch = 0; ch < 2; ch++) {
+			const vector<int16_t> & samples = simulator.get_analog(ch);
+			hashes[ch] = content_hash(samples.data(), samples.size()*sizeof(int16_t), hashes[ch]);
+		}
+		for (int marker = 0; marker < 4; marker++) {
+			const vector<uint8_t> & samples = simulator.get_marker(marker);
+			hashes[2 + marker] = content_hash(samples.data(), samples.size(), hashes[2 + marker]);
+		}
+		if (csv.is_open()) {
+			for (size_t ct = 0; ct < shotLength; ct++) {
+				csv << simulator.output_start() + ct << "," << simulator.get_analog(0)[ct] << "," << simulator.get_analog(1)[ct];
+				for (int marker = 0; marker < 4; marker++) {
+					csv << "," << int(ct < simulator.get_marker(marker).size() ? simulator.get_marker(marker)[ct] : 0);
+				}
+				csv << "\n";
+			}
+		}
+		if (shot > 0) {
+			FILE_LOG(logDEBUG) << "Shot " << shot << " triggered at sample " << simulator.trigger_times().front() << " is " << shotLength << " samples long";
+		}
+		numSamples += shotLength;
+		simulator.clear_output();
+	}
+
+	if (stop == STOP_SEQUENCE_END) {
+		cout << concol::YELLOW << "Sequence ran off the end of instruction memory" << concol::RESET << endl;
+	}
+	else if (stop == STOP_INSTRUCTION_LIMIT) {
+		cout << concol::YELLOW << "Gave up waiting for a WAIT; the sequence may loop forever" << concol::RESET << endl;
+	}
+
+	cout << "Simulated " << simulator.stats.triggers << " triggers, " << simulator.stats.instructions << " instructions and " <<
+		numSamples << " samples in " << simTime << " s (" << simulator.stats.instructions / simTime << " instructions/s, " <<
+		numSamples / simTime << " samples/s)" << endl;
+	cout << "Missed triggers: " << simulator.stats.missedTriggers << "  Prefetches: " << simulator.stats.prefetches <<
+		"  Max stack depth: " << simulator.stats.maxStackDepth << endl;
+	const char * names[6] = {"analog A", "analog B", "marker 1", "marker 2", "marker 3", "marker 4"};
+	for (int ct = 0; ct < 6; ct++) {
+		cout << names[ct] << " hash: " << std::hex << std::setw(16) << std::setfill('0') << hashes[ct] << std::dec << endl;
+	}
+
+	return simulator.stats.missedTriggers > 0 ? 1 : 0;
+}
@@ -9,6 +9,8 @@ Runs a read/write test to confirm communications integrity.
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <numeric>
 
 #include "libaps2.h"
 #include "../C++/helpers.h"
@@ -51,6 +53,22 @@ void run_test(string deviceSerial, string memArea, uint32_t memStartAddr, uint32
 	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop-start).count();
 	cout << " at " << static_cast<double>(testLength)/duration << " MB/s." << concol::RESET << endl;
 
+	//Read the whole block back
+	cout << "reading " << std::dec << testLength/1024 << " kB starting at " << hexn<8> << testStartAddr << " ..... ";
+	cout.flush();
+	vector<uint32_t> readVec(testVec.size());
+	start = std::chrono::steady_clock::now();
+	read_memory(deviceSerial.c_str(), testStartAddr, readVec.data(), readVec.size());
+	stop = std::chrono::steady_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::microseconds>(stop-start).count();
+	cout << " at " << static_cast<double>(testLength)/duration << " MB/s.....";
+	if (readVec == testVec) {
+		cout << concol::GREEN << " passed" << concol::RESET << endl;
+	}
+	else {
+		cout << concol::RED << " failed" << concol::RESET << endl;
+	}
+
 	//Check a few 1kB count entries for correctness
 	addrDistribution = std::uniform_int_distribution<uint32_t>(testStartAddr, testStartAddr+testLength-1024);
 	for (size_t ct=0; ct < 10; ct++){
@@ -77,6 +95,28 @@ void run_test(string deviceSerial, string memArea, uint32_t memStartAddr, uint32
 }
 
 
+void run_latency_test(string deviceSerial, size_t numReads){
+	//Time single word register reads to measure the host<->APS2 round trip
+	cout << endl;
+	cout << concol::CYAN << "Testing register round-trip latency:" << concol::RESET << endl;
+	cout << "reading " << std::dec << numReads << " single registers ..... ";
+	cout.flush();
+
+	vector<double> latencies;
+	latencies.reserve(numReads);
+	uint32_t regVal;
+	for (size_t ct=0; ct < numReads; ct++){
+		auto start = std::chrono::steady_clock::now();
+		read_register(deviceSerial.c_str(), 0, &regVal);
+		auto stop = std::chrono::steady_clock::now();
+		latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop-start).count()/1e3);
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+	cout << "mean " << mean << " us; median " << latencies[latencies.size()/2] << " us; max " << latencies.back() << " us." << endl;
+}
+
+
 int main(int argc, char const *argv[])
 {
 	print_title("BBN APS2 Communications Test");
@@ -110,11 +150,7 @@ int main(int argc, char const *argv[])
 		idx += writeSize;
 	}
 	inData.resize(idx);
-	idx = 0;
-	while (idx < inData.size()){
-		read_memory(deviceSerial.c_str(),  idx*4, inData.data()+idx, 128);
-		idx += 128;
-	}
+	read_memory(deviceSerial.c_str(), 0, inData.data(), inData.size());
 
 	bool passed = true;
 	for (unsigned ct=0; ct<inData.size(); ct++){
@@ -128,6 +164,8 @@ int main(int argc, char const *argv[])
 	}
 
 
+	run_latency_test(deviceSerial, 1000);
+
 	run_test(deviceSerial, "sequence", 0, 0x1FFFFFFFu, 4*(1<<20));
 	run_test(deviceSerial, "waveform", 0x20000000u, 0x3FFFFFFFu, 4*(1<<20));
 	run_test(deviceSerial, "sequence cache", 0xC2000000u, 0xC2007FFF, 8*(1<<10));